@@ -0,0 +1,162 @@
+// neodymium_aot: recompiles a program ahead of time into a shared object neodymium runs with
+// --native (see modules/recompiler.h and modules/native.h).
+//
+//   neodymium_aot [--verify] [--max-instructions N] [--quiet] INPUT.bin OUTPUT
+//
+// OUTPUT ending in .cpp gets the source, anything else is built with $CXX (c++ if it isn't set).
+// --verify runs the program in the interpreter and on the shared object, and only keeps the output
+// if both leave the machine the same.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "modules/cfg.h"
+#include "modules/cpu.h"
+#include "modules/errors.h"
+#include "modules/native.h"
+#include "modules/recompiler.h"
+#include "modules/snapshot.h"
+
+#define AOT_MAX_INSTRUCTIONS (1ull << 32) // --verify gives up on programs running longer than this
+#define AOT_FLAGS "-O2 -shared -fPIC"
+
+static std::vector<byte> read_image(const char* path)
+{
+    struct stat buffer;
+    if (stat(path, &buffer) != 0) raise(Errors::FILE_NOT_FOUND);
+    if (buffer.st_size > RAM_SIZE) raise(Errors::FILE_TOO_BIG);
+
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) raise(Errors::ERROR_OPENING_FILE);
+    std::vector<byte> image(buffer.st_size);
+    size_t read = fread(image.data(), 1, image.size(), file);
+    fclose(file);
+    if (read != image.size()) raise(Errors::ERROR_OPENING_FILE);
+    return image;
+}
+
+static bool write_file(const char* path, const std::string& text)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) return false;
+    bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+    return fclose(file) == 0 && written;
+}
+
+static bool ends_with(const char* text, const char* end)
+{
+    size_t a = strlen(text), b = strlen(end);
+    return a >= b && strcmp(text + a - b, end) == 0;
+}
+
+// How a run ended, and the whole machine it left
+struct Outcome {
+    int result;         // Halt code, -1 if it didn't halt
+    const char* error;  // Set if it faulted
+    uint64_t instructions;
+    Snapshot machine;
+};
+
+// native: the shared object to run on, the interpreter without one
+static void run(const std::vector<byte>& image, const char* native, uint64_t max_instructions, Outcome& o)
+{
+    o.result = -1;
+    o.error = nullptr;
+    CPU* cpu = new CPU();
+    for (size_t i = 0; i < image.size(); i++) cpu->ram.write(i, image[i]);
+    if (native != nullptr) {
+        Errors error;
+        cpu->native = new NativeEngine(cpu);
+        if (!cpu->native->load(native, error)) raise(error);
+        cpu->engine = Engine::NATIVE;
+    }
+
+    try {
+        while (o.result == -1 && cpu->retired < max_instructions) o.result = cpu->execute(1 << 20);
+    }
+    catch (VMFault& f) {
+        o.error = error_message(f.code);
+    }
+    o.instructions = cpu->retired;
+    o.machine.take(cpu);
+    delete cpu;
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* input = nullptr;
+    const char* output = nullptr;
+    bool verify = false;
+    bool quiet = false;
+    uint64_t max_instructions = AOT_MAX_INSTRUCTIONS;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+
+        if (strcmp(arg, "--verify") == 0) verify = true;
+        else if (strcmp(arg, "--quiet") == 0) quiet = true;
+        else if (strcmp(arg, "--max-instructions") == 0 && i + 1 < argc) max_instructions = strtoull(argv[++i], nullptr, 10);
+        else if (arg[0] != '-' && input == nullptr) input = arg;
+        else if (arg[0] != '-' && output == nullptr) output = arg;
+        else {
+            input = nullptr;
+            break;
+        }
+    }
+    if (input == nullptr || output == nullptr) {
+        fprintf(stderr, "Usage: %s [--verify] [--max-instructions N] [--quiet] INPUT.bin OUTPUT\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<byte> image = read_image(input);
+    ControlFlow flow(image.data(), image.size(), true);
+    Recompiler recompiler(flow);
+    std::string source = recompiler.source();
+    if (!quiet) printf("Compiled: %d blocks, %d instructions\n", recompiler.blocks, recompiler.instructions);
+
+    if (ends_with(output, ".cpp")) {
+        if (!write_file(output, source)) raise(Errors::ERROR_OPENING_FILE);
+        if (verify) fprintf(stderr, "Nothing to verify, only the source was written\n");
+        return 0;
+    }
+
+    std::string temporary = std::string(output) + ".cpp";
+    if (!write_file(temporary.c_str(), source)) raise(Errors::ERROR_OPENING_FILE);
+    const char* compiler = getenv("CXX");
+    std::string command = std::string(compiler != nullptr && compiler[0] != '\0' ? compiler : "c++")
+        + " " AOT_FLAGS " -o '" + output + "' '" + temporary + "'";
+    int status = system(command.c_str());
+    unlink(temporary.c_str());
+    if (status != 0) {
+        fprintf(stderr, "Couldn't build the shared object: %s\n", command.c_str());
+        return 1;
+    }
+
+    if (verify) {
+        Outcome before, after;
+        run(image, nullptr, max_instructions, before);
+        run(image, output, max_instructions, after);
+
+        if (before.result == -1 && before.error == nullptr) {
+            fprintf(stderr, "Can't verify, the program didn't halt in %llu instructions\n", (unsigned long long)max_instructions);
+            unlink(output);
+            return 1;
+        }
+        if (before.result != after.result || before.error != after.error || !before.machine.same(after.machine)) {
+            fprintf(stderr, "The native code doesn't end the same way, nothing written\n");
+            unlink(output);
+            return 1;
+        }
+        if (!quiet) {
+            if (before.error != nullptr) printf("Verified: faults (%s)", before.error);
+            else printf("Verified: halts with %d", before.result);
+            printf(" after %llu instructions\n", (unsigned long long)before.instructions);
+        }
+    }
+    return 0;
+}
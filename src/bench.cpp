@@ -0,0 +1,588 @@
+// neodymium_bench: times every opcode family and a few example programs on each engine.
+//
+//   neodymium_bench [--engine NAME]... [--filter TEXT] [--min-time SECONDS] [--output FILE.csv]
+//   neodymium_bench --scaling CORES [--engine NAME]... [--min-time SECONDS]
+//   neodymium_bench --write-examples DIR
+//   neodymium_bench --verify-tables
+//
+// The CSV has one row per benchmark and engine, so runs of two versions can be diffed.
+// Every engine has to end each program with the same result, or the run fails.
+// --scaling runs a program sharing its work out between 1, 2, 4... up to CORES cores instead.
+// --verify-tables checks the compile-time DIV/PWR/SQRT/FSQRT tables against the host math.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "modules/alu.h"
+#include "modules/cores.h"
+#include "modules/cpu.h"
+#include "modules/errors.h"
+
+#define BENCH_MIN_TIME      0.2             // Seconds of runs per benchmark and engine
+#define BENCH_BODY          64              // Copies of the measured instructions per loop iteration
+#define BENCH_MAX_RETIRED   (1ull << 32)    // A program that runs longer than this is broken
+#define BENCH_ITEMS         200             // Work items --scaling shares out, fewer than 256 - MAX_CORES
+
+// Just enough of an assembler for the programs below. Addresses are written high byte first.
+struct Program {
+    std::vector<byte> code;
+
+    uint16_t here() const { return code.size(); }
+    void emit(std::initializer_list<byte> bytes) { for (byte b : bytes) code.push_back(b); }
+    void emit_address(uint16_t address) { emit({(byte)(address >> 8), (byte)address}); }
+
+    // A jump or call to target, returns where its address is so a forward target can be patched
+    size_t jump(byte opcode, uint16_t target = 0) {
+        emit({opcode});
+        size_t at = code.size();
+        emit_address(target);
+        return at;
+    }
+    void patch(size_t at, uint16_t target) {
+        code[at] = target >> 8;
+        code[at + 1] = target;
+    }
+};
+
+// Runs body iterations * outer times. $5, $6 and $7 are the loop's, $6 has to stay 0.
+// INC only sets flags when it wraps, so CMP $6, #0 clears the overflow left by the body first.
+static void counted_loop(Program& p, int outer, const std::function<void(Program&)>& body)
+{
+    p.emit({0x02, 0x05, (byte)(256 - outer)});   // MOV $5, #256-outer
+    p.emit({0x02, 0x06, 0x00});                  // MOV $6, #0
+    uint16_t outer_loop = p.here();
+    p.emit({0x02, 0x07, 0x00});                  // MOV $7, #0
+    uint16_t inner_loop = p.here();
+    body(p);
+    p.emit({0x22, 0x06, 0x00});                  // CMP $6, #0
+    p.emit({0x42, 0x07});                        // INC $7
+    p.jump(0x2e, inner_loop);                    // JNO inner_loop
+    p.emit({0x22, 0x06, 0x00});                  // CMP $6, #0
+    p.emit({0x42, 0x05});                        // INC $5
+    p.jump(0x2e, outer_loop);                    // JNO outer_loop
+}
+
+// BENCH_BODY instructions cycling through forms
+static void repeat(Program& p, const std::vector<std::vector<byte>>& forms)
+{
+    for (int i = 0; i < BENCH_BODY; i++) {
+        const std::vector<byte>& form = forms[i % forms.size()];
+        p.code.insert(p.code.end(), form.begin(), form.end());
+    }
+}
+
+static Program opcode_mov()
+{
+    Program p;
+    p.emit({0x02, 0x02, 0x40});                  // MOV $2, #0x40
+    counted_loop(p, 64, [](Program& p) {
+        repeat(p, {
+            {0x01, 0x01, 0x02},                  // MOV $1, $2
+            {0x02, 0x03, 0x07},                  // MOV $3, #7
+            {0x03, 0x04, 0x40, 0x10},            // MOV $4, [0x4010]
+            {0x04, 0x01, 0x03, 0x02},            // MOV $1, [$3, $2]
+        });
+    });
+    p.emit({0xfd, 0x01});                        // HALT $1
+    return p;
+}
+
+static Program opcode_logic()
+{
+    Program p;
+    counted_loop(p, 64, [](Program& p) {
+        repeat(p, {
+            {0x10, 0x01},                        // NOT $1
+            {0x11, 0x02, 0x01},                  // AND $2, $1
+            {0x12, 0x01, 0x5a},                  // AND $1, #0x5a
+        });
+    });
+    p.emit({0xfd, 0x01});
+    return p;
+}
+
+static Program opcode_arithmetic()
+{
+    Program p;
+    counted_loop(p, 64, [](Program& p) {
+        repeat(p, {
+            {0x40, 0x01, 0x03},                  // ADD $1, #3
+            {0x41, 0x02, 0x01},                  // ADD $2, $1
+            {0x43, 0x03, 0x01},                  // SUB $3, #1
+            {0x44, 0x04, 0x02},                  // SUB $4, $2
+            {0x42, 0x01},                        // INC $1
+            {0x45, 0x02},                        // DEC $2
+            {0x46, 0x03, 0x03},                  // MUL $3, #3
+            {0x47, 0x04, 0x03},                  // MUL $4, $3
+            {0x22, 0x01, 0x09},                  // CMP $1, #9
+            {0x23, 0x01, 0x02},                  // CMP $1, $2
+        });
+    });
+    p.emit({0xfd, 0x01});
+    return p;
+}
+
+static Program opcode_divide()
+{
+    Program p;
+    p.emit({0x02, 0x03, 0x02});                  // MOV $3, #2 (PWR faults on 0)
+    p.emit({0x02, 0x04, 0x05});                  // MOV $4, #5 (MOD faults on 0)
+    counted_loop(p, 64, [](Program& p) {
+        repeat(p, {
+            {0x02, 0x01, 0xc8},                  // MOV $1, #200
+            {0x48, 0x01, 0x03},                  // DIV $1, #3
+            {0x49, 0x01, 0x04},                  // DIV $1, $4
+            {0x4f, 0x01, 0x07},                  // MOD $1, #7
+            {0x4e, 0x02, 0x04},                  // MOD $2, $4
+            {0x4a, 0x03, 0x01},                  // PWR $3, #1
+            {0x4c, 0x01},                        // SQRT $1
+            {0x4d, 0x02},                        // FSQRT $2
+        });
+    });
+    p.emit({0xfd, 0x01});
+    return p;
+}
+
+static Program opcode_jump()
+{
+    Program p;
+    counted_loop(p, 64, [](Program& p) {
+        // Every jump goes to the next instruction, taken or not
+        static const byte jumps[] = {0x20, 0x24, 0x26, 0x28, 0x2a, 0x2c, 0x2e};
+        for (int i = 0; i < BENCH_BODY; i++) {
+            size_t at = p.jump(jumps[i % sizeof(jumps)]);
+            p.patch(at, p.here());
+        }
+    });
+    p.emit({0xfe, 0x00});                        // HALT #0
+    return p;
+}
+
+static Program opcode_call()
+{
+    Program p;
+    std::vector<size_t> calls;
+    counted_loop(p, 64, [&](Program& p) {
+        for (int i = 0; i < BENCH_BODY / 2; i++) calls.push_back(p.jump(0x50)); // CALL function
+    });
+    p.emit({0xfe, 0x00});
+    uint16_t function = p.here();
+    p.emit({0x52});                              // RET
+    for (size_t at : calls) p.patch(at, function);
+    return p;
+}
+
+static Program opcode_stack()
+{
+    Program p;
+    counted_loop(p, 64, [](Program& p) {
+        repeat(p, {
+            {0x30, 0x01},                        // PUSH $1
+            {0x31, 0x03},                        // PUSH #3
+            {0x32, 0x02},                        // POP $2
+            {0x32, 0x01},                        // POP $1
+        });
+    });
+    p.emit({0xfd, 0x02});
+    return p;
+}
+
+static Program opcode_store()
+{
+    Program p;
+    p.emit({0x02, 0x02, 0x40});                  // MOV $2, #0x40
+    p.emit({0x02, 0x03, 0x20});                  // MOV $3, #0x20
+    counted_loop(p, 64, [](Program& p) {
+        repeat(p, {
+            {0x60, 0x02, 0x03, 0x01},            // STORE [$2, $3], $1
+            {0x61, 0x40, 0x21, 0x01},            // STORE [0x4021], $1
+            {0x62, 0x02, 0x03, 0x09},            // STORE [$2, $3], #9
+            {0x63, 0x40, 0x22, 0x0a},            // STORE [0x4022], #10
+        });
+    });
+    p.emit({0x03, 0x01, 0x40, 0x22});            // MOV $1, [0x4022]
+    p.emit({0xfd, 0x01});
+    return p;
+}
+
+static Program opcode_atomic()
+{
+    Program p;
+    p.emit({0x02, 0x02, 0x40});                  // MOV $2, #0x40
+    p.emit({0x02, 0x03, 0x20});                  // MOV $3, #0x20
+    p.emit({0x02, 0x01, 0x01});                  // MOV $1, #1
+    counted_loop(p, 64, [](Program& p) {
+        repeat(p, {
+            {0x65, 0x02, 0x03, 0x01},            // XADD [$2, $3], $1
+            {0x64, 0x02, 0x03, 0x04},            // CAS [$2, $3], $4
+        });
+    });
+    p.emit({0x03, 0x01, 0x40, 0x20});            // MOV $1, [0x4020]
+    p.emit({0xfd, 0x01});
+    return p;
+}
+
+// Three nested counters with nothing else in them
+static Program workload_loop()
+{
+    Program p;
+    p.emit({0x02, 0x03, 0x00});                  // MOV $3, #0
+    counted_loop(p, 64, [](Program& p) {
+        uint16_t loop = p.here();
+        p.emit({0x42, 0x03});                    // INC $3
+        p.jump(0x2e, loop);                      // JNO loop
+        p.emit({0x22, 0x06, 0x00});              // CMP $6, #0
+    });
+    p.emit({0xfd, 0x03});
+    return p;
+}
+
+// Fills 0x4000-0x7fff a byte at a time, 256 times over
+static Program workload_fill()
+{
+    Program p;
+    counted_loop(p, 1, [](Program& p) {
+        p.emit({0x02, 0x02, 0x40});              // MOV $2, #0x40
+        uint16_t page = p.here();
+        p.emit({0x02, 0x03, 0x00});              // MOV $3, #0
+        p.emit({0x22, 0x06, 0x00});              // CMP $6, #0
+        uint16_t bytes = p.here();
+        p.emit({0x60, 0x02, 0x03, 0x01});        // STORE [$2, $3], $1
+        p.emit({0x42, 0x03});                    // INC $3
+        p.jump(0x2e, bytes);                     // JNO bytes
+        p.emit({0x42, 0x01});                    // INC $1
+        p.emit({0x42, 0x02});                    // INC $2
+        p.emit({0x01, 0x04, 0x02});              // MOV $4, $2
+        p.emit({0x22, 0x04, 0x80});              // CMP $4, #0x80, overflows once $2 gets to 0x80
+        p.jump(0x2e, page);                      // JNO page
+    });
+    p.emit({0x03, 0x01, 0x7f, 0xff});            // MOV $1, [0x7fff]
+    p.emit({0xfd, 0x01});
+    return p;
+}
+
+// Recursion 60 calls deep, with a register saved on the stack at each level
+static Program workload_recursion()
+{
+    Program p;
+    size_t call;
+    counted_loop(p, 32, [&](Program& p) {
+        p.emit({0x02, 0x01, 60});                // MOV $1, #60
+        call = p.jump(0x50);                     // CALL function
+    });
+    p.emit({0xfd, 0x02});
+    uint16_t function = p.here();
+    p.patch(call, function);
+    p.emit({0x22, 0x01, 0x00});                  // CMP $1, #0
+    size_t done = p.jump(0x24);                  // JZ done
+    p.emit({0x30, 0x01});                        // PUSH $1
+    p.emit({0x45, 0x01});                        // DEC $1
+    p.emit({0x40, 0x02, 0x01});                  // ADD $2, #1
+    p.jump(0x50, function);                      // CALL function
+    p.emit({0x32, 0x01});                        // POP $1
+    p.patch(done, p.here());
+    p.emit({0x52});                              // RET
+    return p;
+}
+
+// Draws a moving gradient into the framebuffer (0xa000), 16x16 pixels per frame
+static Program workload_framebuffer()
+{
+    Program p;
+    p.emit({0x02, 0x02, 0xa0});                  // MOV $2, #0xa0
+    p.emit({0x02, 0x01, 0x00});                  // MOV $1, #0 (frame)
+    counted_loop(p, 64, [](Program& p) {
+        // $7 is the pixel, the loop's inner counter
+        p.emit({0x01, 0x03, 0x07});              // MOV $3, $7
+        p.emit({0x41, 0x03, 0x01});              // ADD $3, $1
+        p.emit({0x12, 0x03, 0x0f});              // AND $3, #0x0f
+        p.emit({0x60, 0x02, 0x07, 0x03});        // STORE [$2, $7], $3
+    });
+    p.emit({0x03, 0x01, 0xa0, 0x11});            // MOV $1, [0xa011]
+    p.emit({0xfd, 0x01});
+    return p;
+}
+
+// For --scaling: every core takes work items from a counter at 0x4000 with XADD until there are
+// none left, then counts itself done at 0x4001. Core 0 waits for all of them and halts with 0.
+static Program workload_parallel()
+{
+    Program p;
+    p.emit({0x02, 0x02, 0x40});                  // MOV $2, #0x40
+    p.emit({0x02, 0x03, 0x00});                  // MOV $3, #0
+    uint16_t take = p.here();
+    p.emit({0x02, 0x01, 0x01});                  // MOV $1, #1
+    p.emit({0x65, 0x02, 0x03, 0x01});            // XADD [$2, $3], $1
+    p.emit({0x22, 0x01, 256 - BENCH_ITEMS});     // CMP $1, #256-items, overflows once they're all taken
+    size_t done = p.jump(0x2c);                  // JO done
+    counted_loop(p, 4, [](Program& p) {
+        repeat(p, {
+            {0x40, 0x04, 0x03},                  // ADD $4, #3
+            {0x46, 0x04, 0x05},                  // MUL $4, #5
+        });
+    });
+    p.jump(0x20, take);                          // JMP take
+    p.patch(done, p.here());
+
+    p.emit({0x02, 0x03, 0x01});                  // MOV $3, #1
+    p.emit({0x02, 0x01, 0x01});                  // MOV $1, #1
+    p.emit({0x65, 0x02, 0x03, 0x01});            // XADD [$2, $3], $1
+    p.emit({0x03, 0x04, 0xd2, 0x00});            // MOV $4, [CORE_ID]
+    p.emit({0x22, 0x04, 0x00});                  // CMP $4, #0
+    size_t first = p.jump(0x24);                 // JZ first
+    p.emit({0xfe, 0x00});                        // HALT #0
+    p.patch(first, p.here());
+
+    // Done once 0x4001 + (256 - cores) overflows
+    p.emit({0x03, 0x05, 0xd2, 0x01});            // MOV $5, [CORE_COUNT]
+    p.emit({0x10, 0x05});                        // NOT $5
+    p.emit({0x40, 0x05, 0x01});                  // ADD $5, #1
+    uint16_t wait = p.here();
+    p.emit({0x04, 0x01, 0x03, 0x02});            // MOV $1, [$3, $2]
+    p.emit({0x23, 0x01, 0x05});                  // CMP $1, $5
+    p.jump(0x2e, wait);                          // JNO wait
+    p.emit({0xfe, 0x00});                        // HALT #0
+    return p;
+}
+
+struct Benchmark {
+    const char* name;
+    const char* kind;
+    Program (*build)();
+};
+
+static const Benchmark benchmarks[] = {
+    {"mov",         "opcode",   opcode_mov},
+    {"logic",       "opcode",   opcode_logic},
+    {"arithmetic",  "opcode",   opcode_arithmetic},
+    {"divide",      "opcode",   opcode_divide},
+    {"jump",        "opcode",   opcode_jump},
+    {"call",        "opcode",   opcode_call},
+    {"stack",       "opcode",   opcode_stack},
+    {"store",       "opcode",   opcode_store},
+    {"atomic",      "opcode",   opcode_atomic},
+    {"loop",        "workload", workload_loop},
+    {"fill",        "workload", workload_fill},
+    {"recursion",   "workload", workload_recursion},
+    {"framebuffer", "workload", workload_framebuffer},
+};
+
+struct Measurement {
+    uint64_t instructions;
+    double seconds;
+    int runs;
+    int result;         // Halt code of the last run, or -1
+    const char* error;  // Set if the program faulted or never halted
+};
+
+static Measurement measure(const Program& program, Engine engine, double min_time)
+{
+    Measurement m = {0, 0, 0, -1, nullptr};
+
+    while (m.runs == 0 || m.seconds < min_time) {
+        CPU* cpu = new CPU();
+        for (size_t i = 0; i < program.code.size(); i++) cpu->ram.write(i, program.code[i]);
+        cpu->engine = engine;
+
+        int result = -1;
+        auto start = std::chrono::steady_clock::now();
+        try {
+            while (result == -1 && cpu->retired < BENCH_MAX_RETIRED) result = cpu->execute(1 << 20);
+        }
+        catch (VMFault& f) {
+            m.error = error_message(f.code);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (result == -1 && m.error == nullptr) m.error = "Didn't halt.";
+        m.result = result;
+        m.instructions += cpu->retired;
+        m.seconds += elapsed.count();
+        m.runs++;
+        delete cpu;
+
+        if (m.error != nullptr) break;
+    }
+    return m;
+}
+
+// Runs of workload_parallel on cores cores, instructions are all of theirs
+static Measurement measure_cores(const Program& program, Engine engine, int count, double min_time)
+{
+    Measurement m = {0, 0, 0, -1, nullptr};
+
+    while (m.runs == 0 || m.seconds < min_time) {
+        CPU* cpu = new CPU();
+        for (size_t i = 0; i < program.code.size(); i++) cpu->ram.write(i, program.code[i]);
+        cpu->engine = engine;
+        Cores* cores = new Cores(cpu, count);
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+            m.result = cores->run();
+        }
+        catch (VMFault& f) {
+            m.error = error_message(f.code);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        m.instructions += cores->retired();
+        m.seconds += elapsed.count();
+        m.runs++;
+        delete cores;
+        delete cpu;
+
+        if (m.result == -1 && m.error == nullptr) m.error = "Didn't halt.";
+        if (m.error != nullptr) break;
+    }
+    return m;
+}
+
+static const struct { const char* name; Engine engine; } engines[] = {
+    {"reference", Engine::REFERENCE},
+    {"decoded",   Engine::DECODED},
+    {"jit",       Engine::JIT},
+};
+
+static int write_examples(const char* dir)
+{
+    for (const Benchmark& b : benchmarks) {
+        if (strcmp(b.kind, "workload") != 0) continue;
+        std::string path = std::string(dir) + "/" + b.name + ".bin";
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr) raise(Errors::ERROR_OPENING_FILE);
+        Program p = b.build();
+        fwrite(p.code.data(), 1, p.code.size(), file);
+        fclose(file);
+        printf("%s (%zu bytes)\n", path.c_str(), p.code.size());
+    }
+    return 0;
+}
+
+// The same work on 1, 2, 4... cores, speedup is against one core of the same engine
+static int scaling(int max_cores, const std::vector<int>& selected, double min_time)
+{
+    Program program = workload_parallel();
+    printf("%-10s %5s %14s %9s %12s %8s\n", "engine", "cores", "instructions", "s/run", "M instr/s", "speedup");
+
+    int failures = 0;
+    for (int e : selected) {
+        double single = 0;
+        for (int count = 1; count <= max_cores; count = count * 2 > max_cores && count < max_cores ? max_cores : count * 2) {
+            Measurement m = measure_cores(program, engines[e].engine, count, min_time);
+            double per_run = m.seconds / m.runs;
+            if (count == 1) single = per_run;
+
+            printf("%-10s %5d %14llu %9.4f %12.1f %8.2f", engines[e].name, count,
+                (unsigned long long)(m.instructions / m.runs), per_run, m.instructions / m.seconds / 1e6, single / per_run);
+            if (m.error != nullptr) {
+                printf("  %s", m.error);
+                failures++;
+            }
+            printf("\n");
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, const char* argv[])
+{
+    std::vector<int> selected;
+    const char* filter = nullptr;
+    const char* output = nullptr;
+    double min_time = BENCH_MIN_TIME;
+    int max_cores = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+
+        if (strcmp(arg, "--engine") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            int found = -1;
+            for (int e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) {
+                if (strcmp(engines[e].name, name) == 0) found = e;
+            }
+            if (found == -1) raise(Errors::UNKNOWN_ENGINE);
+            selected.push_back(found);
+        }
+        else if (strcmp(arg, "--filter") == 0 && i + 1 < argc) filter = argv[++i];
+        else if (strcmp(arg, "--min-time") == 0 && i + 1 < argc) min_time = atof(argv[++i]);
+        else if (strcmp(arg, "--output") == 0 && i + 1 < argc) output = argv[++i];
+        else if (strcmp(arg, "--scaling") == 0 && i + 1 < argc) {
+            max_cores = atoi(argv[++i]);
+            if (max_cores < 1) max_cores = 1;
+            if (max_cores > MAX_CORES) max_cores = MAX_CORES;
+        }
+        else if (strcmp(arg, "--write-examples") == 0 && i + 1 < argc) return write_examples(argv[++i]);
+        else if (strcmp(arg, "--verify-tables") == 0) {
+            int mismatches = verify_alu_tables(stdout);
+            printf("%d table entries differ from the host math\n", mismatches);
+            return mismatches == 0 ? 0 : 1;
+        }
+        else {
+            fprintf(stderr, "Usage: %s [--engine reference|decoded|jit]... [--filter TEXT] [--min-time SECONDS] [--output FILE.csv]\n"
+                            "       %s --scaling CORES [--engine reference|decoded|jit]... [--min-time SECONDS]\n"
+                            "       %s --write-examples DIR\n"
+                            "       %s --verify-tables\n", argv[0], argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if (selected.empty()) {
+        for (int e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) selected.push_back(e);
+    }
+    if (max_cores > 0) return scaling(max_cores, selected, min_time);
+
+    FILE* csv = nullptr;
+    if (output != nullptr) {
+        csv = fopen(output, "w");
+        if (csv == nullptr) raise(Errors::ERROR_OPENING_FILE);
+        fprintf(csv, "benchmark,kind,engine,instructions,seconds,instructions_per_second,ns_per_instruction,result\n");
+    }
+
+    printf("%-12s %-9s %-10s %14s %9s %12s %9s %7s\n",
+        "benchmark", "kind", "engine", "instructions", "seconds", "M instr/s", "ns/instr", "result");
+
+    int failures = 0;
+    for (const Benchmark& b : benchmarks) {
+        if (filter != nullptr && strstr(b.name, filter) == nullptr) continue;
+        Program program = b.build();
+        int expected = -2;
+        uint64_t expected_instructions = 0;
+
+        for (int e : selected) {
+            Measurement m = measure(program, engines[e].engine, min_time);
+            double per_second = m.instructions / m.seconds;
+            double ns = m.seconds * 1e9 / m.instructions;
+
+            printf("%-12s %-9s %-10s %14llu %9.3f %12.1f %9.2f %7d", b.name, b.kind, engines[e].name,
+                (unsigned long long)m.instructions, m.seconds, per_second / 1e6, ns, m.result);
+            if (csv != nullptr) {
+                fprintf(csv, "%s,%s,%s,%llu,%.6f,%.0f,%.3f,%d\n", b.name, b.kind, engines[e].name,
+                    (unsigned long long)m.instructions, m.seconds, per_second, ns, m.result);
+            }
+
+            // Every engine has to agree with the first one
+            if (m.error != nullptr) {
+                printf("  %s", m.error);
+                failures++;
+            }
+            else if (expected == -2) {
+                expected = m.result;
+                expected_instructions = m.instructions / m.runs;
+            }
+            else if (m.result != expected || m.instructions / m.runs != expected_instructions) {
+                printf("  differs from %s", engines[selected[0]].name);
+                failures++;
+            }
+            printf("\n");
+        }
+    }
+
+    if (csv != nullptr) fclose(csv);
+    return failures == 0 ? 0 : 1;
+}
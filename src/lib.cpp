@@ -0,0 +1,126 @@
+// libneodymium: the C API in neodymium.h over a CPU. Every call catches what the VM throws, a fault
+// becomes the status of the run.
+
+#include <cstring>
+#include <new>
+
+#include "neodymium.h"
+#include "modules/cpu.h"
+#include "modules/errors.h"
+#include "modules/loader.h"
+
+struct neodymium_vm {
+    CPU cpu;
+    neodymium_status status;
+    int exit_code;
+    const char* error;
+
+    neodymium_vm(Engine engine) : status(NEODYMIUM_RUNNING), exit_code(-1), error(nullptr) { cpu.engine = engine; }
+
+    byte* reg(int r) // nullptr if there's no such register
+    {
+        if (r == NEODYMIUM_ALWAYS_ZERO) return &cpu.ALWAYS_ZERO;
+        return r >= 0 && r < REGISTERS ? &cpu.registers[r] : nullptr;
+    }
+};
+
+neodymium_vm* neodymium_create(neodymium_engine engine)
+{
+    Engine selected;
+    switch (engine) {
+        case NEODYMIUM_ENGINE_REFERENCE: selected = Engine::REFERENCE; break;
+        case NEODYMIUM_ENGINE_DECODED: selected = Engine::DECODED; break;
+        case NEODYMIUM_ENGINE_JIT: selected = Engine::JIT; break;
+        default: return nullptr;
+    }
+
+    try {
+        return new neodymium_vm(selected);
+    }
+    catch (std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void neodymium_destroy(neodymium_vm* vm)
+{
+    delete vm;
+}
+
+int neodymium_load(neodymium_vm* vm, const uint8_t* image, size_t size)
+{
+    Errors error;
+    if (!load_image(vm->cpu.ram, image, size, error)) return -1;
+    vm->cpu.ram.pc = 0;
+    return 0;
+}
+
+neodymium_status neodymium_run_for(neodymium_vm* vm, uint64_t budget)
+{
+    if (vm->status == NEODYMIUM_FAULTED) return vm->status;
+
+    try {
+        int res = vm->cpu.execute(budget);
+        if (res == -1) vm->status = NEODYMIUM_RUNNING;
+        else {
+            vm->status = NEODYMIUM_HALTED;
+            vm->exit_code = res;
+        }
+    }
+    catch (VMFault& f) {
+        vm->status = NEODYMIUM_FAULTED;
+        vm->error = error_message(f.code);
+    }
+    catch (std::bad_alloc&) {
+        vm->status = NEODYMIUM_FAULTED;
+        vm->error = "Out of memory.";
+    }
+    return vm->status;
+}
+
+neodymium_status neodymium_status_of(const neodymium_vm* vm) { return vm->status; }
+int neodymium_exit_code(const neodymium_vm* vm) { return vm->exit_code; }
+const char* neodymium_error(const neodymium_vm* vm) { return vm->error; }
+uint64_t neodymium_instructions(const neodymium_vm* vm) { return vm->cpu.retired; }
+
+uint8_t neodymium_get_register(neodymium_vm* vm, int reg)
+{
+    byte* r = vm->reg(reg);
+    return r != nullptr ? *r : 0;
+}
+
+void neodymium_set_register(neodymium_vm* vm, int reg, uint8_t value)
+{
+    byte* r = vm->reg(reg);
+    if (r != nullptr) *r = value;
+}
+
+uint16_t neodymium_get_pc(const neodymium_vm* vm) { return vm->cpu.ram.pc; }
+void neodymium_set_pc(neodymium_vm* vm, uint16_t pc) { vm->cpu.ram.pc = pc; }
+
+uint8_t neodymium_read(neodymium_vm* vm, uint16_t address)
+{
+    return vm->cpu.ram.get_from_address(address);
+}
+
+void neodymium_write(neodymium_vm* vm, uint16_t address, uint8_t value)
+{
+    vm->cpu.ram.write(address, value);
+}
+
+int neodymium_read_memory(neodymium_vm* vm, uint16_t address, uint8_t* out, size_t size)
+{
+    if (size > (size_t)RAM_SIZE - address) return -1;
+    if (size == 0) return 0;
+    if (vm->cpu.ram.plain(address, size)) memcpy(out, vm->cpu.ram.memory + address, size);
+    else for (size_t i = 0; i < size; i++) out[i] = vm->cpu.ram.get_from_address(address + i);
+    return 0;
+}
+
+int neodymium_write_memory(neodymium_vm* vm, uint16_t address, const uint8_t* data, size_t size)
+{
+    if (size > (size_t)RAM_SIZE - address) return -1;
+    if (size == 0) return 0;
+    for (size_t i = 0; i < size; i++) vm->cpu.ram.write(address + i, data[i]);
+    return 0;
+}
@@ -21,15 +21,18 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
-#if defined(K_UNIX)
-    #include <sys/stat.h>
-//#elif defined(K_NT)
-    // Include windows code here
-#endif
+#include <cstdlib>
+#include <chrono>
 
+#include "modules/batch.h"
 #include "modules/cpu.h"
 #include "modules/errors.h"
+#include "modules/loader.h"
+#include "modules/native.h"
+#include "modules/profiler.h"
 #include "modules/screen.h"
+#include "modules/snapshot.h"
+#include "modules/headless_display.h"
 
 int main(int argc, const char* argv[]) {
     
@@ -41,39 +44,164 @@ int main(int argc, const char* argv[]) {
     raise(Errors::OS_UNSUPPORTED);
     #endif
     
-    if (argc != 2) {
+    const char* file_name = nullptr;
+    bool print_stats = false;
+    bool profile = false;
+    const char* flamegraph_path = nullptr;
+    const char* restore_path = nullptr;
+    const char* snapshot_path = nullptr;
+    bool present_on_write = false;
+    bool rom = false;
+    const char* dump_path = nullptr;
+    const char* native_path = nullptr;
+    const char* ram_path = nullptr;
+    int core_count = 1;
+    #ifdef NEODYMIUM_GLFW
+    DisplayBackend backend = MACHINE.window ? DisplayBackend::GLFW : DisplayBackend::HEADLESS;
+    #else
+    DisplayBackend backend = DisplayBackend::HEADLESS;
+    #endif
+    uint32_t fps = DEFAULT_FPS;
+    Engine engine = Engine::REFERENCE;
+    const char* batch_source = nullptr;
+    BatchOptions batch = {0, Engine::REFERENCE, 0, 0, nullptr};
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+
+        if (strcmp(arg, "--version") == 0 || strcmp(arg, "-v") == 0){
+            printf("%s, %s machine\n", VERSION, MACHINE.name);
+            exit(0);
+        }
+        else if (strcmp(arg, "--stats") == 0) print_stats = true;
+        else if (strcmp(arg, "--profile") == 0) profile = true;
+        else if (strcmp(arg, "--flamegraph") == 0 && i + 1 < argc) {
+            flamegraph_path = argv[++i];
+            profile = true;
+        }
+        else if (strcmp(arg, "--restore") == 0 && i + 1 < argc) restore_path = argv[++i];
+        else if (strcmp(arg, "--snapshot") == 0 && i + 1 < argc) snapshot_path = argv[++i];
+        else if (strcmp(arg, "--present-on-write") == 0) present_on_write = true;
+        else if (strcmp(arg, "--rom") == 0) rom = true;
+        else if (strcmp(arg, "--headless") == 0) backend = DisplayBackend::HEADLESS;
+        else if (strcmp(arg, "--dump-frame") == 0 && i + 1 < argc) dump_path = argv[++i];
+        else if (strcmp(arg, "--engine") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "reference") == 0) engine = Engine::REFERENCE;
+            else if (strcmp(name, "decoded") == 0) engine = Engine::DECODED;
+            else if (strcmp(name, "jit") == 0) engine = Engine::JIT;
+            else raise(Errors::UNKNOWN_ENGINE);
+        }
+        else if (strcmp(arg, "--native") == 0 && i + 1 < argc) native_path = argv[++i];
+        else if (strcmp(arg, "--ram-file") == 0 && i + 1 < argc) ram_path = argv[++i];
+        else if (strcmp(arg, "--cores") == 0 && i + 1 < argc) {
+            core_count = atoi(argv[++i]);
+            if (core_count < 1) core_count = 1;
+            if (core_count > MAX_CORES) core_count = MAX_CORES;
+        }
+        else if (strcmp(arg, "--fps") == 0 && i + 1 < argc) fps = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(arg, "--batch") == 0 && i + 1 < argc) batch_source = argv[++i];
+        else if (strcmp(arg, "--jobs") == 0 && i + 1 < argc) batch.jobs = (unsigned)atoi(argv[++i]);
+        else if (strcmp(arg, "--output") == 0 && i + 1 < argc) batch.output = argv[++i];
+        else if (strcmp(arg, "--lockstep") == 0 && i + 1 < argc) batch.lanes = (unsigned)atoi(argv[++i]);
+        else if (strcmp(arg, "--max-instructions") == 0 && i + 1 < argc) batch.max_instructions = strtoull(argv[++i], nullptr, 10);
+        else file_name = arg;
+    }
+
+    if (batch_source != nullptr) {
+        batch.engine = engine;
+        return run_batch(batch_source, batch) == 0 ? 0 : 1;
+    }
+
+    if (file_name == nullptr && restore_path == nullptr && ram_path == nullptr) {
         raise(Errors::NO_FILE_ARG);
     }
-    const char* file_name = argv[1];
     
-    if (strcmp(file_name, "--version") == 0 || strcmp(file_name, "-v") == 0){
-        printf("%s\n", VERSION);
-        exit(0);
+    CPU cpu = CPU();
+    Errors error;
+    // What's in the file runs as it is, unless there's a program or snapshot to load into it
+    if (ram_path != nullptr && !load_ram_file(cpu.ram, ram_path, error)) raise(error);
+    if (restore_path != nullptr) {
+        Snapshot snapshot;
+        if (!snapshot.load(restore_path, error)) raise(error);
+        snapshot.restore(&cpu);
     }
-    
-    struct stat buffer;
-    if (stat(file_name, &buffer) != 0){
-        raise(Errors::FILE_NOT_FOUND);
+    else if (file_name != nullptr) {
+        uint32_t size;
+        if (!load_program(cpu.ram, file_name, error, &size)) raise(error);
+        if (rom) cpu.ram.protect(0, size);
     }
-    
-    if (buffer.st_size > 0x10000) {
-        raise(Errors::FILE_TOO_BIG);
+    if (native_path != nullptr) {
+        cpu.native = new NativeEngine(&cpu);
+        if (!cpu.native->load(native_path, error)) raise(error);
+        engine = Engine::NATIVE;
     }
     
-    std::ifstream in;
-    in.open(file_name, std::ios::in | std::ios::binary);
-    
-    if (!in.is_open()) {
-        raise(Errors::ERROR_OPENING_FILE);
+    cpu.screen.set_backend(backend);
+    // A pattern ("frame%d.png") dumps every presented frame in headless mode, a plain path only the last one
+    bool dump_every_frame = dump_path != nullptr && strchr(dump_path, '%') != nullptr;
+    if (dump_every_frame) {
+        const char* number = strstr(dump_path, "%d");
+        if (number == nullptr || number != strchr(dump_path, '%') || strchr(number + 1, '%') != nullptr
+            || backend != DisplayBackend::HEADLESS) {
+            raise(Errors::BAD_DUMP_PATTERN);
+        }
+        static_cast<HeadlessDisplay*>(cpu.screen.display)->dump_pattern = dump_path;
     }
-    
-    CPU cpu = CPU();
-    for (int i = 0; i < buffer.st_size; i++) {
-        byte b;
-        in.read((char*)&b, sizeof(b));
-        
-        cpu.ram.write(i, b);
+
+    cpu.engine = profile ? Engine::PROFILE : engine;
+    cpu.presenter.set_fps(fps);
+    if (present_on_write) cpu.presenter.mode = PresentMode::ON_WRITE;
+
+    Cores cores(&cpu, core_count);
+    auto start = std::chrono::steady_clock::now();
+    bool faulted = false;
+    bool closed = false;
+    Errors fault_code;
+    try {
+        closed = (core_count > 1 ? cores.run() : cpu.run()) == RUN_CLOSED;
     }
-    
-    cpu.run();
+    catch (VMFault& f) {
+        // Still report what ran, the profile of a crash is the interesting one
+        faulted = true;
+        fault_code = f.code;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (dump_path != nullptr && !dump_every_frame) {
+        cpu.screen.dump(dump_path);
+    }
+
+    if (print_stats) {
+        fprintf(stderr, "%llu instructions in %.3fs (%.0f instructions/s)\n",
+            (unsigned long long)cpu.retired, elapsed.count(), cpu.retired / elapsed.count());
+        cpu.report_engine(stderr);
+        if (core_count > 1) cores.report(stderr);
+    }
+
+    if (snapshot_path != nullptr) {
+        Snapshot snapshot;
+        snapshot.take(&cpu);
+        if (!snapshot.save(snapshot_path, error)) raise(error);
+    }
+
+    if (cpu.profiler != nullptr) {
+        cpu.profiler->report(stderr);
+
+        if (flamegraph_path != nullptr) {
+            FILE* out = fopen(flamegraph_path, "w");
+            if (out == nullptr) {
+                fprintf(stderr, "Can't write %s\n", flamegraph_path);
+            }
+            else {
+                cpu.profiler->write_collapsed(out);
+                fclose(out);
+            }
+        }
+    }
+
+    // Closing the window ends the run like before, once everything above was written
+    cpu.screen.terminate();
+    if (faulted) raise(fault_code);
+    if (closed) raise(Errors::SIGKILL);
 }
\ No newline at end of file
@@ -0,0 +1,159 @@
+#include "alu.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// This is an approximation (floored to 5.54 because there is no other ln from 0-254 like it, at most they are 5.53)
+#define BYTE_LN 5.54
+
+// Everything below is worked out with integers (and floats where the original used them), the
+// library math isn't constexpr. verify_alu_tables() checks the results match it bit for bit.
+
+namespace {
+
+constexpr AluResult number_result(int64_t num) // update_flags_with_number()
+{
+    byte flags = (num == 0 ? ALU_ZERO : 0) | (num < 0 ? ALU_UNDERFLOW : 0) | (num > 255 ? ALU_OVERFLOW : 0);
+    return {(byte)num, flags};
+}
+
+constexpr AluResult div_entry(int x, int y)
+{
+    // round(x / 0.0) doesn't fit an int64, the conversion gives INT64_MIN on x86: 0 and underflow
+    if (y == 0) return number_result(INT64_MIN);
+    return number_result((2 * x + y) / (2 * y)); // round(), halves away from zero
+}
+
+constexpr AluResult pwr_entry(int x, int y)
+{
+    if (x == 0 || y == 0) return {0, 0}; // Faults
+
+    // pow() is exact for these, and once past INT32_MAX the double comes out of the
+    // conversion to byte as 0 (it goes through a 32-bit int)
+    uint64_t power = 1;
+    for (int i = 0; i < y && power <= INT32_MAX; i++) power *= x;
+    byte value = power > INT32_MAX ? 0 : (byte)power;
+
+    // b*ln(a) > 5.54 is a**b > 254.68..., no power of a byte is anywhere near it
+    return {value, (byte)(power >= 255 ? ALU_OVERFLOW : 0)};
+}
+
+// IEEE single precision bits of a whole number up to 255
+constexpr uint32_t float_bits(int x)
+{
+    if (x == 0) return 0;
+    int exponent = 0;
+    while ((x >> (exponent + 1)) != 0) exponent++;
+    return (uint32_t)(127 + exponent) << 23 | (((uint32_t)x << (23 - exponent)) & 0x7fffff);
+}
+
+// The float a (normal) bit pattern stands for
+constexpr float bits_float(uint32_t bits)
+{
+    double value = 1.0 + (double)(bits & 0x7fffff) / (1 << 23);
+    for (int e = (int)(bits >> 23 & 0xff) - 127; e > 0; e--) value *= 2;
+    for (int e = (int)(bits >> 23 & 0xff) - 127; e < 0; e++) value /= 2;
+    return (bits >> 31) ? -(float)value : (float)value;
+}
+
+constexpr float round_float(float v) // round() of a positive float
+{
+    float whole = (float)(int64_t)v;
+    return v - whole >= 0.5F ? whole + 1 : whole;
+}
+
+constexpr AluResult sqrt_entry(int x) // CPU's Quake III inverse square root
+{
+    float x2 = (float)x * 0.5F;
+    int32_t i = (int32_t)float_bits(x);
+    i = 0x5f3759df - (i >> 1);
+    float y = bits_float((uint32_t)i);
+    y = y * (1.5F - (x2 * y * y));
+    return number_result((byte)round_float(1 / y));
+}
+
+constexpr AluResult fsqrt_entry(int x)
+{
+    int root = 0;
+    while ((root + 1) * (root + 1) <= x) root++;
+    return number_result(x - root * root > root ? root + 1 : root); // round(sqrt(x)), x is never a square and a half
+}
+
+template <int SIZE, typename Entry>
+constexpr AluTable<SIZE> generate(Entry entry)
+{
+    AluTable<SIZE> table = {};
+    for (int i = 0; i < SIZE; i++) table.entries[i] = entry(i);
+    return table;
+}
+
+}
+
+constexpr AluTable<0x10000> div_table = generate<0x10000>([](int i) { return div_entry(i >> 8, i & 0xff); });
+constexpr AluTable<0x10000> pwr_table = generate<0x10000>([](int i) { return pwr_entry(i >> 8, i & 0xff); });
+constexpr AluTable<0x100> sqrt_table = generate<0x100>(sqrt_entry);
+constexpr AluTable<0x100> fsqrt_table = generate<0x100>(fsqrt_entry);
+
+static AluResult host_flags(int64_t num, byte value)
+{
+    AluResult r = number_result(num);
+    r.value = value;
+    return r;
+}
+
+AluResult host_div(byte x, byte y)
+{
+    int64_t result = (int64_t)round((double)x / (double)y);
+    return host_flags(result, (byte)result);
+}
+
+AluResult host_pwr(byte x, byte y)
+{
+    double pow_size = (double)y * log((double)x); // a**b > 255 = b*ln(a) > ln(255)
+    double result = pow((double)x, (double)y);
+    return {(byte)result, pow_size > BYTE_LN ? (byte)ALU_OVERFLOW : (byte)0};
+}
+
+AluResult host_sqrt(byte x)
+{
+    // Thanks Quake III
+    int32_t i;
+    float x2, y;
+
+    x2 = (float)x * 0.5F;
+    y = (float)x;
+    memcpy(&i, &y, sizeof(i));
+    i = 0x5f3759df - (i >> 1);
+    memcpy(&y, &i, sizeof(y));
+    y = y * (1.5F - (x2 * y * y));
+
+    byte result = (byte)round(1/y);
+    return host_flags(result, result);
+}
+
+AluResult host_fsqrt(byte x)
+{
+    int64_t result = round(::sqrt((double)x));
+    return host_flags(result, (byte)result);
+}
+
+int verify_alu_tables(FILE* out)
+{
+    int mismatches = 0;
+    auto check = [&](const char* name, int x, int y, AluResult table, AluResult host) {
+        if (table.value == host.value && table.flags == host.flags) return;
+        if (mismatches++ < 20) {
+            fprintf(out, "%s %d, %d: table %d (flags %d), host %d (flags %d)\n", name, x, y, table.value, table.flags, host.value, host.flags);
+        }
+    };
+
+    for (int x = 0; x < 256; x++) {
+        for (int y = 0; y < 256; y++) {
+            check("DIV", x, y, div_table[x << 8 | y], host_div(x, y));
+            if (x != 0 && y != 0) check("PWR", x, y, pwr_table[x << 8 | y], host_pwr(x, y));
+        }
+        check("SQRT", x, 0, sqrt_table[x], host_sqrt(x));
+        check("FSQRT", x, 0, fsqrt_table[x], host_fsqrt(x));
+    }
+    return mismatches;
+}
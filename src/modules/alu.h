@@ -0,0 +1,41 @@
+#pragma once
+#include "def.h"
+#include <cstdio>
+
+// Flag bits of an AluResult
+#define ALU_ZERO        0x01
+#define ALU_UNDERFLOW   0x02
+#define ALU_OVERFLOW    0x04
+
+struct AluResult {
+    byte value;
+    byte flags;
+};
+
+template <int SIZE>
+struct AluTable {
+    AluResult entries[SIZE];
+    constexpr const AluResult& operator[](int i) const { return entries[i]; }
+};
+
+// DIV, PWR, SQRT and FSQRT for every operand, generated at compile time (see alu.cpp).
+// The two operand ones are indexed by x << 8 | y. PWR with a 0 faults before looking.
+extern const AluTable<0x10000> div_table;
+extern const AluTable<0x10000> pwr_table;
+extern const AluTable<0x100> sqrt_table;
+extern const AluTable<0x100> fsqrt_table;
+
+// The number CPU::update_flags_with_number() would have been given for these flags
+constexpr int64_t alu_flags_number(byte flags)
+{
+    return flags & ALU_ZERO ? 0 : flags & ALU_UNDERFLOW ? -1 : flags & ALU_OVERFLOW ? 256 : 1;
+}
+
+// The host math the tables replaced, to check them against
+AluResult host_div(byte x, byte y);
+AluResult host_pwr(byte x, byte y);
+AluResult host_sqrt(byte x);
+AluResult host_fsqrt(byte x);
+
+// Compares every entry with the host math, prints the ones that differ. Returns how many did.
+int verify_alu_tables(FILE* out);
@@ -0,0 +1,220 @@
+#include "batch.h"
+#include "loader.h"
+#include "lockstep.h"
+#include "pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define BATCH_CHUNK 0x100000 // Instructions per execute() call
+
+enum struct BatchStatus : byte {HALTED, FAULT, LIMIT, LOAD_ERROR};
+
+struct BatchResult {
+    std::string path;
+    BatchStatus status;
+    int code;                   // Halt code, or the error for FAULT/LOAD_ERROR
+    uint64_t instructions;
+    double seconds;
+};
+
+static const char* status_name(BatchStatus status) {
+    switch (status) {
+        case BatchStatus::HALTED:     return "halted";
+        case BatchStatus::FAULT:      return "fault";
+        case BatchStatus::LIMIT:      return "limit";
+        case BatchStatus::LOAD_ERROR: return "load-error";
+    }
+    return "?";
+}
+
+static bool ends_with(const std::string& s, const char* suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static std::vector<std::string> collect_programs(const char* source) {
+    std::vector<std::string> paths;
+
+    struct stat buffer;
+    if (stat(source, &buffer) != 0) raise(Errors::FILE_NOT_FOUND);
+
+    if (S_ISDIR(buffer.st_mode)) {
+        DIR* dir = opendir(source);
+        if (dir == nullptr) raise(Errors::ERROR_OPENING_FILE);
+
+        std::string base = source;
+        if (!ends_with(base, "/")) base += "/";
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (ends_with(name, ".bin")) paths.push_back(base + name);
+        }
+        closedir(dir);
+        std::sort(paths.begin(), paths.end()); // readdir order isn't stable between runs
+        return paths;
+    }
+
+    std::ifstream list(source);
+    if (!list.is_open()) raise(Errors::ERROR_OPENING_FILE);
+
+    std::string line;
+    while (std::getline(list, line)) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        paths.push_back(line);
+    }
+    return paths;
+}
+
+// Budget for the next chunk of a program that has run retired instructions, 0 once it hit the limit
+static uint64_t next_budget(const BatchOptions& options, uint64_t retired) {
+    if (options.max_instructions == 0) return BATCH_CHUNK;
+    if (retired >= options.max_instructions) return 0;
+    return std::min<uint64_t>(BATCH_CHUNK, options.max_instructions - retired);
+}
+
+static void run_one(const std::string& path, const BatchOptions& options, BatchResult& result) {
+    auto start = std::chrono::steady_clock::now();
+    result.path = path;
+    result.instructions = 0;
+    result.code = 0;
+
+    CPU* cpu = new CPU(); // 64K of RAM plus engine caches, keep it off the worker's stack
+    cpu->engine = options.engine;
+
+    Errors error;
+    if (!load_program(cpu->ram, path.c_str(), error)) {
+        result.status = BatchStatus::LOAD_ERROR;
+        result.code = (int)error;
+    }
+    else {
+        try {
+            while (true) {
+                uint64_t budget = next_budget(options, cpu->retired);
+                if (budget == 0) {
+                    result.status = BatchStatus::LIMIT;
+                    break;
+                }
+
+                int code = cpu->execute(budget);
+                if (code != -1) {
+                    result.status = BatchStatus::HALTED;
+                    result.code = code;
+                    break;
+                }
+            }
+        }
+        catch (VMFault& f) {
+            result.status = BatchStatus::FAULT;
+            result.code = (int)f.code;
+        }
+        result.instructions = cpu->retired;
+    }
+    delete cpu;
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+}
+
+// Same as run_one() for up to LANES programs at once, see lockstep.h
+template <int LANES>
+static void run_lockstep(const std::vector<std::string>& paths, size_t first, size_t count, const BatchOptions& options,
+    std::vector<BatchResult>& results) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<CPU*> cpus;
+    std::vector<size_t> indices;
+
+    for (size_t i = first; i < first + count; i++) {
+        BatchResult& result = results[i];
+        result.path = paths[i];
+        result.instructions = 0;
+        result.code = 0;
+
+        CPU* cpu = new CPU();
+        cpu->engine = options.engine; // For lanes that leave the group
+        Errors error;
+        if (!load_program(cpu->ram, paths[i].c_str(), error)) {
+            result.status = BatchStatus::LOAD_ERROR;
+            result.code = (int)error;
+            delete cpu;
+            continue;
+        }
+        cpus.push_back(cpu);
+        indices.push_back(i);
+    }
+
+    Lockstep<LANES>* lockstep = new Lockstep<LANES>(cpus.data(), cpus.size());
+    uint64_t retired = 0; // Same for every lane still running
+    while (uint64_t budget = next_budget(options, retired)) {
+        if (lockstep->execute(budget) == 0) break;
+        retired += budget;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    for (size_t l = 0; l < cpus.size(); l++) {
+        BatchResult& result = results[indices[l]];
+        LaneStatus status = lockstep->status[l];
+        result.status = status == LaneStatus::HALTED ? BatchStatus::HALTED
+                      : status == LaneStatus::FAULTED ? BatchStatus::FAULT : BatchStatus::LIMIT;
+        result.code = status == LaneStatus::RUNNING ? 0 : lockstep->code[l];
+        result.instructions = cpus[l]->retired;
+        result.seconds = elapsed.count(); // The whole group's
+    }
+
+    delete lockstep;
+    for (CPU* cpu : cpus) delete cpu;
+}
+
+int run_batch(const char* source, const BatchOptions& options) {
+    std::vector<std::string> paths = collect_programs(source);
+    std::vector<BatchResult> results(paths.size());
+
+    unsigned jobs = options.jobs;
+    if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        ThreadPool pool(std::min<size_t>(jobs, std::max<size_t>(paths.size(), 1)));
+        size_t lanes = std::min(options.lanes, 32u);
+        for (size_t i = 0; i < paths.size(); i += std::max<size_t>(lanes, 1)) {
+            size_t count = std::min(lanes, paths.size() - i);
+            if (lanes == 0) pool.submit([&, i]() { run_one(paths[i], options, results[i]); });
+            else if (lanes <= 8) pool.submit([&, i, count]() { run_lockstep<8>(paths, i, count, options, results); });
+            else if (lanes <= 16) pool.submit([&, i, count]() { run_lockstep<16>(paths, i, count, options, results); });
+            else pool.submit([&, i, count]() { run_lockstep<32>(paths, i, count, options, results); });
+        }
+        pool.wait();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    FILE* out = stdout;
+    if (options.output != nullptr) {
+        out = fopen(options.output, "w");
+        if (out == nullptr) raise(Errors::ERROR_OPENING_FILE);
+    }
+
+    int failed = 0;
+    uint64_t total = 0;
+    fprintf(out, "path,status,code,instructions,seconds,error\n");
+    for (BatchResult& r : results) {
+        const char* error = "";
+        if (r.status == BatchStatus::FAULT || r.status == BatchStatus::LOAD_ERROR) {
+            error = error_message((Errors)r.code);
+        }
+        // Paths go in quotes, the error messages have no commas
+        fprintf(out, "\"%s\",%s,%d,%llu,%.6f,%s\n", r.path.c_str(), status_name(r.status), r.code,
+            (unsigned long long)r.instructions, r.seconds, error);
+
+        if (r.status != BatchStatus::HALTED) failed++;
+        total += r.instructions;
+    }
+    if (out != stdout) fclose(out);
+
+    fprintf(stderr, "%zu programs, %d failed, %llu instructions in %.3fs on %u threads (%.0f instructions/s)\n",
+        results.size(), failed, (unsigned long long)total, elapsed.count(), jobs, total / elapsed.count());
+    return failed;
+}
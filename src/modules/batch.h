@@ -0,0 +1,15 @@
+#pragma once
+#include "def.h"
+#include "cpu.h"
+
+struct BatchOptions {
+    unsigned jobs;              // Worker threads, 0 = one per core
+    Engine engine;
+    uint64_t max_instructions;  // Per program, 0 = no limit
+    unsigned lanes;             // Programs per lockstep group (up to 32), 0 = every program on its own
+    const char* output;         // CSV summary, nullptr = stdout
+};
+
+// Runs every program in source (a directory of .bin files, or a file listing one path per line)
+// headless on its own VM. Returns how many programs didn't halt cleanly.
+int run_batch(const char* source, const BatchOptions& options);
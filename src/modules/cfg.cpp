@@ -0,0 +1,201 @@
+#include "cfg.h"
+#include "cpu.h"
+#include "opcodes.h"
+#include <algorithm>
+
+bool is_jump(byte opcode)
+{
+    return opcode == 0x20;
+}
+
+bool is_conditional_jump(byte opcode)
+{
+    return opcode >= 0x24 && opcode <= 0x2e && opcode % 2 == 0;
+}
+
+bool is_indirect_jump(byte opcode)
+{
+    return opcode == 0x21 || (opcode >= 0x25 && opcode <= 0x2f && opcode % 2 == 1) || opcode == 0x51;
+}
+
+bool is_terminator(byte opcode)
+{
+    return opcode == 0x20 || opcode == 0x21 || opcode == 0x52 || opcode >= 0xfd || opcode_operands(opcode) == nullptr;
+}
+
+bool has_address(byte opcode)
+{
+    const char* operands = opcode_operands(opcode);
+    for (const char* o = operands; o != nullptr && *o; o++) {
+        if (*o == 'A') return true;
+    }
+    return false;
+}
+
+bool valid_registers(const CodeInstruction& in)
+{
+    const char* operands = opcode_operands(in.opcode);
+    if (operands == nullptr) return true;
+
+    int at = 0;
+    for (const char* o = operands; *o; o++) {
+        if (*o == 'R' && in.operands[at] >= REGISTERS && in.operands[at] != 0xff) return false;
+        at += *o == 'A' ? 2 : 1;
+    }
+    return true;
+}
+
+ControlFlow::ControlFlow(const byte* image, size_t size, bool partial)
+    : image(image, image + size), marks(RAM_SIZE), index(RAM_SIZE, -1), problem(nullptr), problem_pc(0), partial(partial)
+{
+    walk();
+}
+
+const CodeInstruction* ControlFlow::at(uint16_t address) const
+{
+    return index[address] == -1 ? nullptr : &instructions[index[address]];
+}
+
+bool ControlFlow::reads_memory() const
+{
+    for (const CodeInstruction& in : instructions) {
+        if (in.opcode == 0x04 || in.opcode == 0x60 || in.opcode == 0x62 || in.opcode == 0x64 || in.opcode == 0x65) return true;
+        if (in.opcode == 0x03 && in.address < image.size()) return true;
+    }
+    return false;
+}
+
+void ControlFlow::fail(const char* reason, uint16_t pc)
+{
+    if (problem != nullptr || partial) return;
+    problem = reason;
+    problem_pc = pc;
+}
+
+void ControlFlow::walk()
+{
+    // The screen and the stack live past this, code there would be written over while it runs
+    if (image.size() > SCREEN_ADDRESS && !partial) {
+        fail("the image reaches the screen", SCREEN_ADDRESS);
+        return;
+    }
+
+    // A RET only goes back after a CALL if the stack holds what that CALL pushed: bytes pushed since
+    // the function started (depth) have to be popped on every path to it. Code is walked once, so
+    // every path to it has to agree on both.
+    struct Path {
+        uint16_t pc;
+        int depth;      // Bytes pushed since the function (or the program) started
+        bool called;    // In code a CALL got to, a RET there has somewhere to go
+    };
+    std::vector<Path> pending = {{0, 0, false}};
+    std::vector<int> depths(RAM_SIZE);
+    std::vector<bool> called(RAM_SIZE);
+    marks[0] |= CFG_LEADER;
+
+    while (!pending.empty() && problem == nullptr) {
+        uint32_t pc = pending.back().pc;
+        int depth = pending.back().depth;
+        bool in_call = pending.back().called;
+        pending.pop_back();
+
+        // Straight-line run until something that leaves or code already walked
+        while (problem == nullptr) {
+            if (pc >= image.size()) {
+                fail("runs past the end of the image", pc - 1);
+                break;
+            }
+            if (marks[pc] & CFG_INSTRUCTION) {
+                if (called[pc] != in_call) fail("runs the same code inside and outside of a CALL", pc);
+                else if (depths[pc] != depth) fail("doesn't leave the stack the same way on every path", pc);
+                break;
+            }
+            if (marks[pc] & CFG_OPERAND) {
+                fail("jumps into the middle of an instruction", pc);
+                break;
+            }
+
+            CodeInstruction in = {};
+            in.pc = pc;
+            in.opcode = image[pc];
+            in.length = instruction_length(in.opcode);
+            if (pc + in.length > image.size()) {
+                fail("runs past the end of the image", pc);
+                break;
+            }
+            bool overlap = false;
+            for (int i = 1; i < in.length; i++) {
+                if (marks[pc + i] & (CFG_INSTRUCTION | CFG_OPERAND)) overlap = true;
+                in.operands[i - 1] = image[pc + i];
+            }
+            if (overlap) {
+                fail("instructions overlap", pc);
+                if (partial) break;
+            }
+
+            // 16-bit immediates, high byte first
+            if (has_address(in.opcode)) {
+                int at = in.opcode == 0x03 ? 1 : 0;
+                in.address = (uint16_t)(in.operands[at] << 8 | in.operands[at + 1]);
+            }
+
+            marks[pc] |= CFG_INSTRUCTION;
+            for (int i = 1; i < in.length; i++) marks[pc + i] |= CFG_OPERAND;
+            instructions.push_back(in);
+            depths[pc] = depth;
+            called[pc] = in_call;
+
+            if (in.opcode == 0x30 || in.opcode == 0x31) depth++;
+            if (in.opcode == 0x32 && --depth < 0 && in_call) fail("pops the address a CALL pushed", pc);
+            if (in.opcode == 0x52 && !in_call) fail("returns without a CALL", pc);
+            else if (in.opcode == 0x52 && depth != 0) fail("returns to an address it pushed", pc);
+
+            if (is_indirect_jump(in.opcode)) {
+                fail("jumps to an address held in registers", pc);
+                if (!partial || is_terminator(in.opcode)) break;
+            }
+
+            uint32_t next = pc + in.length;
+            if (is_jump(in.opcode) || is_conditional_jump(in.opcode) || in.opcode == 0x50) {
+                if (in.address >= image.size()) {
+                    fail("jumps outside the image", pc);
+                    if (!partial || is_terminator(in.opcode)) break;
+                }
+                else {
+                    marks[in.address] |= CFG_LEADER;
+                    if (in.opcode == 0x50) pending.push_back({in.address, 0, true});
+                    else pending.push_back({in.address, depth, in_call});
+                }
+            }
+            if (is_terminator(in.opcode)) break;
+
+            if (is_conditional_jump(in.opcode) || is_indirect_jump(in.opcode) || in.opcode == 0x50) {
+                if (next < image.size()) marks[next] |= CFG_LEADER;
+            }
+            pc = next;
+        }
+    }
+    if (problem != nullptr) return;
+
+    std::sort(instructions.begin(), instructions.end(),
+        [](const CodeInstruction& a, const CodeInstruction& b) { return a.pc < b.pc; });
+    for (size_t i = 0; i < instructions.size(); i++) index[instructions[i].pc] = i;
+
+    // Fixed addresses into the image, a program reading or writing its own code can't be moved around
+    for (const CodeInstruction& in : instructions) {
+        bool read = in.opcode == 0x03;
+        bool written = in.opcode == 0x61 || in.opcode == 0x63;
+        if (written && in.address / PAGE_SIZE == TIMER_ADDRESS / PAGE_SIZE) {
+            fail("sets up the timer, its interrupts run code the walk can't see", in.pc);
+            if (!partial) return;
+        }
+        if ((!read && !written) || in.address >= image.size()) continue;
+
+        if (marks[in.address] & (CFG_INSTRUCTION | CFG_OPERAND)) {
+            fail(read ? "reads its own code" : "writes its own code", in.pc);
+            if (!partial) return;
+            continue;
+        }
+        marks[in.address] |= read ? CFG_READ : CFG_WRITTEN;
+    }
+}
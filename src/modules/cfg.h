@@ -0,0 +1,61 @@
+#pragma once
+#include "def.h"
+#include "ram.h"
+#include <cstddef>
+#include <vector>
+
+// Control flow of a program image, recovered without running it: a walk from address 0 following
+// every direct JMP/Jcc/CALL target, the instruction after each conditional jump and after each
+// CALL (a RET is taken to come back there, which it checks by counting PUSHes and POPs on the way).
+// Bytes the walk never reaches are data or dead code.
+
+// What the walk found at each address
+#define CFG_INSTRUCTION 0x01 // An instruction it reached starts here
+#define CFG_OPERAND     0x02 // Operand byte of one
+#define CFG_LEADER      0x04 // Starts a basic block: the entry, a jump or call target, or after a branch or CALL
+#define CFG_READ        0x08 // Read by a MOV $x, [#0]
+#define CFG_WRITTEN     0x10 // Written by a STORE [#0]
+
+struct CodeInstruction {
+    uint16_t pc;
+    byte opcode;
+    byte length;
+    byte operands[3];   // As in memory, 16-bit immediates high byte first
+    uint16_t address;   // 16-bit immediate: jump/call target or memory address
+};
+
+// Kinds of instructions, by how they leave
+bool is_jump(byte opcode);              // JMP [#0]
+bool is_conditional_jump(byte opcode);  // JZ...JNO [#0]
+bool is_indirect_jump(byte opcode);     // JMP/Jcc/CALL [$x, $y]
+bool is_terminator(byte opcode);        // Never falls through: JMP, RET, HALT, opcodes that don't exist
+bool has_address(byte opcode);          // Has a 16-bit immediate
+
+// False if the instruction faults on a register that doesn't exist, every time it runs
+bool valid_registers(const CodeInstruction& in);
+
+struct ControlFlow {
+    std::vector<byte> image;
+    std::vector<byte> marks;                    // CFG_* by address, RAM_SIZE of them
+    std::vector<CodeInstruction> instructions;  // Every instruction reached, by address
+    std::vector<int> index;                     // Instruction starting at each address, -1 if none
+
+    // Why the program can't be taken apart statically, nullptr if it can. Register-indirect jumps
+    // (the targets aren't known), a RET that may not go back after a CALL (it pushed its own return
+    // address, or the stack differs between paths), instructions overlapping, running off the image,
+    // reading or writing its own code through a fixed address, timer interrupts...
+    const char* problem;
+    uint16_t problem_pc;
+
+    // partial: never a problem, the walk just stops where it can't go on (at register-indirect jumps,
+    // out of the image, into the middle of an instruction). Whoever uses it runs the rest some other way.
+    ControlFlow(const byte* image, size_t size, bool partial = false);
+
+    const CodeInstruction* at(uint16_t address) const; // nullptr if no instruction starts there
+    bool reads_memory() const;  // Any load or store through [$x, $y], or a MOV $x, [#0] inside the image
+
+    private:
+    bool partial;
+    void walk();
+    void fail(const char* reason, uint16_t pc);
+};
@@ -0,0 +1,112 @@
+#include "cores.h"
+#include "cpu.h"
+
+CoreInfo::CoreInfo(byte id)
+: id(id), count(1)
+{
+}
+
+byte CoreInfo::read(uint16_t address)
+{
+    switch (address) {
+        case CORE_ID: return id;
+        case CORE_COUNT: return count;
+    }
+    return 0;
+}
+
+Cores::Cores(CPU* first, int count)
+: results(count, -1), stopping(false), faulted(false), fault_code(Errors::SIGABRT), fault_core(-1)
+{
+    cores.push_back(first);
+    first->ram.shared = count > 1;
+    first->core.count = count;
+
+    for (int id = 1; id < count; id++) {
+        CPU* core = new CPU(first, id);
+        core->core.count = count;
+        // ROM is ROM for everyone
+        for (int page = 0; page < PAGES; page++) core->ram.page_flags[page] |= first->ram.page_flags[page] & PAGE_READONLY;
+        cores.push_back(core);
+    }
+}
+
+Cores::~Cores()
+{
+    stop();
+    for (size_t id = 1; id < cores.size(); id++) delete cores[id];
+}
+
+void Cores::work(int id)
+{
+    CPU* cpu = cores[id];
+    try {
+        int res = -1;
+        while (res == -1 && !stopping.load(std::memory_order_relaxed)) res = cpu->execute(CORE_SLICE);
+        results[id] = res;
+    }
+    catch (VMFault& f) {
+        bool first = false;
+        if (faulted.compare_exchange_strong(first, true)) {
+            fault_code = f.code;
+            fault_core = id;
+        }
+        stopping = true;
+    }
+}
+
+void Cores::stop()
+{
+    stopping = true;
+    for (std::thread& thread : threads) thread.join();
+    threads.clear();
+}
+
+int Cores::run()
+{
+    CPU* first = cores[0];
+    // The profile is core 0's, the others run what it would without one
+    for (size_t id = 1; id < cores.size(); id++) {
+        cores[id]->engine = first->engine == Engine::PROFILE ? Engine::REFERENCE : first->engine;
+    }
+
+    stopping = false;
+    for (size_t id = 1; id < cores.size(); id++) threads.emplace_back(&Cores::work, this, (int)id);
+
+    first->scheduler.schedule(first->retired + PRESENT_BATCH, EventKind::FRAME);
+    int res = -1;
+    try {
+        while (res == -1 && !faulted.load(std::memory_order_relaxed)) res = first->execute(CORE_SLICE);
+    }
+    catch (VMFault& f) {
+        bool first_fault = false;
+        if (faulted.compare_exchange_strong(first_fault, true)) {
+            fault_code = f.code;
+            fault_core = 0;
+        }
+    }
+    first->scheduler.cancel(EventKind::FRAME);
+    stop();
+
+    results[0] = res;
+    if (faulted) fault(fault_code);
+    return res;
+}
+
+uint64_t Cores::retired() const
+{
+    uint64_t total = 0;
+    for (const CPU* core : cores) total += core->retired;
+    return total;
+}
+
+void Cores::report(FILE* out)
+{
+    fprintf(out, "Cores: %zu, %llu instructions in all\n", cores.size(), (unsigned long long)retired());
+    for (size_t id = 0; id < cores.size(); id++) {
+        fprintf(out, "  core %zu: %llu instructions", id, (unsigned long long)cores[id]->retired);
+        if ((int)id == fault_core) fprintf(out, ", faulted (%s)\n", error_message(fault_code));
+        else if (results[id] >= 0) fprintf(out, ", halted with %d\n", results[id]);
+        else fprintf(out, "\n");
+    }
+}
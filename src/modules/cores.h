@@ -0,0 +1,56 @@
+#pragma once
+#include "def.h"
+#include "device.h"
+#include "errors.h"
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#define CORE_ADDRESS    0xd200
+#define CORE_ID         (CORE_ADDRESS + 0) // Which core reads it, 0 is the one the program was loaded on
+#define CORE_COUNT      (CORE_ADDRESS + 1) // Cores running the program
+#define MAX_CORES       16 // Their stacks are the pages under STACK_ADDRESS, one each
+#define CORE_SLICE      0x10000 // Instructions a core runs between two looks at whether the others stopped
+
+// Tells a core which one it is, every core has its own at CORE_ADDRESS. The rest of the page
+// reads 0 and ignores writes.
+struct CoreInfo : Device {
+    byte id;
+    byte count;
+
+    CoreInfo(byte id);
+    byte read(uint16_t address) override;
+    bool write(uint16_t address, byte data) override { return false; }
+    bool steady(uint16_t address) override { return true; }
+};
+
+struct CPU;
+
+// One program on several cores sharing the first one's memory, each on a thread of its own. Every
+// core starts at 0 with its own registers, flags, stack (see CPU::CPU) and devices, and reads
+// CORE_ID to know its part of the work. Core 0 is the machine the way it was: it has the window,
+// presents frames and gets the keys. See devinfo.md for what one core sees of another's stores.
+struct Cores {
+    private:
+    std::vector<CPU*> cores;        // cores[0] is the one given, the rest are owned
+    std::vector<std::thread> threads;
+    std::vector<int> results;       // Halt code of each, -1 while it runs
+    std::atomic<bool> stopping;     // Core 0 is done, or one of them faulted
+    std::atomic<bool> faulted;
+    Errors fault_code;              // Of the first one that faulted
+    int fault_core;
+
+    void work(int id);              // A thread's, for cores 1 and up
+    void stop();                    // Every thread, joined
+
+    public:
+    Cores(CPU* first, int count);
+    ~Cores();
+
+    // Like CPU::run() on core 0 (frames included), the others run on their threads until it halts.
+    // A fault on any of them stops them all, and is thrown from here.
+    int run();
+    uint64_t retired() const;       // All of them
+    void report(FILE* out);         // For --stats
+};
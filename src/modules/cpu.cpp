@@ -1,20 +1,17 @@
 #include "cpu.h"
 #include "errors.h"
 #include "casts.h"
+#include "decoded.h"
+#include "jit.h"
+#include "profiler.h"
+#include "native.h"
 
-#include <cmath>
 #include <unistd.h> // UNIX-only. Should add macro to support windows
 
-// This is an approximation (floored to 5.54 because there is no other ln from 0-254 like it, at most they are 5.53)
-#define BYTE_LN         5.54 
-#define STACK_ADDRESS   0xcf00
-#define SCREEN_ADDRESS  0xa000
-#define REGISTERS       8
-
 byte* CPU::get_register_by_address(byte addr)
 {
     if (addr == 0xff) return &ALWAYS_ZERO; // Returns a pointer to a new byte which can be modified, but no modification with update it, also, it's always zero
-    if(addr >= REGISTERS) raise(Errors::SIGSEGV);
+    if(addr >= REGISTERS) fault(Errors::SIGSEGV);
     return &registers[addr];
 };
 
@@ -23,20 +20,90 @@ byte* CPU::get_next_as_register()
     return get_register_by_address(ram.next());
 }
 
-void CPU::update_flags_with_number(int64_t num)
+uint16_t CPU::next_register_address()
+{
+    byte* register_x = get_next_as_register();
+    byte* register_y = get_next_as_register();
+    return bytes_to_uint16(*register_y, *register_x);
+}
+
+// Table loads, the math is worked out at compile time in alu.cpp
+byte CPU::alu_div(byte x, byte y)
 {
-    overflow    = num > 255;
-    zero        = num == 0;
-    underflow   = num < 0; 
+    return alu_result(div_table[x << 8 | y]);
+}
+
+byte CPU::alu_pwr(byte x, byte y)
+{
+    /* C++ returns trash values when a exponent or base is 0 so
+    *  it would be better to skip it, it also takes out the possibility of
+    *  a = 0, which would make ln(a) = -1 (due to C++ indicating an error)
+    */
+    if (y == 0 || x == 0) {
+        fault(Errors::SIGABRT);
+    }
+    return alu_result(pwr_table[x << 8 | y]);
 }
 
-CPU::CPU()
-: ram(RAM()), stack(Stack(&(ram.memory[STACK_ADDRESS]))), screen(Screen(&(ram.memory[SCREEN_ADDRESS]))), zero(false), underflow(false), overflow(false) 
+byte CPU::alu_sqrt(byte x)
 {
-    registers = new byte[REGISTERS]();
+    return alu_result(sqrt_table[x]);
 }
 
-int CPU::tick() { // Gotta make it DRY, cause a lot of repetition in it. (like the register and immediates)
+byte CPU::alu_fsqrt(byte x)
+{
+    return alu_result(fsqrt_table[x]);
+}
+
+int CPU::cas(uint16_t address, byte value)
+{
+    byte held = registers[0];
+    int written = ram.compare_exchange(address, held, value);
+    update_flags_with_number(held == registers[0] ? 0 : 1);
+    registers[0] = held;
+    return written;
+}
+
+int CPU::xadd(uint16_t address, byte* value)
+{
+    byte added = *value;
+    int written = ram.fetch_add(address, *value);
+    update_flags_with_number((int64_t)*value + (int64_t)added);
+    return written;
+}
+
+CPU::CPU(CPU* first, byte id)
+: ALWAYS_ZERO(0), registers(), flags_result(1), flags_pending(false), zero(false), underflow(false), overflow(false), decoded(nullptr), jit(nullptr), idle(this), ram(RAM(first != nullptr ? &first->ram : nullptr)), scheduler(), keyboard(), timer(&scheduler), core(id), stack(Stack(&ram, STACK_ADDRESS - id * PAGE_SIZE)), screen(Screen(&(ram.memory[SCREEN_ADDRESS]), &keyboard)), engine(Engine::REFERENCE), retired(0), profiler(nullptr), native(nullptr)
+{
+    ram.watch(SCREEN_ADDRESS, FRAMEBUFFER_SIZE);
+    ram.map(KEYBOARD_ADDRESS, PAGE_SIZE, &keyboard);
+    ram.map(TIMER_ADDRESS, PAGE_SIZE, &timer);
+    ram.map(CORE_ADDRESS, PAGE_SIZE, &core);
+}
+
+CPU::~CPU()
+{
+    delete decoded;
+    #if NEODYMIUM_JIT
+    delete jit;
+    #endif
+    delete profiler;
+    delete native;
+}
+
+int CPU::tick() {
+    // The operands were read by then, put pc back: every engine leaves it at the faulting instruction
+    uint16_t start = ram.pc;
+    try {
+        return step();
+    }
+    catch (VMFault&) {
+        ram.pc = start;
+        throw;
+    }
+}
+
+int CPU::step() { // Gotta make it DRY, cause a lot of repetition in it. (like the register and immediates)
     byte opcode = ram.next();
 
     switch (opcode) {
@@ -99,10 +166,7 @@ int CPU::tick() { // Gotta make it DRY, cause a lot of repetition in it. (like t
             return -1;
         }
         case 0x21: { // JMP [$x,$y]
-            uint16_t addr = bytes_to_uint16(
-                *(get_next_as_register()),
-                *(get_next_as_register())
-            );
+            uint16_t addr = next_register_address();
             
             ram.pc = addr;
             return -1;
@@ -128,90 +192,84 @@ int CPU::tick() { // Gotta make it DRY, cause a lot of repetition in it. (like t
         case 0x24: { // JZ [#0]
             uint16_t immediate = ram.next_16bit_immediate();
             
+            sync_flags();
             if(zero) ram.pc = immediate;
             return -1;
         }
         case 0x25: { // JZ [$x,$y]
-            uint16_t addr = bytes_to_uint16(
-                *(get_next_as_register()),
-                *(get_next_as_register())
-            );
+            uint16_t addr = next_register_address();
             
+            sync_flags();
             if(zero) ram.pc = addr;
             return -1;
         }
         case 0x26: { // JNZ [#0]
             uint16_t immediate = ram.next_16bit_immediate();
             
+            sync_flags();
             if(!zero) ram.pc = immediate;
             return -1;
         }
         case 0x27: { // JNZ [$x,$y]
-            uint16_t addr = bytes_to_uint16(
-                *(get_next_as_register()),
-                *(get_next_as_register())
-            );
+            uint16_t addr = next_register_address();
             
+            sync_flags();
             if(!zero) ram.pc = addr;
             return -1;
         }
         case 0x28: { // JU [#0]
             uint16_t immediate = ram.next_16bit_immediate();
             
+            sync_flags();
             if(underflow) ram.pc = immediate;
             return -1;
         }
         case 0x29: { // JU [$x,$y]
-            uint16_t addr = bytes_to_uint16(
-                *(get_next_as_register()),
-                *(get_next_as_register())
-            );
+            uint16_t addr = next_register_address();
             
+            sync_flags();
             if(underflow) ram.pc = addr;
             return -1;
         }
         case 0x2a: { // JNU [#0]
             uint16_t immediate = ram.next_16bit_immediate();
             
+            sync_flags();
             if(!underflow) ram.pc = immediate;
             return -1;
         }
         case 0x2b: { // JNU [$x,$y]
-            uint16_t addr = bytes_to_uint16(
-                *(get_next_as_register()),
-                *(get_next_as_register())
-            );
+            uint16_t addr = next_register_address();
             
+            sync_flags();
             if(!underflow) ram.pc = addr;
             return -1;
         }
         case 0x2c: { // JO [#0]
             uint16_t immediate = ram.next_16bit_immediate();
             
+            sync_flags();
             if(overflow) ram.pc = immediate;
             return -1;
         }
         case 0x2d: { // JO [$x,$y]
-            uint16_t addr = bytes_to_uint16(
-                *(get_next_as_register()),
-                *(get_next_as_register())
-            );
+            uint16_t addr = next_register_address();
             
+            sync_flags();
             if(overflow) ram.pc = addr;
             return -1;
         }
         case 0x2e: { // JNO [#0]
             uint16_t immediate = ram.next_16bit_immediate();
             
+            sync_flags();
             if(!overflow) ram.pc = immediate;
             return -1;
         }
         case 0x2f: { // JNO [$x,$y]
-            uint16_t addr = bytes_to_uint16(
-                *(get_next_as_register()),
-                *(get_next_as_register())
-            );
+            uint16_t addr = next_register_address();
             
+            sync_flags();
             if(!overflow) ram.pc = addr;
             return -1;
         }
@@ -319,106 +377,47 @@ int CPU::tick() { // Gotta make it DRY, cause a lot of repetition in it. (like t
             byte* register_x = get_next_as_register();
             byte immediate = ram.next();
             
-            int64_t result = (int64_t)round((double)*register_x / (double)immediate);
-            update_flags_with_number(result);
-            
-            *register_x = (byte)result;
+            *register_x = alu_div(*register_x, immediate);
             return -1;
         }
         case 0x49: { // DIV $x, $y
             byte* register_x = get_next_as_register();
             byte* register_y = get_next_as_register();
             
-            int64_t result = (int64_t)round((double)*register_x / (double)*register_y);
-            update_flags_with_number(result);
-            
-            *register_x = (byte)result;
+            *register_x = alu_div(*register_x, *register_y);
             return -1;
         }
         case 0x4a: { // PWR $x, #0
             byte* register_x = get_next_as_register();
             byte immediate = ram.next();
             
-            /* C++ returns trash values when a exponent or base is 0 so
-            *  it would be better to skip it, it also takes out the possibility of
-            *  a = 0, which would make ln(a) = -1 (due to C++ indicating an error)
-            */
-            if (immediate == 0 || *register_x == 0) {
-                raise(Errors::SIGABRT);
-            }
-            
-            double pow_size = (double)immediate * log((double)*register_x); // a**b > 255 = b*ln(a) > ln(255)
-            
-            overflow    = (pow_size > BYTE_LN);
-            underflow   = false;
-            zero        = false;
-            
-            double result = pow((double)*register_x, (double)immediate); // this gonna overflow heavily, it's unstopable.
-            
-            *register_x = (byte)result;
+            *register_x = alu_pwr(*register_x, immediate);
             return -1;
         }
         case 0x4b: { // PWR $x, $y
             byte* register_x = get_next_as_register();
             byte* register_y = get_next_as_register();
             
-            /* C++ returns trash values when a exponent or base is 0 so
-            *  it would be better to skip it, it also takes out the possibility of
-            *  a = 0, which would make ln(a) = -1 (due to C++ indicating an error)
-            */
-            if (*register_y == 0 || *register_x == 0) {
-                raise(Errors::SIGABRT);
-            }
-            
-            double pow_size = (double)*register_y * log((double)*register_x); // a**b > 255 = b*ln(a) > ln(255)
-            
-            overflow    = (pow_size > BYTE_LN);
-            underflow   = false;
-            zero        = false;
-            
-            double result = pow((double)*register_x, (double)*register_y); // this gonna overflow heavily, it's unstopable.
-            
-            *register_x = (byte)result;
+            *register_x = alu_pwr(*register_x, *register_y);
             return -1;
         }
         case 0x4c: { // SQRT $x
-            // Thanks Quake III
-            
             byte* register_x = get_next_as_register();
             
-            long i;
-            float x2, y;
-            
-            x2 = (float)*register_x * 0.5F;
-            y = (float)*register_x;
-            i = * (long*)&y;
-            i = 0x5f3759df - (i >> 1);
-            y = * (float*)&i;
-            y = y * (1.5F - (x2 * y * y));
-            
-            *register_x = (byte)round(1/y);
-            
-            overflow    = false;
-            underflow   = false;
-            zero        = (*register_x == 0);
+            *register_x = alu_sqrt(*register_x);
             return -1;
         }
         case 0x4d: { // FSQRT $x
             byte* register_x = get_next_as_register();
             
-            int64_t result = round(sqrt((double)*register_x));
-            
-            overflow    = false;
-            underflow   = false;
-            zero        = (result == 0);
-            
-            *register_x = (byte)result;
+            *register_x = alu_fsqrt(*register_x);
             return -1;
         }
         case 0x4e: { // MOD $x, $y
             byte* register_x = get_next_as_register();
             byte* register_y = get_next_as_register();
 
+            if (*register_y == 0) fault(Errors::SIGFPE);
             uint64_t result = (uint64_t)*register_x % (uint64_t)*register_y;
             update_flags_with_number(result);
 
@@ -429,6 +428,7 @@ int CPU::tick() { // Gotta make it DRY, cause a lot of repetition in it. (like t
             byte* register_x = get_next_as_register();
             byte immediate = ram.next();
 
+            if (immediate == 0) fault(Errors::SIGFPE);
             uint64_t result = (uint64_t)*register_x % (uint64_t)immediate;
             update_flags_with_number(result);
 
@@ -445,10 +445,7 @@ int CPU::tick() { // Gotta make it DRY, cause a lot of repetition in it. (like t
             return -1;
         }
         case 0x51: { // CALL [$x,$y]
-            uint16_t addr = bytes_to_uint16(
-                *get_next_as_register(),
-                *get_next_as_register()
-            );
+            uint16_t addr = next_register_address();
             
             stack.push_16bit(ram.pc);
             
@@ -464,38 +461,40 @@ int CPU::tick() { // Gotta make it DRY, cause a lot of repetition in it. (like t
             return -1;
         }
         case 0x60: { // STORE [$x,$y], $z
-            uint16_t addr = bytes_to_uint16(
-                *get_next_as_register(),
-                *get_next_as_register()
-            );
+            uint16_t addr = next_register_address();
             byte* register_z = get_next_as_register();
 
-            ram.write(addr, *register_z);
-            return -1;
+            return ram.write(addr, *register_z) == WRITE_YIELD ? TICK_YIELD : -1;
         }
         case 0x61: { // STORE [#0], $x
             uint16_t addr = ram.next_16bit_immediate();
             byte* register_x = get_next_as_register();
 
-            ram.write(addr, *register_x);
-            return -1;
+            return ram.write(addr, *register_x) == WRITE_YIELD ? TICK_YIELD : -1;
         }
         case 0x62: { // STORE [$x,$y], #0
-            uint16_t addr = bytes_to_uint16(
-                *get_next_as_register(),
-                *get_next_as_register()
-            );
+            uint16_t addr = next_register_address();
             byte immediate = ram.next();
 
-            ram.write(addr, immediate);
-            return -1;
+            return ram.write(addr, immediate) == WRITE_YIELD ? TICK_YIELD : -1;
         }
         case 0x63: { // STORE [#0], #1
             uint16_t addr = ram.next_16bit_immediate();
             byte immediate = ram.next();
 
-            ram.write(addr, immediate);
-            return -1;
+            return ram.write(addr, immediate) == WRITE_YIELD ? TICK_YIELD : -1;
+        }
+        case 0x64: { // CAS [$x,$y], $z
+            uint16_t addr = next_register_address();
+            byte* register_z = get_next_as_register();
+
+            return cas(addr, *register_z) == WRITE_YIELD ? TICK_YIELD : -1;
+        }
+        case 0x65: { // XADD [$x,$y], $z
+            uint16_t addr = next_register_address();
+            byte* register_z = get_next_as_register();
+
+            return xadd(addr, register_z) == WRITE_YIELD ? TICK_YIELD : -1;
         }
         case 0xfd: { // HALT $x
             byte* register_x = get_next_as_register();
@@ -511,17 +510,132 @@ int CPU::tick() { // Gotta make it DRY, cause a lot of repetition in it. (like t
         }
     }
     
-    raise(Errors::SIGABRT);
-    return 0; // this wont run never (Cause raise calls exit()), but it makes g++ happy
+    fault(Errors::SIGABRT);
 }
 
-int CPU::run() {
-    while (true) {
+int CPU::dispatch(uint64_t budget) {
+    #if NEODYMIUM_JIT
+    if (engine == Engine::JIT) {
+        if (jit == nullptr) jit = new JIT(this);
+        return jit->execute(budget);
+    }
+    #endif
+
+    if (engine == Engine::DECODED || engine == Engine::JIT) {
+        if (decoded == nullptr) decoded = new DecodedEngine(this);
+        return decoded->execute(budget);
+    }
+
+    if (engine == Engine::PROFILE) {
+        if (profiler == nullptr) profiler = new Profiler(this);
+        return profiler->execute(budget);
+    }
+
+    if (engine == Engine::NATIVE && native != nullptr) return native->execute(budget);
+
+    for (uint64_t i = 0; i < budget; i++) {
         int res = tick();
+        retired++;
+        if (res != -1) {
+            return res == TICK_YIELD ? -1 : res;
+        }
+    }
+    return -1;
+}
+
+int CPU::execute(uint64_t budget) {
+    uint64_t end = budget > NO_EVENT - retired ? NO_EVENT : retired + budget;
+
+    while (true) {
+        // The profile counts what really ran
+        if (engine != Engine::PROFILE && idle.check((scheduler.next() < end ? scheduler.next() : end) - retired)) skip_idle(end);
+
+        // Waiting for an event, the program gets into its idle loop somewhere in between
+        uint64_t until = scheduler.next() < end ? scheduler.next() : end;
+        if (scheduler.next() != NO_EVENT && until - retired > IDLE_CHECK) until = retired + IDLE_CHECK;
+        int res = dispatch(until - retired);
         if (res != -1) {
             return res;
         }
 
-        screen.tick();
+        scheduler.settle(retired);
+        while (scheduler.next() <= retired) {
+            res = handle(scheduler.pop());
+            if (res != -1) return res;
+        }
+        if (retired >= end) return -1;
+    }
+}
+
+void CPU::skip_idle(uint64_t end)
+{
+    // The frame clock is wall time. Spinning until the frame is due would run as many instructions
+    // as the CPU runs in that time (the timer counts on through them), sleep instead and count them.
+    uint64_t frame = scheduler.next(EventKind::FRAME);
+    if (frame == scheduler.next() && frame < end) {
+        double seconds = presenter.until_frame();
+        double rate = idle.rate();
+        if (seconds > 0) {
+            uint64_t other = scheduler.next(EventKind::TIMER) < end ? scheduler.next(EventKind::TIMER) : end;
+            if (rate > 0 && (other - retired) / rate < seconds) seconds = (other - retired) / rate;
+
+            auto start = std::chrono::steady_clock::now();
+            screen.wait(seconds);
+            std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+            idle.slept += waited.count();
+
+            if (rate > 0) {
+                double spun = waited.count() * rate;
+                scheduler.cancel(EventKind::FRAME);
+                scheduler.schedule(spun < other - retired ? retired + (uint64_t)spun : other, EventKind::FRAME);
+            }
+        }
+    }
+
+    uint64_t until = scheduler.next() < end ? scheduler.next() : end;
+    uint64_t skip = (until - retired) / idle.length * idle.length;
+    retired += skip;
+    idle.skipped += skip;
+}
+
+int CPU::handle(const Event& event)
+{
+    switch (event.kind) {
+        case EventKind::FRAME: {
+            // Every batch, presenting is way more expensive than an instruction
+            scheduler.schedule(event.at + PRESENT_BATCH, EventKind::FRAME);
+            if (!presenter.frame_due()) break;
+
+            // Fixed rate draws the last frame again when nothing was written, without uploading it.
+            // Other cores may be setting it right now.
+            bool written = __atomic_exchange_n(&ram.watch_written, false, __ATOMIC_ACQ_REL);
+            if (presenter.mode == PresentMode::FIXED_RATE || written) screen.present(written);
+            if (!screen.poll()) return RUN_CLOSED;
+            break;
+        }
+        case EventKind::TIMER:
+            if (timer.expire(event.at)) interrupt(timer.vector());
+            break;
     }
-}
\ No newline at end of file
+    return -1;
+}
+
+void CPU::interrupt(uint16_t vector)
+{
+    stack.push_16bit(ram.pc);
+    ram.pc = vector;
+}
+
+int CPU::run() {
+    scheduler.schedule(retired + PRESENT_BATCH, EventKind::FRAME);
+    int res = execute(NO_EVENT);
+    scheduler.cancel(EventKind::FRAME);
+    return res;
+}
+
+void CPU::report_engine(FILE* out)
+{
+    if (decoded != nullptr) decoded->report(out);
+    if (native != nullptr) native->report(out);
+    if (idle.found != 0) idle.report(out);
+}
@@ -1,30 +1,121 @@
 #pragma once
 #include "def.h"
+#include "alu.h"
 #include "ram.h"
 #include "stack.h"
+#include "keyboard.h"
+#include "scheduler.h"
+#include "timer.h"
+#include "cores.h"
 #include "screen.h"
+#include "presenter.h"
+#include "idle.h"
+#include "machine.h"
+#include <cstdio>
+
+#define MAX_INSTRUCTION_SIZE 4 // Bytes, opcode included
+#define REGISTERS 8
+#define STACK_ADDRESS   (MACHINE.stack_address)
+#define SCREEN_ADDRESS  (MACHINE.screen_address)
+#define RUN_CLOSED      -2 // run() ended because the window was closed
+#define TICK_YIELD      -3 // tick() ran a store a device wants to act on, see Device::write()
+
+enum struct Engine : byte {
+    REFERENCE,  // CPU::tick(), decodes every instruction every time
+    DECODED,    // Pre-decoded instruction cache with threaded dispatch (see decoded.h)
+    JIT,        // Hot blocks compiled to x86-64 (see jit.h), the decoded engine elsewhere
+    PROFILE,    // CPU::tick() counting everything it runs (see profiler.h)
+    NATIVE,     // A shared object neodymium_aot built from the program (see native.h), the reference engine without one
+};
+
+struct DecodedEngine;
+struct JIT;
+struct Profiler;
+struct NativeEngine;
+struct Snapshot;
+template <int LANES> struct Lockstep;
 
 struct CPU
 {
     private:
     byte ALWAYS_ZERO;
-    bytes registers;
+    byte registers[REGISTERS];
     byte* get_register_by_address(byte addr);
     byte* get_next_as_register();
-    void update_flags_with_number(int64_t num);
+    uint16_t next_register_address(); // [$x,$y] operand, $x is the high byte
+
+    // Flags are worked out when something reads them: an instruction only leaves the number
+    // they come from (every instruction that sets them does it from one), sync_flags() turns
+    // it into the three bools. Anything reading or writing the bools directly syncs first.
+    int64_t flags_result;
+    bool flags_pending;
+    void update_flags_with_number(int64_t num) { flags_result = num; flags_pending = true; }
+    void sync_flags();
+
+    // Math shared by every engine, they update the flags like the instructions do
+    byte alu_div(byte x, byte y);
+    byte alu_pwr(byte x, byte y);
+    byte alu_sqrt(byte x);
+    byte alu_fsqrt(byte x);
+    byte alu_result(AluResult result) { update_flags_with_number(alu_flags_number(result.flags)); return result.value; }
+
+    // Atomics, WRITE_*. CAS stores value if address holds $a (zero flag set) or loads $a with what it
+    // holds, XADD adds value there and gets what it held (flags like ADD).
+    int cas(uint16_t address, byte value);
+    int xadd(uint16_t address, byte* value);
 
     bool zero; // Indicates if last value is equal to zero
     bool underflow; // Indicates if last value is under 0 and had to wrap around to 255
     bool overflow; // Indicate if last value is over 255 and had to wrap around to 0
 
+    DecodedEngine* decoded;
+    JIT* jit;
+    IdleLoop idle;
+
+    int step(); // tick(), leaving pc wherever a fault left it
+    int dispatch(uint64_t budget); // Runs up to budget instructions on the selected engine, nothing else
+    void skip_idle(uint64_t end); // pc is at the head of an idle loop, goes around it up to the next event (or end)
+    int handle(const Event& event); // -1, or what execute() returns because of it
+    void interrupt(uint16_t vector); // Like a CALL, from between two instructions
+
+    friend struct DecodedEngine;
+    friend struct JIT;
+    friend struct Profiler;
+    friend struct NativeEngine;
+    friend struct Snapshot;
+    friend struct IdleLoop;
+    template <int LANES> friend struct Lockstep;
+    friend struct neodymium_vm; // libneodymium's handle, see neodymium.h
+    friend struct EngineRun;    // What tests/tests.cpp compares between engines
 
     public:
     RAM ram;
+    Scheduler scheduler;
+    Keyboard keyboard; // Mapped at KEYBOARD_ADDRESS
+    Timer timer;       // Mapped at TIMER_ADDRESS
+    CoreInfo core;     // Mapped at CORE_ADDRESS
     Stack stack;
     Screen screen;
+    Presenter presenter;
+    Engine engine;
+    uint64_t retired; // Instructions executed since the CPU was created
+    Profiler* profiler; // Created the first time Engine::PROFILE runs
+    NativeEngine* native; // Loaded by whoever picks Engine::NATIVE, deleted with the CPU
 
-    CPU();
+    CPU(CPU* first = nullptr, byte id = 0); // Core id sharing first's memory (see cores.h), or a machine of its own
+    ~CPU();
     
-    int tick();
-    int run();
+    int tick(); // -1, TICK_YIELD or the halt code. A fault leaves pc at the instruction, like the other engines.
+    int execute(uint64_t budget); // Runs up to budget instructions on the selected engine, -1 if it didn't halt. Handles events as they're due.
+    int run(); // Halt code, or RUN_CLOSED
+    void report_engine(FILE* out); // Whatever the engines that ran counted, for --stats
 };
+
+inline void CPU::sync_flags()
+{
+    if (!flags_pending) return;
+    flags_pending = false;
+    overflow    = flags_result > 255;
+    zero        = flags_result == 0;
+    underflow   = flags_result < 0;
+}
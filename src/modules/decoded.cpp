@@ -0,0 +1,523 @@
+#include "decoded.h"
+#include "cpu.h"
+#include "errors.h"
+
+DecodedEngine::DecodedEngine(CPU* cpu)
+: cpu(cpu), handlers(nullptr), fused(), bulk_loops(), bulk_bytes()
+{
+    cache = new DecodedInstruction[RAM_SIZE]();
+}
+
+DecodedEngine::~DecodedEngine()
+{
+    if (cpu->ram.code_context == this) cpu->ram.code_written = nullptr;
+    delete[] cache;
+}
+
+void DecodedEngine::code_written(void* context, uint16_t address)
+{
+    static_cast<DecodedEngine*>(context)->invalidate(address);
+}
+
+void DecodedEngine::invalidate(uint16_t address)
+{
+    // Fused pairs and loops span more than one instruction
+    for (int i = 0; i < DECODED_MAX_SPAN; i++) {
+        DecodedInstruction& slot = cache[(uint16_t)(address - i)];
+        // Only op and handler go back, a handler that is running may still read the rest
+        slot.op = Op::DECODE;
+        if (handlers != nullptr) slot.handler = handlers[(int)Op::DECODE];
+    }
+}
+
+void DecodedEngine::flush()
+{
+    for (uint32_t i = 0; i < RAM_SIZE; i++) {
+        cache[i].op = Op::DECODE;
+        if (handlers != nullptr) cache[i].handler = handlers[(int)Op::DECODE];
+    }
+}
+
+void DecodedEngine::decode(uint16_t pc)
+{
+    DecodedInstruction& slot = cache[pc];
+    RAM& ram = cpu->ram;
+    uint16_t at = pc;
+
+    auto next = [&]() { return ram.memory[at++]; };
+    auto next_register = [&]() { return cpu->get_register_by_address(next()); };
+    auto next_address = [&]() { byte high = next(); byte low = next(); return (uint16_t)((high << 8) | low); };
+
+    // Built aside so a faulting operand doesn't leave a half decoded slot behind
+    DecodedInstruction d = {};
+    byte opcode = next();
+
+    switch (opcode) {
+        case 0x00: d.op = Op::NOP; break;
+        case 0x01: d.op = Op::MOV; d.x = next_register(); d.y = next_register(); break;
+        case 0x02: d.op = Op::MOV; d.x = next_register(); d.immediate = next(); d.y = &slot.immediate; break;
+        case 0x03: d.op = Op::LOAD; d.x = next_register(); d.address = next_address(); break;
+        case 0x04: d.op = Op::LOAD_INDIRECT; d.x = next_register(); d.y = next_register(); d.z = next_register(); break;
+        case 0x10: d.op = Op::NOT; d.x = next_register(); break;
+        case 0x11: d.op = Op::AND; d.x = next_register(); d.y = next_register(); break;
+        case 0x12: d.op = Op::AND; d.x = next_register(); d.immediate = next(); d.y = &slot.immediate; break;
+        case 0x20: d.op = Op::JMP; d.address = next_address(); break;
+        case 0x21: d.op = Op::JMP_INDIRECT; d.x = next_register(); d.y = next_register(); break;
+        case 0x22: d.op = Op::CMP; d.x = next_register(); d.immediate = next(); d.y = &slot.immediate; break;
+        case 0x23: d.op = Op::CMP; d.x = next_register(); d.y = next_register(); break;
+        case 0x24: case 0x26: case 0x28: case 0x2a: case 0x2c: case 0x2e: {
+            static const Op jumps[] = {Op::JZ, Op::JNZ, Op::JU, Op::JNU, Op::JO, Op::JNO};
+            d.op = jumps[(opcode - 0x24) / 2];
+            d.address = next_address();
+            break;
+        }
+        case 0x25: case 0x27: case 0x29: case 0x2b: case 0x2d: case 0x2f: {
+            static const Op jumps[] = {Op::JZ_INDIRECT, Op::JNZ_INDIRECT, Op::JU_INDIRECT, Op::JNU_INDIRECT, Op::JO_INDIRECT, Op::JNO_INDIRECT};
+            d.op = jumps[(opcode - 0x25) / 2];
+            d.x = next_register();
+            d.y = next_register();
+            break;
+        }
+        case 0x30: d.op = Op::PUSH; d.y = next_register(); break;
+        case 0x31: d.op = Op::PUSH; d.immediate = next(); d.y = &slot.immediate; break;
+        case 0x32: d.op = Op::POP; d.x = next_register(); break;
+        case 0x40: case 0x43: case 0x46: case 0x48: case 0x4a: case 0x4f: { // $x, #0
+            d.op = opcode == 0x40 ? Op::ADD : opcode == 0x43 ? Op::SUB : opcode == 0x46 ? Op::MUL
+                    : opcode == 0x48 ? Op::DIV : opcode == 0x4a ? Op::PWR : Op::MOD;
+            d.x = next_register();
+            d.immediate = next();
+            d.y = &slot.immediate;
+            break;
+        }
+        case 0x41: case 0x44: case 0x47: case 0x49: case 0x4b: case 0x4e: { // $x, $y
+            d.op = opcode == 0x41 ? Op::ADD : opcode == 0x44 ? Op::SUB : opcode == 0x47 ? Op::MUL
+                    : opcode == 0x49 ? Op::DIV : opcode == 0x4b ? Op::PWR : Op::MOD;
+            d.x = next_register();
+            d.y = next_register();
+            break;
+        }
+        case 0x42: d.op = Op::INC; d.x = next_register(); break;
+        case 0x45: d.op = Op::DEC; d.x = next_register(); break;
+        case 0x4c: d.op = Op::SQRT; d.x = next_register(); break;
+        case 0x4d: d.op = Op::FSQRT; d.x = next_register(); break;
+        case 0x50: d.op = Op::CALL; d.address = next_address(); break;
+        case 0x51: d.op = Op::CALL_INDIRECT; d.x = next_register(); d.y = next_register(); break;
+        case 0x52: d.op = Op::RET; break;
+        case 0x60: d.op = Op::STORE_INDIRECT; d.x = next_register(); d.y = next_register(); d.z = next_register(); break;
+        case 0x61: d.op = Op::STORE; d.address = next_address(); d.y = next_register(); break;
+        case 0x62: d.op = Op::STORE_INDIRECT; d.x = next_register(); d.y = next_register(); d.immediate = next(); d.z = &slot.immediate; break;
+        case 0x63: d.op = Op::STORE; d.address = next_address(); d.immediate = next(); d.y = &slot.immediate; break;
+        case 0x64: d.op = Op::CAS; d.x = next_register(); d.y = next_register(); d.z = next_register(); break;
+        case 0x65: d.op = Op::XADD; d.x = next_register(); d.y = next_register(); d.z = next_register(); break;
+        case 0xfd: d.op = Op::HALT; d.y = next_register(); break;
+        case 0xfe: d.op = Op::HALT; d.immediate = next(); d.y = &slot.immediate; break;
+        case 0xff: d.op = Op::HALT; d.y = &slot.immediate; break;
+        default: d.op = Op::INVALID; break;
+    }
+
+    uint16_t end = at;
+
+    #if DECODED_IDIOMS
+    if ((opcode == 0x04 || opcode == 0x60 || opcode == 0x62) && decode_loop(pc, d)) end = d.address;
+    else
+    #endif
+    {
+    #if DECODED_FUSION
+    // The second instruction is only taken in if its operands are good, a fault has to come from its own slot
+    auto valid = [&](uint16_t address) { byte r = ram.memory[address]; return r < REGISTERS || r == 0xff; };
+    auto second_address = [&]() { return (uint16_t)((ram.memory[(uint16_t)(at + 1)] << 8) | ram.memory[(uint16_t)(at + 2)]); };
+    byte second = ram.memory[at];
+
+    bool jump = second >= 0x24 && second <= 0x2e && second % 2 == 0; // Jcc [#0]
+
+    if (jump && (d.op == Op::CMP || d.op == Op::INC || d.op == Op::DEC)) {
+        bool negated = ((second - 0x24) / 2) % 2;
+        bool* flags[] = {&cpu->zero, &cpu->underflow, &cpu->overflow};
+        d.op = d.op == Op::CMP ? (negated ? Op::CMP_JUMP_NOT : Op::CMP_JUMP)
+            : d.op == Op::INC ? (negated ? Op::INC_JUMP_NOT : Op::INC_JUMP)
+            : (negated ? Op::DEC_JUMP_NOT : Op::DEC_JUMP);
+        d.z = (byte*)flags[(second - 0x24) / 4];
+        d.middle = at;
+        d.address = second_address();
+        at += 3;
+    }
+    else if (d.op == Op::MOV && second == 0x61 && valid(at + 3)) { // STORE [#0], $x
+        d.op = Op::MOV_STORE;
+        d.middle = at;
+        d.address = second_address();
+        d.z = cpu->get_register_by_address(ram.memory[(uint16_t)(at + 3)]);
+        at += 4;
+    }
+    #endif
+    end = at;
+    }
+
+    d.next = at;
+    d.handler = handlers != nullptr ? handlers[(int)d.op] : nullptr;
+    slot = d;
+
+    // Writes to these pages have to reach invalidate()
+    ram.page_flags[pc / PAGE_SIZE] |= PAGE_CODE;
+    ram.page_flags[(uint16_t)(end - 1) / PAGE_SIZE] |= PAGE_CODE;
+}
+
+// Matches the loops DECODED_IDIOMS describes, d is the first instruction already decoded
+bool DecodedEngine::decode_loop(uint16_t pc, DecodedInstruction& d)
+{
+    const byte* memory = cpu->ram.memory;
+    auto at = [&](int offset) { return memory[(uint16_t)(pc + offset)]; };
+    auto valid = [](byte r) { return r < REGISTERS || r == 0xff; };
+
+    int offset = 0;
+    bool copy = at(0) == 0x04;
+    byte loaded = at(1), source = at(3); // MOV $v, [$l,$s], $l is the low byte in this one
+    if (copy) {
+        if (at(4) != 0x60 || at(6) != at(2) || at(7) != loaded) return false; // STORE [$h,$l], $v
+        offset = 4;
+    }
+    bool immediate = at(offset) == 0x62;
+    byte high = at(offset + 1), low = at(offset + 2), value = at(offset + 3);
+    offset += 4;
+
+    if (at(offset) != 0x42 || at(offset + 1) != low) return false; // INC $l
+    offset += 2;
+    uint16_t bound = 0;
+    if (at(offset) == 0x22 && at(offset + 1) == low) { // CMP $l, #k
+        bound = 0x100 | at(offset + 2);
+        offset += 3;
+    }
+    if (at(offset) != 0x2e || (at(offset + 1) << 8 | at(offset + 2)) != pc) return false; // JNO back
+    offset += 3;
+    if (pc + offset > 0xffff) return false;
+
+    // Nothing the loop changes can be read as anything else
+    if (!valid(high) || !valid(low) || low == high) return false;
+    if (copy && (!valid(source) || low == source || loaded == low || loaded == high || loaded == source)) return false;
+    if (!copy && !immediate && (!valid(value) || value == low)) return false;
+
+    if (copy) {
+        d.x = cpu->get_register_by_address(high);
+        d.y = cpu->get_register_by_address(low);
+        d.z = cpu->get_register_by_address(loaded);
+        d.immediate = source;
+    }
+    d.op = copy ? Op::COPY : Op::FILL;
+    d.middle = bound;
+    d.address = pc + offset;
+    return true;
+}
+
+// Runs as much of a FILL/COPY loop at pc as the budget (left, in instructions) allows, in one go.
+// Returns how many instructions that was, 0 if it has to be stepped instead.
+uint64_t DecodedEngine::bulk(uint16_t& pc, const DecodedInstruction* op, uint64_t left)
+{
+    CPU& c = *cpu;
+    RAM& ram = c.ram;
+
+    c.sync_flags();
+    if (c.overflow) return 0; // JNO leaves after the first time around
+
+    bool copy = op->op == Op::COPY;
+    bool bounded = op->middle & 0x100;
+    int bound = op->middle & 0xff;
+    int per_loop = 3 + copy + bounded;
+    int start = *op->y;
+
+    // How many times around until JNO leaves: INC $l wraps, or CMP $l, #k overflows once $l >= 256 - k
+    uint32_t count = 256 - start;
+    if (bounded) {
+        if (bound == 0 || start == 255) return 0; // Never leaves, or wraps around the page first
+        int limit = 256 - bound;
+        count = start + 1 >= limit ? 1 : limit - start;
+    }
+
+    bool leaves = count <= left / per_loop;
+    if (!leaves) count = left / per_loop;
+    if (count == 0) return 0;
+
+    uint16_t to = *op->x << 8 | start;
+    if (to < op->address && to + count > pc) return 0; // Writes over its own code
+    uint16_t from = copy ? *c.get_register_by_address(op->immediate) << 8 | start : to;
+    if (!ram.plain(to, count) || !ram.plain(from, count)) return 0; // Devices and ROM get every byte, one at a time
+
+    if (copy) {
+        ram.copy(to, from, count);
+        *op->z = ram.memory[from + count - 1]; // Read before the last store, which can't have changed it
+    }
+    else ram.fill(to, *op->z, count);
+    bulk_loops[copy]++;
+    bulk_bytes[copy] += count;
+
+    *op->y = start + count;
+    if (bounded) c.update_flags_with_number(*op->y + bound);
+    else if (leaves) c.update_flags_with_number(256); // INC wrapped, otherwise it left the flags alone
+
+    pc = leaves ? op->address : pc;
+    return count * per_loop;
+}
+
+int DecodedEngine::execute(uint64_t budget)
+{
+    #if DECODED_THREADED
+    #define DECODED_OP_LABEL(name) &&op_##name,
+    static const void* const labels[] = { DECODED_OPS(DECODED_OP_LABEL) };
+    #undef DECODED_OP_LABEL
+    #else
+    static const void* const labels[] = { nullptr };
+    #endif
+
+    if (handlers == nullptr) {
+        handlers = labels;
+        flush();
+    }
+
+    CPU& c = *cpu;
+    RAM& ram = c.ram;
+    ram.code_written = code_written;
+    ram.code_context = this;
+
+    uint16_t pc = ram.pc;
+    uint64_t executed = 0;
+    DecodedInstruction* op;
+    int result = -1;
+
+    #if DECODED_THREADED
+    #define REDISPATCH() goto *op->handler
+    #else
+    #define DECODED_OP_CASE(name) case Op::name: goto op_##name;
+    #define REDISPATCH() goto dispatch
+    #endif
+
+    #define DISPATCH() \
+        if (executed == budget) goto out; \
+        executed++; \
+        op = &cache[pc]; \
+        REDISPATCH()
+
+    #define NEXT() pc = op->next; DISPATCH()
+    // After a store: ends the run there if a device asked, the slot may be gone so next is a copy
+    #define STORED(write) { int written = write; pc = next; if (written == WRITE_YIELD) goto out; } DISPATCH()
+    #define REGISTER_ADDRESS(high, low) (uint16_t)((*(high) << 8) | *(low))
+    #define JUMP_IF(condition, target) c.sync_flags(); pc = (condition) ? (target) : op->next; DISPATCH()
+    // Between the two halves of a fused pair, stops at the second one if the budget ran out
+    #define FUSED() \
+        if (executed == budget) { pc = op->middle; goto out; } \
+        executed++; \
+        fused[(int)op->op - (int)DECODED_FUSED_FIRST]++
+
+    try {
+    DISPATCH();
+
+    #if !DECODED_THREADED
+    dispatch:
+    switch (op->op) {
+        DECODED_OPS(DECODED_OP_CASE)
+    }
+    #undef DECODED_OP_CASE
+    #endif
+
+    op_DECODE:
+        decode(pc);
+        REDISPATCH();
+    op_INVALID:
+        fault(Errors::SIGABRT);
+    op_NOP:
+        NEXT();
+    op_MOV:
+        *op->x = *op->y;
+        NEXT();
+    op_LOAD:
+        *op->x = ram.get_from_address(op->address);
+        NEXT();
+    op_LOAD_INDIRECT: // [$y,$z] has $y as the low byte here, same as CPU::tick
+        *op->x = ram.get_from_address(REGISTER_ADDRESS(op->z, op->y));
+        NEXT();
+    op_NOT:
+        *op->x = ~(*op->x);
+        NEXT();
+    op_AND:
+        *op->x = (*op->x) & (*op->y);
+        NEXT();
+    op_JMP:
+        pc = op->address;
+        DISPATCH();
+    op_JMP_INDIRECT:
+        pc = REGISTER_ADDRESS(op->x, op->y);
+        DISPATCH();
+    op_CMP:
+        c.update_flags_with_number((int64_t)*op->x + (int64_t)*op->y);
+        NEXT();
+    op_JZ:              JUMP_IF(c.zero, op->address);
+    op_JZ_INDIRECT:     JUMP_IF(c.zero, REGISTER_ADDRESS(op->x, op->y));
+    op_JNZ:             JUMP_IF(!c.zero, op->address);
+    op_JNZ_INDIRECT:    JUMP_IF(!c.zero, REGISTER_ADDRESS(op->x, op->y));
+    op_JU:              JUMP_IF(c.underflow, op->address);
+    op_JU_INDIRECT:     JUMP_IF(c.underflow, REGISTER_ADDRESS(op->x, op->y));
+    op_JNU:             JUMP_IF(!c.underflow, op->address);
+    op_JNU_INDIRECT:    JUMP_IF(!c.underflow, REGISTER_ADDRESS(op->x, op->y));
+    op_JO:              JUMP_IF(c.overflow, op->address);
+    op_JO_INDIRECT:     JUMP_IF(c.overflow, REGISTER_ADDRESS(op->x, op->y));
+    op_JNO:             JUMP_IF(!c.overflow, op->address);
+    op_JNO_INDIRECT:    JUMP_IF(!c.overflow, REGISTER_ADDRESS(op->x, op->y));
+    op_PUSH:
+        c.stack.push(*op->y);
+        NEXT();
+    op_POP:
+        *op->x = c.stack.pop();
+        NEXT();
+    op_ADD:
+    op_SUB: { // SUB adds too, same as CPU::tick
+        int64_t result = (int64_t)*op->x + (int64_t)*op->y;
+        c.update_flags_with_number(result);
+        *op->x = (byte)result;
+        NEXT();
+    }
+    op_INC:
+        (*op->x)++;
+        if (*op->x == 0) c.update_flags_with_number(256);
+        NEXT();
+    op_DEC:
+        (*op->x)--;
+        if (*op->x == 255) c.update_flags_with_number(-1);
+        NEXT();
+    op_MUL: {
+        int64_t result = (int64_t)*op->x * (int64_t)*op->y;
+        c.update_flags_with_number(result);
+        *op->x = (byte)result;
+        NEXT();
+    }
+    op_DIV:
+        *op->x = c.alu_div(*op->x, *op->y);
+        NEXT();
+    op_PWR:
+        *op->x = c.alu_pwr(*op->x, *op->y);
+        NEXT();
+    op_SQRT:
+        *op->x = c.alu_sqrt(*op->x);
+        NEXT();
+    op_FSQRT:
+        *op->x = c.alu_fsqrt(*op->x);
+        NEXT();
+    op_MOD: {
+        if (*op->y == 0) fault(Errors::SIGFPE);
+        uint64_t result = (uint64_t)*op->x % (uint64_t)*op->y;
+        c.update_flags_with_number(result);
+        *op->x = (byte)result;
+        NEXT();
+    }
+    op_CALL:
+        c.stack.push_16bit(op->next);
+        pc = op->address;
+        DISPATCH();
+    op_CALL_INDIRECT: {
+        uint16_t target = REGISTER_ADDRESS(op->x, op->y);
+        c.stack.push_16bit(op->next);
+        pc = target;
+        DISPATCH();
+    }
+    op_RET:
+        pc = c.stack.pop_16bit();
+        DISPATCH();
+    op_STORE: {
+        uint16_t next = op->next; // The write may invalidate this very slot
+        STORED(ram.write(op->address, *op->y));
+    }
+    op_STORE_INDIRECT: {
+        uint16_t next = op->next;
+        STORED(ram.write(REGISTER_ADDRESS(op->x, op->y), *op->z));
+    }
+    op_CAS: {
+        uint16_t next = op->next;
+        STORED(c.cas(REGISTER_ADDRESS(op->x, op->y), *op->z));
+    }
+    op_XADD: {
+        uint16_t next = op->next;
+        STORED(c.xadd(REGISTER_ADDRESS(op->x, op->y), op->z));
+    }
+    op_HALT:
+        result = *op->y;
+        pc = op->next;
+        goto out;
+    op_FILL:
+    op_COPY: {
+        uint64_t ran = bulk(pc, op, budget - executed + 1);
+        if (ran > 0) {
+            executed += ran - 1;
+            DISPATCH();
+        }
+
+        // Only the first instruction, the loop goes on through the INC's slot
+        uint16_t next = op->next;
+        if (op->op == Op::FILL) {
+            STORED(ram.write(REGISTER_ADDRESS(op->x, op->y), *op->z));
+        }
+        *op->z = ram.get_from_address(REGISTER_ADDRESS(c.get_register_by_address(op->immediate), op->y));
+        pc = next;
+        DISPATCH();
+    }
+
+    op_CMP_JUMP:
+        c.update_flags_with_number((int64_t)*op->x + (int64_t)*op->y);
+        FUSED();
+        JUMP_IF(*op->z, op->address);
+    op_CMP_JUMP_NOT:
+        c.update_flags_with_number((int64_t)*op->x + (int64_t)*op->y);
+        FUSED();
+        JUMP_IF(!*op->z, op->address);
+    op_INC_JUMP:
+        if (++(*op->x) == 0) c.update_flags_with_number(256);
+        FUSED();
+        JUMP_IF(*op->z, op->address);
+    op_INC_JUMP_NOT:
+        if (++(*op->x) == 0) c.update_flags_with_number(256);
+        FUSED();
+        JUMP_IF(!*op->z, op->address);
+    op_DEC_JUMP:
+        if (--(*op->x) == 255) c.update_flags_with_number(-1);
+        FUSED();
+        JUMP_IF(*op->z, op->address);
+    op_DEC_JUMP_NOT:
+        if (--(*op->x) == 255) c.update_flags_with_number(-1);
+        FUSED();
+        JUMP_IF(!*op->z, op->address);
+    op_MOV_STORE: {
+        *op->x = *op->y;
+        FUSED();
+        uint16_t next = op->next;
+        STORED(ram.write(op->address, *op->z));
+    }
+
+    }
+    catch (...) {
+        // The faulting instruction doesn't count as retired
+        ram.pc = pc;
+        c.retired += executed - 1;
+        throw;
+    }
+
+    #undef DISPATCH
+    #undef REDISPATCH
+    #undef NEXT
+    #undef STORED
+    #undef REGISTER_ADDRESS
+    #undef JUMP_IF
+    #undef FUSED
+
+    out:
+    ram.pc = pc;
+    c.retired += executed;
+    return result;
+}
+
+void DecodedEngine::report(FILE* out)
+{
+    #define DECODED_OP_NAME(name) #name,
+    static const char* const names[] = { DECODED_FUSED_OPS(DECODED_OP_NAME) };
+    #undef DECODED_OP_NAME
+
+    for (int i = 0; i < DECODED_FUSED_COUNT; i++) {
+        fprintf(out, "%s%s %llu", i == 0 ? "Fused: " : ", ", names[i], (unsigned long long)fused[i]);
+    }
+    fprintf(out, "\nBulk: FILL %llu (%llu bytes), COPY %llu (%llu bytes)\n",
+        (unsigned long long)bulk_loops[0], (unsigned long long)bulk_bytes[0], (unsigned long long)bulk_loops[1], (unsigned long long)bulk_bytes[1]);
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include "def.h"
+#include <cstdio>
+
+struct CPU;
+
+// Pairs run as one instruction (see DECODED_FUSION), most loops end in one of these.
+// The jumps are any conditional jump to [#0], z points to the flag it reads.
+#define DECODED_FUSED_OPS(X) \
+    X(CMP_JUMP) X(CMP_JUMP_NOT) X(INC_JUMP) X(INC_JUMP_NOT) X(DEC_JUMP) X(DEC_JUMP_NOT) \
+    X(MOV_STORE)
+
+// Every kind of decoded instruction. Forms that only differ in where an operand
+// comes from share a kind: immediates are pointed to just like registers.
+#define DECODED_OPS(X) \
+    X(DECODE) X(INVALID) X(NOP) \
+    X(MOV) X(LOAD) X(LOAD_INDIRECT) X(NOT) X(AND) \
+    X(JMP) X(JMP_INDIRECT) X(CMP) \
+    X(JZ) X(JZ_INDIRECT) X(JNZ) X(JNZ_INDIRECT) \
+    X(JU) X(JU_INDIRECT) X(JNU) X(JNU_INDIRECT) \
+    X(JO) X(JO_INDIRECT) X(JNO) X(JNO_INDIRECT) \
+    X(PUSH) X(POP) \
+    X(ADD) X(INC) X(SUB) X(DEC) X(MUL) X(DIV) X(PWR) X(SQRT) X(FSQRT) X(MOD) \
+    X(CALL) X(CALL_INDIRECT) X(RET) \
+    X(STORE) X(STORE_INDIRECT) X(CAS) X(XADD) \
+    X(HALT) X(FILL) X(COPY) \
+    DECODED_FUSED_OPS(X)
+
+#define DECODED_OP_ENUM(name) name,
+enum struct Op : byte {
+    DECODED_OPS(DECODED_OP_ENUM)
+};
+#undef DECODED_OP_ENUM
+
+#define DECODED_FUSED_FIRST Op::CMP_JUMP
+#define DECODED_FUSED_COUNT ((int)Op::MOV_STORE - (int)DECODED_FUSED_FIRST + 1)
+
+// Direct-threaded dispatch needs the labels-as-values extension, a switch is used otherwise
+#ifndef DECODED_THREADED
+#if defined(__GNUC__) || defined(__clang__)
+#define DECODED_THREADED 1
+#else
+#define DECODED_THREADED 0
+#endif
+#endif
+
+// Decodes CMP/INC/DEC + a conditional jump and MOV + STORE [#0] into one slot: one dispatch and the
+// two instructions' operands at hand. The second one keeps its own slot, for jumps that land on it.
+#ifndef DECODED_FUSION
+#define DECODED_FUSION 1
+#endif
+
+// Recognizes the loops that fill or copy a page a byte at a time and runs them with RAM::fill/copy:
+//   [MOV $v, [$l,$s]]  STORE [$h,$l], $v|#0  INC $l  [CMP $l, #k]  JNO back to the start
+// The slot has the first instruction's operands, and runs just that when the loop can't be done at once.
+#ifndef DECODED_IDIOMS
+#define DECODED_IDIOMS 1
+#endif
+
+#define DECODED_MAX_SPAN 16 // Bytes one slot can be decoded from, the longest loop above
+
+struct DecodedInstruction {
+    const void* handler;    // Where to jump to run it (threaded dispatch only)
+    byte* x;                // Operands, resolved to a register or to immediate below
+    byte* y;
+    byte* z;
+    uint16_t address;       // 16-bit immediate (memory address or jump target), FILL/COPY: where the loop leaves to
+    uint16_t next;          // Address of the following instruction
+    uint16_t middle;        // Fused pairs: address of the second instruction. FILL/COPY: 0x100 | k if it has CMP $l, #k
+    byte immediate;
+    Op op;
+};
+
+// Decodes each address once, the first time it's executed, and runs from the cache
+// after that. Writes to decoded bytes (STORE, PUSH, CALL...) drop the affected slots.
+struct DecodedEngine {
+    private:
+    CPU* cpu;
+    DecodedInstruction* cache; // One slot per address
+    const void* const* handlers;
+    uint64_t fused[DECODED_FUSED_COUNT]; // Times each fused pair ran
+    uint64_t bulk_loops[2];             // FILL and COPY loops run at once
+    uint64_t bulk_bytes[2];
+
+    void decode(uint16_t pc);
+    bool decode_loop(uint16_t pc, DecodedInstruction& d);
+    uint64_t bulk(uint16_t& pc, const DecodedInstruction* op, uint64_t left);
+    static void code_written(void* context, uint16_t address);
+
+    public:
+    DecodedEngine(CPU* cpu);
+    ~DecodedEngine();
+
+    int execute(uint64_t budget); // Same contract as CPU::execute
+    void invalidate(uint16_t address); // Drops every instruction containing this byte
+    void flush(); // Drops everything
+    void report(FILE* out); // How many times each fused pair and bulk loop ran
+};
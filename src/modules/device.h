@@ -0,0 +1,13 @@
+#pragma once
+#include "def.h"
+
+// Something mapped over pages of the address space with RAM::map(). It gets every guest read and
+// write there, with the full address, so one device can be mapped over several ranges.
+struct Device {
+    virtual ~Device() {}
+    virtual byte read(uint16_t address) = 0;
+    virtual bool write(uint16_t address, byte data) = 0; // True if the engine has to stop after this instruction
+    // True if reading address changes nothing and gives the same until the next event, so a loop
+    // polling it can be skipped (see IdleLoop)
+    virtual bool steady(uint16_t address) { return false; }
+};
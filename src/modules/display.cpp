@@ -0,0 +1,26 @@
+#include "display.h"
+#include "headless_display.h"
+#include "glfw_display.h"
+#include "errors.h"
+#include <chrono>
+#include <thread>
+
+void Display::wait(double seconds)
+{
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+Display* create_display(DisplayBackend backend)
+{
+    switch (backend) {
+        case DisplayBackend::HEADLESS: return new HeadlessDisplay();
+        case DisplayBackend::GLFW: {
+            #ifdef NEODYMIUM_GLFW
+            return new GLFWDisplay();
+            #else
+            raise(Errors::BACKEND_UNAVAILABLE);
+            #endif
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "def.h"
+
+enum struct DisplayBackend : byte {
+    HEADLESS,   // Keeps frames in memory only, no window
+    GLFW,       // OpenGL window (only when built with NEODYMIUM_GLFW)
+};
+
+struct Keyboard;
+
+// Where the screen sends its frames
+struct Display {
+    virtual ~Display() {}
+    virtual void present(const byte* framebuffer, bool changed) = 0; // changed: written since the last frame, or it's the same one again
+    virtual bool poll() = 0; // Handles events, false once the window was closed
+    virtual void terminate() {}
+    virtual void attach(Keyboard* keyboard) {} // Keys pressed go there, displays without a window have none
+    virtual void wait(double seconds); // Sleeps, windows wake up early on an event (after handling it like poll())
+};
+
+Display* create_display(DisplayBackend backend);
@@ -4,10 +4,13 @@
 
 const std::unordered_map<Errors, const char*> errors_dict = {
     {Errors::SIGABRT, "Abnormal termination."},                 {Errors::SIGSEGV, "Segmentation fault."},
-    {Errors::SIGKILL, "Signal killed."},
+    {Errors::SIGKILL, "Signal killed."},                        {Errors::SIGFPE, "Floating point exception."},
     {Errors::OS_UNSUPPORTED, "Your OS isn't supported."},       {Errors::NO_FILE_ARG, "No file argument provided."},
     {Errors::FILE_NOT_FOUND, "File not found."},                {Errors::FILE_TOO_BIG, "File too big."},
-    {Errors::ERROR_OPENING_FILE, "Error opening file."},        
+    {Errors::ERROR_OPENING_FILE, "Error opening file."},        {Errors::BACKEND_UNAVAILABLE, "Display backend not built in."},
+    {Errors::BAD_DUMP_PATTERN, "Bad --dump-frame pattern, it takes one frame number and only works headless."},
+    {Errors::UNKNOWN_ENGINE, "Unknown execution engine."},     {Errors::BAD_SNAPSHOT, "Not a snapshot file."},
+    {Errors::BAD_NATIVE, "Not native code built from this program."},
 };
 
 void raise(Errors code) {
@@ -21,4 +24,12 @@ void raise(Errors code) {
     }
     
     exit(scode - 128);
-}
\ No newline at end of file
+}
+
+void fault(Errors code) {
+    throw VMFault{code};
+}
+
+const char* error_message(Errors code) {
+    return errors_dict.at(code);
+}
@@ -5,6 +5,7 @@
 
 enum struct Errors : byte{ // May add others just in case
     SIGABRT             =   6,
+    SIGFPE              =   8,
     SIGKILL             =   9,
     SIGSEGV             =   11,
     // Non-signal errors (1-128)
@@ -13,6 +14,19 @@ enum struct Errors : byte{ // May add others just in case
     FILE_NOT_FOUND      =   NON_SIGNAL_PREFIX + 3,
     FILE_TOO_BIG        =   NON_SIGNAL_PREFIX + 4,
     ERROR_OPENING_FILE  =   NON_SIGNAL_PREFIX + 5,
+    BACKEND_UNAVAILABLE =   NON_SIGNAL_PREFIX + 6,
+    BAD_DUMP_PATTERN    =   NON_SIGNAL_PREFIX + 7,
+    UNKNOWN_ENGINE      =   NON_SIGNAL_PREFIX + 8,
+    BAD_SNAPSHOT        =   NON_SIGNAL_PREFIX + 9,
+    BAD_NATIVE          =   NON_SIGNAL_PREFIX + 10,
 };
 
-void raise(Errors code);
\ No newline at end of file
+// Error raised by a guest program (bad register, unknown opcode...). Only the VM
+// that caused it stops, whoever runs it decides what to do (main() raises it).
+struct VMFault {
+    Errors code;
+};
+
+void raise(Errors code); // Prints the error and exits the process
+[[noreturn]] void fault(Errors code); // Throws a VMFault
+const char* error_message(Errors code);
\ No newline at end of file
@@ -0,0 +1,204 @@
+#ifdef NEODYMIUM_GLFW
+#include "glfw_display.h"
+#include "screen.h"
+#include "keyboard.h"
+#include "errors.h"
+#include <cstddef>
+#include <cstring>
+
+// Pixel buffer objects aren't in the GL 1.1 the headers promise, they're looked up at run time
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER  0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW          0x88E0
+#endif
+
+typedef void (APIENTRY *GenBuffers)(GLsizei count, GLuint* buffers);
+typedef void (APIENTRY *BindBuffer)(GLenum target, GLuint buffer);
+typedef void (APIENTRY *BufferData)(GLenum target, ptrdiff_t size, const void* data, GLenum usage);
+typedef void (APIENTRY *DeleteBuffers)(GLsizei count, const GLuint* buffers);
+
+static GenBuffers gen_buffers = nullptr;
+static BindBuffer bind_buffer = nullptr;
+static BufferData buffer_data = nullptr;
+static DeleteBuffers delete_buffers = nullptr;
+
+GLFWDisplay::GLFWDisplay() 
+: window(nullptr), keyboard(nullptr), requested(false), stopping(false), width(WIDTH * ZOOM), height(HEIGHT * ZOOM), texture(0), pixel_buffer(0)
+{
+    if (!glfwInit()) 
+    {
+        glfwTerminate();
+        raise(Errors::SIGABRT); // Abnormal termination
+    }
+
+    window = glfwCreateWindow(
+        WIDTH * ZOOM,
+        HEIGHT * ZOOM,
+        "Neodymium vScreen",
+        NULL,
+        NULL
+    );
+
+    if (!window) 
+    {
+        glfwTerminate();
+        raise(Errors::SIGABRT);
+    }
+
+    glfwSetWindowUserPointer(window, this);
+    glfwSetKeyCallback(window, key_pressed);
+
+    // The context belongs to the render thread from now on
+    renderer = std::thread(&GLFWDisplay::render, this);
+};
+
+GLFWDisplay::~GLFWDisplay()
+{
+    terminate();
+}
+
+void GLFWDisplay::render()
+{
+    glfwMakeContextCurrent(window);
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // Rows are WIDTH * 3 bytes, not padded
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, WIDTH, HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glEnable(GL_TEXTURE_2D);
+
+    gen_buffers = (GenBuffers)glfwGetProcAddress("glGenBuffers");
+    bind_buffer = (BindBuffer)glfwGetProcAddress("glBindBuffer");
+    buffer_data = (BufferData)glfwGetProcAddress("glBufferData");
+    delete_buffers = (DeleteBuffers)glfwGetProcAddress("glDeleteBuffers");
+    if (gen_buffers && bind_buffer && buffer_data && delete_buffers) gen_buffers(1, &pixel_buffer);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return requested || stopping; });
+        if (stopping) break;
+        requested = false;
+        lock.unlock();
+
+        if (frames.acquire()) upload(frames.front());
+
+        glViewport(0, 0, width.load(std::memory_order_relaxed), height.load(std::memory_order_relaxed));
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        // The first row of the framebuffer at the bottom, like glDrawPixels put it and --dump-frame writes it
+        glBegin(GL_QUADS);
+        glTexCoord2f(0, 0); glVertex2f(-1, -1);
+        glTexCoord2f(1, 0); glVertex2f( 1, -1);
+        glTexCoord2f(1, 1); glVertex2f( 1,  1);
+        glTexCoord2f(0, 1); glVertex2f(-1,  1);
+        glEnd();
+
+        glfwSwapBuffers(window); // Waits for vsync, only this thread does
+        lock.lock();
+    }
+
+    if (pixel_buffer != 0) delete_buffers(1, &pixel_buffer);
+    glDeleteTextures(1, &texture);
+    glfwMakeContextCurrent(NULL);
+}
+
+void GLFWDisplay::upload(const byte* framebuffer)
+{
+    if (pixel_buffer == 0) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, framebuffer);
+        return;
+    }
+
+    // A new buffer every time (the driver recycles them), so this never waits for the last upload to finish
+    bind_buffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffer);
+    buffer_data(GL_PIXEL_UNPACK_BUFFER, FRAMEBUFFER_SIZE, framebuffer, GL_STREAM_DRAW);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, NULL); // From offset 0 of the buffer
+    bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void GLFWDisplay::present(const byte* framebuffer, bool changed)
+{
+    if (changed) {
+        memcpy(frames.back(), framebuffer, FRAMEBUFFER_SIZE);
+        frames.publish();
+    }
+
+    // If it's still drawing the last one, the request waits for it and the newest frame gets drawn then
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requested = true;
+    }
+    wake.notify_one();
+};
+
+bool GLFWDisplay::poll()
+{
+    glfwPollEvents();
+
+    int w, h;
+    glfwGetFramebufferSize(window, &w, &h);
+    width.store(w, std::memory_order_relaxed);
+    height.store(h, std::memory_order_relaxed);
+
+    return !glfwWindowShouldClose(window);
+};
+
+// GLFW key to what the guest reads, 0 for keys it doesn't get
+static byte key_code(int key)
+{
+    if (key >= GLFW_KEY_SPACE && key <= GLFW_KEY_GRAVE_ACCENT) return key; // GLFW numbers these by their ASCII
+    switch (key) {
+        case GLFW_KEY_BACKSPACE: return KEY_BACKSPACE;
+        case GLFW_KEY_TAB: return KEY_TAB;
+        case GLFW_KEY_ENTER: case GLFW_KEY_KP_ENTER: return KEY_ENTER;
+        case GLFW_KEY_ESCAPE: return KEY_ESCAPE;
+        case GLFW_KEY_DELETE: return KEY_DELETE;
+        case GLFW_KEY_UP: return KEY_UP;
+        case GLFW_KEY_DOWN: return KEY_DOWN;
+        case GLFW_KEY_LEFT: return KEY_LEFT;
+        case GLFW_KEY_RIGHT: return KEY_RIGHT;
+    }
+    return 0;
+}
+
+void GLFWDisplay::key_pressed(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    GLFWDisplay* display = (GLFWDisplay*)glfwGetWindowUserPointer(window);
+    if (action == GLFW_RELEASE || display->keyboard == nullptr) return;
+
+    byte code = key_code(key);
+    if (code != 0) display->keyboard->queue.push(code);
+}
+
+void GLFWDisplay::wait(double seconds)
+{
+    glfwWaitEventsTimeout(seconds);
+}
+
+void GLFWDisplay::attach(Keyboard* keyboard)
+{
+    this->keyboard = keyboard;
+}
+
+void GLFWDisplay::terminate()
+{
+    if (window == nullptr) return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    renderer.join();
+
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    window = nullptr;
+}
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+#ifdef NEODYMIUM_GLFW
+#include "display.h"
+#include "triple_buffer.h"
+#include <GLFW/glfw3.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// The window is drawn by a render thread of its own, so waiting for vsync in glfwSwapBuffers never
+// stops the VM. present() copies the framebuffer into a TripleBuffer and asks for a frame, the render
+// thread draws the newest one it has. Events are still handled on the VM's thread (GLFW wants them
+// on the main one) in poll().
+//
+// The framebuffer is kept in a texture drawn over the whole window, and only uploaded again when the
+// program wrote to it. Uploads go through a pixel buffer object when the driver has them (GL 2.1),
+// straight from memory otherwise.
+//
+// Key presses (and repeats) go into the keyboard's queue from the key callback, which runs in poll()
+// and wait().
+struct GLFWDisplay : Display {
+    private:
+    GLFWwindow* window;
+    Keyboard* keyboard;
+    TripleBuffer frames;
+    std::thread renderer;
+    std::mutex mutex;               // Only guards the two below, never held while drawing
+    std::condition_variable wake;
+    bool requested;                 // A frame to draw
+    bool stopping;
+    std::atomic<int> width;         // Framebuffer size of the window, read on the main thread by poll()
+    std::atomic<int> height;
+
+    // Render thread only
+    GLuint texture;
+    GLuint pixel_buffer; // 0 if there are none
+
+    void render();
+    void upload(const byte* framebuffer);
+    static void key_pressed(GLFWwindow* window, int key, int scancode, int action, int mods);
+
+    public:
+    GLFWDisplay();
+    ~GLFWDisplay();
+    void present(const byte* framebuffer, bool changed) override; // Never waits for the render thread
+    bool poll() override;
+    void terminate() override; // Stops the render thread and closes the window
+    void attach(Keyboard* keyboard) override;
+    void wait(double seconds) override;
+};
+#endif
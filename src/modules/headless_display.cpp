@@ -0,0 +1,25 @@
+#include "headless_display.h"
+#include "image.h"
+#include <cstdio>
+#include <cstring>
+
+HeadlessDisplay::HeadlessDisplay()
+: frame(), frames(0), dump_pattern(nullptr)
+{}
+
+void HeadlessDisplay::present(const byte* framebuffer, bool changed)
+{
+    if (changed) memcpy(frame, framebuffer, FRAMEBUFFER_SIZE);
+
+    if (dump_pattern != nullptr) {
+        // Not a format for snprintf, it comes from the command line: only the first %d is replaced
+        const char* number = strstr(dump_pattern, "%d");
+        char path[4096];
+        if (number == nullptr) snprintf(path, sizeof(path), "%s", dump_pattern);
+        else snprintf(path, sizeof(path), "%.*s%llu%s", (int)(number - dump_pattern), dump_pattern, (unsigned long long)frames, number + 2);
+        write_image(path, frame, WIDTH, HEIGHT);
+    }
+    frames++;
+}
+
+bool HeadlessDisplay::poll() { return true; } // Nothing can close us
@@ -0,0 +1,13 @@
+#pragma once
+#include "display.h"
+#include "screen.h"
+
+struct HeadlessDisplay : Display {
+    byte frame[FRAMEBUFFER_SIZE]; // Last presented frame
+    uint64_t frames;
+    const char* dump_pattern; // If set, every presented frame is written there (its "%d" gets the frame number)
+
+    HeadlessDisplay();
+    void present(const byte* framebuffer, bool changed) override;
+    bool poll() override;
+};
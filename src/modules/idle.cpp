@@ -0,0 +1,120 @@
+#include "idle.h"
+#include "cpu.h"
+#include "cfg.h"
+#include "casts.h"
+#include "opcodes.h"
+#include <cstring>
+
+// Only change registers and flags, or pc. Loads are checked again in step(), a device read can do more.
+static bool harmless(byte opcode)
+{
+    switch (opcode) {
+        case 0x00: case 0x01: case 0x02: case 0x03: case 0x04:
+        case 0x10: case 0x11: case 0x12:
+        case 0x20: case 0x22: case 0x23:
+            return true;
+    }
+    return is_conditional_jump(opcode) || (opcode >= 0x40 && opcode <= 0x4f);
+}
+
+IdleLoop::IdleLoop(CPU* cpu)
+: cpu(cpu), started(std::chrono::steady_clock::now()), length(0), found(0), skipped(0), slept(0)
+{
+}
+
+bool IdleLoop::head(uint16_t& address)
+{
+    const byte* memory = cpu->ram.memory;
+    uint16_t pc = cpu->ram.pc;
+
+    // Falling through conditional jumps, until one jumps back to where it came from
+    for (int i = 0; i < IDLE_MAX_LOOP; i++) {
+        byte opcode = memory[pc];
+        if (!harmless(opcode)) return false;
+
+        if (is_jump(opcode) || is_conditional_jump(opcode)) {
+            uint16_t target = bytes_to_uint16(memory[(uint16_t)(pc + 2)], memory[(uint16_t)(pc + 1)]);
+            if (target <= pc && pc - target < IDLE_MAX_LOOP * MAX_INSTRUCTION_SIZE) {
+                address = target;
+                return true;
+            }
+            if (is_jump(opcode)) {
+                pc = target;
+                continue;
+            }
+        }
+        pc += instruction_length(opcode);
+    }
+    return false;
+}
+
+bool IdleLoop::step()
+{
+    RAM& ram = cpu->ram;
+    byte opcode = ram.memory[ram.pc];
+    if (!harmless(opcode)) return false;
+
+    // Device registers have to read the same until the next event, and without side effects
+    if (opcode == 0x03 || opcode == 0x04) {
+        byte a = ram.memory[(uint16_t)(ram.pc + 2)], b = ram.memory[(uint16_t)(ram.pc + 3)];
+        uint16_t address;
+        if (opcode == 0x03) address = bytes_to_uint16(b, a);
+        else if ((a >= REGISTERS && a != 0xff) || (b >= REGISTERS && b != 0xff)) address = 0; // Faults in tick(), before reading
+        else address = bytes_to_uint16(*cpu->get_register_by_address(a), *cpu->get_register_by_address(b));
+
+        if ((ram.page_flags[address / PAGE_SIZE] & PAGE_DEVICE) && !ram.devices[address / PAGE_SIZE]->steady(address)) return false;
+        // Waiting for another core
+        if (ram.shared && !(ram.page_flags[address / PAGE_SIZE] & PAGE_DEVICE)) return false;
+    }
+
+    cpu->tick();
+    cpu->retired++;
+    return true;
+}
+
+bool IdleLoop::check(uint64_t budget)
+{
+    uint16_t start;
+    if (!head(start)) return false;
+
+    // Up to the head, then once around, keeping what it started with
+    int steps = 0;
+    while (cpu->ram.pc != start) {
+        if (steps == IDLE_MAX_LOOP || (uint64_t)steps == budget || !step()) return false;
+        steps++;
+    }
+    budget -= steps;
+
+    byte registers[REGISTERS];
+    memcpy(registers, cpu->registers, REGISTERS);
+    byte always_zero = cpu->ALWAYS_ZERO;
+    cpu->sync_flags();
+    bool zero = cpu->zero, underflow = cpu->underflow, overflow = cpu->overflow;
+
+    int around = 0;
+    do {
+        if (around == IDLE_MAX_LOOP || (uint64_t)around == budget || !step()) return false;
+        around++;
+    } while (cpu->ram.pc != start);
+
+    cpu->sync_flags();
+    if (memcmp(registers, cpu->registers, REGISTERS) != 0 || always_zero != cpu->ALWAYS_ZERO) return false;
+    if (zero != cpu->zero || underflow != cpu->underflow || overflow != cpu->overflow) return false;
+
+    length = around;
+    found++;
+    return true;
+}
+
+double IdleLoop::rate() const
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    double busy = elapsed.count() - slept;
+    return busy > 0 && cpu->retired > skipped ? (cpu->retired - skipped) / busy : 0;
+}
+
+void IdleLoop::report(FILE* out)
+{
+    fprintf(out, "Idle: %llu loops, %llu instructions skipped, %.3fs waiting for frames\n",
+        (unsigned long long)found, (unsigned long long)skipped, slept);
+}
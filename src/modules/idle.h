@@ -0,0 +1,35 @@
+#pragma once
+#include "def.h"
+#include <chrono>
+#include <cstdio>
+
+#define IDLE_MAX_LOOP   16   // Instructions around, longer loops aren't looked at
+#define IDLE_CHECK      4096 // Instructions between two checks while an event is pending
+
+struct CPU;
+
+// Finds loops the program can't get out of on its own: a JMP to itself, or a poll that reads the
+// same every time around (registers, memory the loop doesn't write, device registers that only
+// change on an event) and leaves registers and flags as they were. Nothing changes until the next
+// event then, CPU::execute() skips to it instead of running them.
+struct IdleLoop {
+    private:
+    CPU* cpu;
+    std::chrono::steady_clock::time_point started;
+
+    bool head(uint16_t& address);   // Where the loop pc is in starts, walking the code without running it
+    bool step();                    // Runs the instruction at pc, unless it could change more than registers and flags
+
+    public:
+    int length;         // Instructions around the one check() found
+    uint64_t found;     // Times check() found one
+    uint64_t skipped;   // Instructions not run because of them
+    double slept;       // Seconds waited for a frame instead
+
+    IdleLoop(CPU* cpu);
+    // Runs up to twice around the loop pc is in (for real, at most budget instructions), true if
+    // it's idle. pc is at its head then.
+    bool check(uint64_t budget);
+    double rate() const; // Instructions per second the CPU runs when it isn't idle, 0 before it ran any
+    void report(FILE* out);
+};
@@ -0,0 +1,94 @@
+#include "image.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+bool write_ppm(const char* path, const byte* rgb, int width, int height)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) return false;
+
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    for (int y = height - 1; y >= 0; y--) {
+        fwrite(&rgb[y * width * 3], 1, width * 3, file);
+    }
+
+    return fclose(file) == 0;
+}
+
+static uint32_t crc32(const byte* data, size_t size, uint32_t crc = 0)
+{
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put_u32(std::vector<byte>& out, uint32_t x)
+{
+    out.push_back(x >> 24); out.push_back(x >> 16); out.push_back(x >> 8); out.push_back(x);
+}
+
+static void put_chunk(std::vector<byte>& out, const char* type, const std::vector<byte>& data)
+{
+    put_u32(out, data.size());
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    put_u32(out, crc32(&out[start], out.size() - start));
+}
+
+// No zlib around, so the image data goes in stored (uncompressed) deflate blocks
+bool write_png(const char* path, const byte* rgb, int width, int height)
+{
+    std::vector<byte> raw;
+    for (int y = height - 1; y >= 0; y--) {
+        raw.push_back(0); // Filter: none
+        raw.insert(raw.end(), &rgb[y * width * 3], &rgb[(y + 1) * width * 3]);
+    }
+
+    std::vector<byte> zlib = {0x78, 0x01};
+    size_t pos = 0;
+    do {
+        size_t len = raw.size() - pos < 0xffff ? raw.size() - pos : 0xffff;
+        zlib.push_back(pos + len == raw.size()); // BFINAL, BTYPE = 00
+        zlib.push_back(len & 0xff); zlib.push_back(len >> 8);
+        zlib.push_back(~len & 0xff); zlib.push_back((~len >> 8) & 0xff);
+        zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+        pos += len;
+    } while (pos < raw.size());
+
+    uint32_t a = 1, b = 0; // Adler-32
+    for (byte x : raw) { a = (a + x) % 65521; b = (b + a) % 65521; }
+    put_u32(zlib, (b << 16) | a);
+
+    std::vector<byte> header;
+    put_u32(header, width);
+    put_u32(header, height);
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8-bit RGB, no interlace
+
+    std::vector<byte> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    put_chunk(png, "IHDR", header);
+    put_chunk(png, "IDAT", zlib);
+    put_chunk(png, "IEND", {});
+
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) return false;
+    fwrite(png.data(), 1, png.size(), file);
+    return fclose(file) == 0;
+}
+
+bool write_image(const char* path, const byte* rgb, int width, int height)
+{
+    size_t len = strlen(path);
+    if (len >= 4 && strcmp(path + len - 4, ".png") == 0) return write_png(path, rgb, width, height);
+    return write_ppm(path, rgb, width, height);
+}
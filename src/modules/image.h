@@ -0,0 +1,8 @@
+#pragma once
+#include "def.h"
+
+// Framebuffers are RGB rows starting at the bottom (as glDrawPixels reads them),
+// the files are written top row first so they look like the window.
+bool write_ppm(const char* path, const byte* rgb, int width, int height);
+bool write_png(const char* path, const byte* rgb, int width, int height);
+bool write_image(const char* path, const byte* rgb, int width, int height); // Picks the format by extension (.png, anything else is PPM)
@@ -0,0 +1,697 @@
+#include "jit.h"
+
+#if NEODYMIUM_JIT
+#include "cpu.h"
+#include "ram.h"
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// How compiled code leaves, in the upper half of the returned value
+#define EXIT_NEXT       0 // Continue at the pc in the lower half
+#define EXIT_INTERPRET  1 // Interpret the instruction at the pc in the lower half, then continue
+#define EXIT_HALT       2 // Halted, the lower half is the code and halt_pc the next pc
+
+// Host registers
+#define EAX 0
+#define ECX 1
+#define EDX 2
+
+#define OFFSET(field) ((uint32_t)offsetof(JitContext, field))
+
+// Leaves room for the biggest block and its stubs
+#define BLOCK_RESERVE (JIT_MAX_BLOCK * 160 + 256)
+
+namespace {
+
+// Addresses are in the executable mapping, the bytes go through the writable one
+struct Emitter {
+    byte* p;
+    ptrdiff_t writable; // JIT::writable
+
+    void emit(std::initializer_list<byte> bytes) { for (byte b : bytes) p++[writable] = b; }
+    void u16(uint16_t x) { memcpy(p + writable, &x, 2); p += 2; }
+    void u32(uint32_t x) { memcpy(p + writable, &x, 4); p += 4; }
+
+    // rel32 jumps return where their offset is, to be patched once the target is known
+    byte* jmp() { emit({0xe9}); byte* site = p; u32(0); return site; }
+    byte* jcc(byte cc) { emit({0x0f, cc}); byte* site = p; u32(0); return site; }
+    void jmp_to(byte* target) { patch(jmp(), target); }
+
+    void patch(byte* site, byte* target)
+    {
+        int32_t rel = (int32_t)(target - (site + 4));
+        memcpy(site + writable, &rel, 4);
+    }
+
+    // mov r64, [rdi + offset]
+    void load_context(int reg, uint32_t offset) { emit({0x48, 0x8b, (byte)(0x87 | reg << 3)}); u32(offset); }
+    // mov r32, imm32
+    void load_immediate(int reg, uint32_t value) { emit({(byte)(0xb8 + reg)}); u32(value); }
+
+    // Guest registers are r8b-r15b, 0xff (always zero) lives in the CPU
+    void load(int reg, byte guest)
+    {
+        if (guest == 0xff) {
+            load_context(EDX, OFFSET(always_zero));
+            emit({0x0f, 0xb6, (byte)(reg << 3 | 2)});              // movzx reg, byte [rdx]
+        }
+        else emit({0x41, 0x0f, 0xb6, (byte)(0xc0 | reg << 3 | guest)}); // movzx reg, r8b+guest
+    }
+
+    void store(byte guest, int reg)
+    {
+        if (guest == 0xff) {
+            load_context(EDX, OFFSET(always_zero));
+            emit({0x88, (byte)(reg << 3 | 2)});                    // mov [rdx], reg8
+        }
+        else emit({0x41, 0x88, (byte)(0xc0 | reg << 3 | guest)});  // mov r8b+guest, reg8
+    }
+
+    // update_flags_with_number(eax)
+    void flags()
+    {
+        emit({0x3d}); u32(255);             // cmp eax, 255
+        emit({0x40, 0x0f, 0x9f, 0xc6});     // setg sil      (overflow)
+        emit({0x85, 0xc0});                 // test eax, eax
+        emit({0x0f, 0x94, 0xc3});           // sete bl       (zero)
+        emit({0x40, 0x0f, 0x98, 0xc5});     // sets bpl      (underflow)
+    }
+
+    // ecx = (high << 8) | low
+    void register_address(int reg, byte high, byte low)
+    {
+        int other = reg == ECX ? EAX : ECX;
+        load(reg, high);
+        emit({0xc1, (byte)(0xe0 | reg), 0x08});                // shl reg, 8
+        load(other, low);
+        emit({0x09, (byte)(0xc0 | other << 3 | reg)});         // or reg, other
+    }
+
+    // Stack pushes/pops, same slots as Stack::push/pop. al is the value.
+    void push_al(uint16_t base)
+    {
+        load_context(EDX, OFFSET(sp));
+        emit({0x0f, 0xb6, 0x0a});           // movzx ecx, byte [rdx]
+        emit({0xfe, 0x02});                 // inc byte [rdx]
+        emit({0xf7, 0xd9});                 // neg ecx
+        emit({0x81, 0xc1}); u32(base + 255);// add ecx, base + 255
+        load_context(EDX, OFFSET(memory));
+        emit({0x88, 0x04, 0x0a});           // mov [rdx + rcx], al
+    }
+
+    void pop_al(uint16_t base)
+    {
+        load_context(EDX, OFFSET(sp));
+        emit({0xfe, 0x0a});                 // dec byte [rdx]
+        emit({0x0f, 0xb6, 0x0a});           // movzx ecx, byte [rdx]
+        emit({0xf7, 0xd9});                 // neg ecx
+        emit({0x81, 0xc1}); u32(base + 255);// add ecx, base + 255
+        load_context(EDX, OFFSET(memory));
+        emit({0x0f, 0xb6, 0x04, 0x0a});     // movzx eax, byte [rdx + rcx]
+    }
+};
+
+bool ends_block(byte opcode)
+{
+    return (opcode >= 0x20 && opcode <= 0x2f && opcode != 0x22 && opcode != 0x23)
+        || (opcode >= 0x50 && opcode <= 0x52) || opcode >= 0xfd;
+}
+
+struct Instruction {
+    uint16_t pc;
+    uint16_t next;
+    uint16_t address;
+    byte opcode;
+    byte a, b, c;
+};
+
+// Operand bytes after the opcode, -1 for what the JIT leaves to the interpreter
+int operand_bytes(byte opcode)
+{
+    switch (opcode) {
+        case 0x00: case 0x52: case 0xff: return 0;
+        case 0x10: case 0x30: case 0x31: case 0x32: case 0x42: case 0x45: case 0xfd: case 0xfe: return 1;
+        case 0x01: case 0x02: case 0x11: case 0x12: case 0x20: case 0x21: case 0x22: case 0x23:
+        case 0x24: case 0x25: case 0x26: case 0x27: case 0x28: case 0x29: case 0x2a: case 0x2b:
+        case 0x2c: case 0x2d: case 0x2e: case 0x2f: case 0x40: case 0x41: case 0x43: case 0x44:
+        case 0x46: case 0x47: case 0x48: case 0x49: case 0x4e: case 0x4f: case 0x50: case 0x51: return 2;
+        case 0x03: case 0x04: case 0x60: case 0x61: case 0x62: case 0x63: return 3;
+    }
+    return -1; // PWR, SQRT, FSQRT and unknown opcodes
+}
+
+bool valid_register(byte r) { return r < 8 || r == 0xff; }
+
+// Which operand bytes are registers, and that they're ones we can map
+bool supported(const Instruction& in)
+{
+    switch (in.opcode) {
+        case 0x10: case 0x30: case 0x32: case 0x42: case 0x45: case 0xfd:
+            return valid_register(in.a);
+        case 0x01: case 0x11: case 0x21: case 0x23: case 0x25: case 0x27: case 0x29: case 0x2b:
+        case 0x2d: case 0x2f: case 0x41: case 0x44: case 0x47: case 0x49: case 0x4e: case 0x51:
+            return valid_register(in.a) && valid_register(in.b);
+        case 0x02: case 0x12: case 0x22: case 0x40: case 0x43: case 0x46:
+            return valid_register(in.a);
+        case 0x48: case 0x4f: // Division by an immediate zero: the interpreter knows what to do
+            return valid_register(in.a) && in.b != 0;
+        case 0x03: return valid_register(in.a);
+        case 0x04: case 0x60: return valid_register(in.a) && valid_register(in.b) && valid_register(in.c);
+        case 0x61: return valid_register(in.c);
+        case 0x62: return valid_register(in.a) && valid_register(in.b);
+    }
+    return true;
+}
+
+}
+
+JIT::JIT(CPU* cpu)
+: cpu(cpu)
+{
+    counters = new uint16_t[RAM_SIZE]();
+    blocks = new JitBlock*[RAM_SIZE]();
+    entries = new void*[RAM_SIZE]();
+
+    context.memory = cpu->ram.memory;
+    context.page_flags = cpu->ram.page_flags;
+    context.watch_written = &cpu->ram.owner->watch_written;
+    context.registers = cpu->registers;
+    context.zero = &cpu->zero;
+    context.underflow = &cpu->underflow;
+    context.overflow = &cpu->overflow;
+    context.always_zero = &cpu->ALWAYS_ZERO;
+    context.sp = &cpu->stack.sp;
+    context.entries = entries;
+    context.budget = 0;
+    context.halt_pc = 0;
+
+    // Blocks are patched whenever they get linked, rather than flipping the buffer between writable
+    // and executable every time it's mapped twice: nothing is ever both
+    code = nullptr;
+    writable = 0;
+    int fd = memfd_create("neodymium-jit", MFD_CLOEXEC);
+    if (fd != -1 && ftruncate(fd, JIT_CODE_SIZE) == 0) {
+        void* executable = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        void* written = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (executable != MAP_FAILED && written != MAP_FAILED) {
+            code = (byte*)executable;
+            writable = (byte*)written - code;
+        }
+        else {
+            if (executable != MAP_FAILED) munmap(executable, JIT_CODE_SIZE);
+            if (written != MAP_FAILED) munmap(written, JIT_CODE_SIZE);
+        }
+    }
+    if (fd != -1) close(fd);
+    generate_trampolines();
+}
+
+JIT::~JIT()
+{
+    if (cpu->ram.code_context == this) cpu->ram.code_written = nullptr;
+    flush();
+    if (code != nullptr) {
+        munmap(code, JIT_CODE_SIZE);
+        munmap(code + writable, JIT_CODE_SIZE);
+    }
+    delete[] counters;
+    delete[] blocks;
+    delete[] entries;
+}
+
+void JIT::generate_trampolines()
+{
+    if (code == nullptr) return;
+    Emitter e = {code, writable};
+
+    // uint32_t enter(JitContext* rdi, void* rsi): loads the guest state and jumps to the block
+    enter = (uint32_t (*)(JitContext*, void*))e.p;
+    e.emit({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}); // push rbx, rbp, r12-r15
+    e.emit({0x48, 0x89, 0xf0});                                         // mov rax, rsi
+    e.load_context(EDX, OFFSET(registers));
+    for (int i = 0; i < 8; i++) e.emit({0x44, 0x0f, 0xb6, (byte)(0x42 | i << 3), (byte)i}); // movzx r8d+i, byte [rdx + i]
+    e.load_context(EDX, OFFSET(zero));
+    e.emit({0x0f, 0xb6, 0x1a});                                         // movzx ebx, byte [rdx]
+    e.load_context(EDX, OFFSET(underflow));
+    e.emit({0x0f, 0xb6, 0x2a});                                         // movzx ebp, byte [rdx]
+    e.load_context(EDX, OFFSET(overflow));
+    e.emit({0x0f, 0xb6, 0x32});                                         // movzx esi, byte [rdx]
+    e.emit({0xff, 0xe0});                                               // jmp rax
+
+    // Every exit ends here with eax set, the guest state goes back to the CPU
+    exit_code = e.p;
+    e.load_context(EDX, OFFSET(registers));
+    for (int i = 0; i < 8; i++) e.emit({0x44, 0x88, (byte)(0x42 | i << 3), (byte)i});        // mov [rdx + i], r8b+i
+    e.load_context(EDX, OFFSET(zero));
+    e.emit({0x88, 0x1a});                                               // mov [rdx], bl
+    e.load_context(EDX, OFFSET(underflow));
+    e.emit({0x40, 0x88, 0x2a});                                         // mov [rdx], bpl
+    e.load_context(EDX, OFFSET(overflow));
+    e.emit({0x40, 0x88, 0x32});                                         // mov [rdx], sil
+    e.emit({0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b}); // pop r15-r12, rbp, rbx
+    e.emit({0xc3});                                                     // ret
+
+    cursor = e.p;
+}
+
+JitBlock* JIT::compile(uint16_t pc)
+{
+    if (code == nullptr) return nullptr;
+    if (cursor + BLOCK_RESERVE > code + JIT_CODE_SIZE) flush();
+
+    // Scan the block first, the prologue needs its length
+    RAM& ram = cpu->ram;
+    Instruction body[JIT_MAX_BLOCK];
+    int length = 0;
+    bool ended = false; // By a terminator, otherwise it falls through to at
+    uint16_t at = pc;
+
+    while (length < JIT_MAX_BLOCK) {
+        Instruction in = {};
+        in.pc = at;
+        in.opcode = ram.memory[at];
+
+        int operands = operand_bytes(in.opcode);
+        if (operands < 0) break;
+        if (operands > 0) in.a = ram.memory[(uint16_t)(at + 1)];
+        if (operands > 1) in.b = ram.memory[(uint16_t)(at + 2)];
+        if (operands > 2) in.c = ram.memory[(uint16_t)(at + 3)];
+        if (!supported(in)) break;
+
+        // 16-bit immediates, high byte first
+        switch (in.opcode) {
+            case 0x03: in.address = (uint16_t)(in.b << 8 | in.c); break;
+            case 0x61: case 0x63: in.address = (uint16_t)(in.a << 8 | in.b); break;
+            case 0x20: case 0x24: case 0x26: case 0x28: case 0x2a: case 0x2c: case 0x2e: case 0x50:
+                in.address = (uint16_t)(in.a << 8 | in.b); break;
+        }
+
+        // Loads from a device are for RAM to do, fixed addresses (and the stack) are known now
+        bool stack_device = ram.page_flags[cpu->stack.base / PAGE_SIZE] & PAGE_DEVICE;
+        if (in.opcode == 0x03 && (ram.page_flags[in.address / PAGE_SIZE] & PAGE_DEVICE)) break;
+        if (stack_device && (in.opcode == 0x32 || in.opcode == 0x52)) break;
+
+        at += 1 + operands;
+        in.next = at;
+        body[length++] = in;
+
+        if (ends_block(in.opcode)) {
+            ended = true;
+            break;
+        }
+    }
+
+    if (length == 0) return nullptr;
+
+    bool interpret_after = !ended && length < JIT_MAX_BLOCK; // Stopped on something we can't compile
+
+    JitBlock* block = new JitBlock();
+    block->start = pc;
+    block->end = at;
+    block->length = length;
+
+    uint16_t stack_base = cpu->stack.base;
+    Emitter e = {cursor, writable};
+    block->entry = e.p;
+
+    struct SideExit { byte* site; int left; uint16_t pc; };
+    struct Chain { byte* site; uint16_t target; };
+    std::vector<SideExit> side_exits;
+    std::vector<Chain> chains;
+
+    // Not enough budget for the whole block: give it back to the dispatcher
+    e.emit({0x48, 0x81, 0xaf}); e.u32(OFFSET(budget)); e.u32(length); // sub qword [rdi + budget], length
+    byte* bail = e.jcc(0x8c);                                            // jl bail
+
+    auto side_exit = [&](byte cc, int index) { side_exits.push_back({e.jcc(cc), length - index, body[index].pc}); };
+    auto chain = [&](byte* site, uint16_t target) { chains.push_back({site, target}); };
+
+    auto indirect_exit = [&]() { // eax is the target
+        e.load_context(EDX, OFFSET(entries));
+        e.emit({0x48, 0x8b, 0x14, 0xc2});   // mov rdx, [rdx + rax * 8]
+        e.emit({0x48, 0x85, 0xd2});         // test rdx, rdx
+        e.patch(e.jcc(0x84), exit_code); // jz exit (reason EXIT_NEXT, pc in eax)
+        e.emit({0xff, 0xe2});               // jmp rdx
+    };
+
+    auto check_stack = [&](int index) { // Leaves if the stack page has any hook
+        e.load_context(EDX, OFFSET(page_flags));
+        e.emit({0x80, 0xba}); e.u32(stack_base / PAGE_SIZE); e.emit({0x00}); // cmp byte [rdx + page], 0
+        side_exit(0x85, index);                                             // jnz
+    };
+
+    auto check_store = [&](int index) { // ecx is the address, kept
+        e.load_context(EDX, OFFSET(page_flags));
+        e.emit({0x89, 0xc8});               // mov eax, ecx
+        e.emit({0xc1, 0xe8, 0x08});         // shr eax, 8
+        e.emit({0x0f, 0xb6, 0x04, 0x02});   // movzx eax, byte [rdx + rax]
+        e.emit({0xa8, (byte)~PAGE_WATCHED});// test al, ~PAGE_WATCHED
+        side_exit(0x85, index);             // jnz: code or anything else with a hook, let RAM::write do it
+        e.emit({0x84, 0xc0});               // test al, al
+        e.emit({0x74, 0x0a});               // jz +10
+        e.load_context(EDX, OFFSET(watch_written));
+        e.emit({0xc6, 0x02, 0x01});         // mov byte [rdx], 1
+    };
+
+    auto check_load = [&](int index) { // ecx is the address, kept. Only emitted while devices are mapped.
+        if (ram.device_pages == 0) return;
+        e.load_context(EDX, OFFSET(page_flags));
+        e.emit({0x89, 0xc8});               // mov eax, ecx
+        e.emit({0xc1, 0xe8, 0x08});         // shr eax, 8
+        e.emit({0xf6, 0x04, 0x02, PAGE_DEVICE}); // test byte [rdx + rax], PAGE_DEVICE
+        side_exit(0x85, index);             // jnz
+    };
+
+    auto write_al = [&]() { // [rcx] = al
+        e.load_context(EDX, OFFSET(memory));
+        e.emit({0x88, 0x04, 0x0a});         // mov [rdx + rcx], al
+    };
+
+    auto test_flag = [&](byte opcode) { // Sets ZF when the flag the jump reads is clear
+        switch ((opcode - 0x24) / 4) {
+            case 0: e.emit({0x84, 0xdb}); break;        // test bl, bl     (zero)
+            case 1: e.emit({0x40, 0x84, 0xed}); break;  // test bpl, bpl   (underflow)
+            case 2: e.emit({0x40, 0x84, 0xf6}); break;  // test sil, sil   (overflow)
+        }
+    };
+
+    for (int i = 0; i < length; i++) {
+        const Instruction& in = body[i];
+
+        switch (in.opcode) {
+            case 0x00: break;
+            case 0x01: e.load(EAX, in.b); e.store(in.a, EAX); break;
+            case 0x02: e.load_immediate(EAX, in.b); e.store(in.a, EAX); break;
+            case 0x03:
+                e.load_context(EDX, OFFSET(memory));
+                e.emit({0x0f, 0xb6, 0x82}); e.u32(in.address);      // movzx eax, byte [rdx + address]
+                e.store(in.a, EAX);
+                break;
+            case 0x04: // [$y,$z] has $y as the low byte, same as CPU::tick
+                e.register_address(ECX, in.c, in.b);
+                check_load(i);
+                e.load_context(EDX, OFFSET(memory));
+                e.emit({0x0f, 0xb6, 0x04, 0x0a});                   // movzx eax, byte [rdx + rcx]
+                e.store(in.a, EAX);
+                break;
+            case 0x10: e.load(EAX, in.a); e.emit({0xf7, 0xd0}); e.store(in.a, EAX); break;         // not eax
+            case 0x11: e.load(EAX, in.a); e.load(ECX, in.b); e.emit({0x21, 0xc8}); e.store(in.a, EAX); break; // and eax, ecx
+            case 0x12: e.load(EAX, in.a); e.emit({0x25}); e.u32(in.b); e.store(in.a, EAX); break;  // and eax, imm
+            case 0x22: e.load(EAX, in.a); e.emit({0x05}); e.u32(in.b); e.flags(); break;           // add eax, imm
+            case 0x23: e.load(EAX, in.a); e.load(ECX, in.b); e.emit({0x01, 0xc8}); e.flags(); break; // add eax, ecx
+            case 0x40: case 0x43: // SUB adds too, same as CPU::tick
+                e.load(EAX, in.a); e.emit({0x05}); e.u32(in.b); e.flags(); e.store(in.a, EAX); break;
+            case 0x41: case 0x44:
+                e.load(EAX, in.a); e.load(ECX, in.b); e.emit({0x01, 0xc8}); e.flags(); e.store(in.a, EAX); break;
+            case 0x42: // INC, flags only change when it wraps
+                e.load(EAX, in.a);
+                e.emit({0xff, 0xc0});                               // inc eax
+                e.store(in.a, EAX);
+                e.emit({0x3d}); e.u32(256);                         // cmp eax, 256
+                e.emit({0x75, 0x09});                               // jne +9
+                e.emit({0x31, 0xdb, 0x31, 0xed});                   // xor ebx, ebx; xor ebp, ebp
+                e.emit({0xbe}); e.u32(1);                           // mov esi, 1
+                break;
+            case 0x45: // DEC
+                e.load(EAX, in.a);
+                e.emit({0xff, 0xc8});                               // dec eax
+                e.store(in.a, EAX);
+                e.emit({0x83, 0xf8, 0xff});                         // cmp eax, -1
+                e.emit({0x75, 0x09});                               // jne +9
+                e.emit({0x31, 0xdb});                               // xor ebx, ebx
+                e.emit({0xbd}); e.u32(1);                           // mov ebp, 1
+                e.emit({0x31, 0xf6});                               // xor esi, esi
+                break;
+            case 0x46: e.load(EAX, in.a); e.emit({0x69, 0xc0}); e.u32(in.b); e.flags(); e.store(in.a, EAX); break; // imul eax, eax, imm
+            case 0x47: e.load(EAX, in.a); e.load(ECX, in.b); e.emit({0x0f, 0xaf, 0xc1}); e.flags(); e.store(in.a, EAX); break; // imul eax, ecx
+            case 0x48: case 0x49: case 0x4e: case 0x4f: {
+                e.load(EAX, in.a);
+                if (in.opcode == 0x48 || in.opcode == 0x4f) e.load_immediate(ECX, in.b);
+                else {
+                    e.load(ECX, in.b);
+                    e.emit({0x85, 0xc9});                           // test ecx, ecx
+                    side_exit(0x84, i);                             // jz: dividing by zero is the interpreter's business
+                }
+                if (in.opcode == 0x48 || in.opcode == 0x49) {
+                    // round(x / y) = (2x + y) / 2y for the byte range, no doubles needed
+                    e.emit({0x01, 0xc0, 0x01, 0xc8, 0x01, 0xc9});   // add eax, eax; add eax, ecx; add ecx, ecx
+                    e.emit({0x31, 0xd2, 0xf7, 0xf1});               // xor edx, edx; div ecx
+                }
+                else {
+                    e.emit({0x31, 0xd2, 0xf7, 0xf1});               // xor edx, edx; div ecx
+                    e.emit({0x89, 0xd0});                           // mov eax, edx
+                }
+                e.flags();
+                e.store(in.a, EAX);
+                break;
+            }
+            case 0x30: check_stack(i); e.load(EAX, in.a); e.push_al(stack_base); break;
+            case 0x31: check_stack(i); e.load_immediate(EAX, in.a); e.push_al(stack_base); break;
+            case 0x32: e.pop_al(stack_base); e.store(in.a, EAX); break;
+            case 0x60: case 0x62:
+                e.register_address(ECX, in.a, in.b);
+                check_store(i);
+                if (in.opcode == 0x60) e.load(EAX, in.c);
+                else e.load_immediate(EAX, in.c);
+                write_al();
+                break;
+            case 0x61: case 0x63:
+                e.load_immediate(ECX, in.address);
+                check_store(i);
+                if (in.opcode == 0x61) e.load(EAX, in.c);
+                else e.load_immediate(EAX, in.c);
+                write_al();
+                break;
+
+            // Terminators
+            case 0x20: chain(e.jmp(), in.address); break;
+            case 0x21: e.register_address(EAX, in.a, in.b); indirect_exit(); break;
+            case 0x24: case 0x26: case 0x28: case 0x2a: case 0x2c: case 0x2e: {
+                bool when_set = ((in.opcode - 0x24) / 2) % 2 == 0; // JZ, JU, JO
+                test_flag(in.opcode);
+                chain(e.jcc(when_set ? 0x85 : 0x84), in.address);
+                chain(e.jmp(), in.next);
+                break;
+            }
+            case 0x25: case 0x27: case 0x29: case 0x2b: case 0x2d: case 0x2f: {
+                bool when_set = ((in.opcode - 0x25) / 2) % 2 == 0;
+                test_flag(in.opcode - 1);
+                chain(e.jcc(when_set ? 0x84 : 0x85), in.next); // Not taken
+                e.register_address(EAX, in.a, in.b);
+                indirect_exit();
+                break;
+            }
+            case 0x50: case 0x51:
+                check_stack(i);
+                if (in.opcode == 0x51) {
+                    e.register_address(EAX, in.a, in.b);
+                    e.emit({0x50});                                 // push rax
+                }
+                e.load_immediate(EAX, in.next & 0xff);
+                e.push_al(stack_base);
+                e.load_immediate(EAX, in.next >> 8);
+                e.push_al(stack_base);
+                if (in.opcode == 0x50) chain(e.jmp(), in.address);
+                else {
+                    e.emit({0x58});                                 // pop rax
+                    indirect_exit();
+                }
+                break;
+            case 0x52:
+                e.pop_al(stack_base);
+                e.emit({0xc1, 0xe0, 0x08, 0x50});                   // shl eax, 8; push rax
+                e.pop_al(stack_base);
+                e.emit({0x59, 0x09, 0xc8});                         // pop rcx; or eax, ecx
+                indirect_exit();
+                break;
+            case 0xfd: case 0xfe: case 0xff:
+                if (in.opcode == 0xfd) e.load(EAX, in.a);
+                else e.load_immediate(EAX, in.opcode == 0xfe ? in.a : 0);
+                e.emit({0x66, 0xc7, 0x87}); e.u32(OFFSET(halt_pc)); e.u16(in.next); // mov word [rdi + halt_pc], next
+                e.emit({0x0d}); e.u32(EXIT_HALT << 16);            // or eax, EXIT_HALT << 16
+                e.jmp_to(exit_code);
+                break;
+        }
+    }
+
+    if (!ended) {
+        if (interpret_after) {
+            e.load_immediate(EAX, EXIT_INTERPRET << 16 | at);
+            e.jmp_to(exit_code);
+        }
+        else chain(e.jmp(), at);
+    }
+
+    // Out of line paths
+    e.patch(bail, e.p);
+    e.emit({0x48, 0x81, 0x87}); e.u32(OFFSET(budget)); e.u32(length);  // add qword [rdi + budget], length
+    e.load_immediate(EAX, pc);
+    e.jmp_to(exit_code);
+
+    for (SideExit& exit : side_exits) {
+        e.patch(exit.site, e.p);
+        e.emit({0x48, 0x81, 0x87}); e.u32(OFFSET(budget)); e.u32(exit.left); // Give back what didn't run
+        e.load_immediate(EAX, EXIT_INTERPRET << 16 | exit.pc);
+        e.jmp_to(exit_code);
+    }
+
+    for (Chain& exit : chains) {
+        byte* stub = e.p;
+        e.load_immediate(EAX, exit.target);
+        e.jmp_to(exit_code);
+
+        JitBlock* target = blocks[exit.target];
+        e.patch(exit.site, target != nullptr ? target->entry : stub);
+        links[exit.target].push_back({exit.site, stub, block});
+        block->targets.push_back(exit.target);
+    }
+
+    cursor = e.p;
+
+    blocks[pc] = block;
+    entries[pc] = block->entry;
+    page_blocks[block->start / PAGE_SIZE].push_back(block);
+    ram.page_flags[block->start / PAGE_SIZE] |= PAGE_CODE;
+    uint16_t last_page = (uint16_t)(block->end - 1) / PAGE_SIZE;
+    if (last_page != block->start / PAGE_SIZE) {
+        page_blocks[last_page].push_back(block);
+        ram.page_flags[last_page] |= PAGE_CODE;
+    }
+
+    link(block);
+    return block;
+}
+
+void JIT::link(JitBlock* block)
+{
+    auto found = links.find(block->start);
+    if (found == links.end()) return;
+    Emitter e = {nullptr, writable};
+    for (JitLink& link : found->second) e.patch(link.site, block->entry);
+}
+
+void JIT::drop(JitBlock* block)
+{
+    blocks[block->start] = nullptr;
+    entries[block->start] = nullptr;
+    counters[block->start] = 0;
+
+    for (int page : {block->start / PAGE_SIZE, (uint16_t)(block->end - 1) / PAGE_SIZE}) {
+        std::vector<JitBlock*>& list = page_blocks[page];
+        for (size_t i = 0; i < list.size(); i++) {
+            if (list[i] == block) { list.erase(list.begin() + i); break; }
+        }
+    }
+
+    // Our own jumps go away with us
+    for (uint16_t target : block->targets) {
+        std::vector<JitLink>& list = links[target];
+        for (size_t i = 0; i < list.size();) {
+            if (list[i].from == block) list.erase(list.begin() + i);
+            else i++;
+        }
+    }
+
+    // Jumps into us go back to their stubs
+    auto found = links.find(block->start);
+    if (found != links.end()) {
+        Emitter e = {nullptr, writable};
+        for (JitLink& link : found->second) e.patch(link.site, link.stub);
+    }
+
+    delete block;
+}
+
+void JIT::invalidate(uint16_t address)
+{
+    std::vector<JitBlock*> list = page_blocks[address / PAGE_SIZE];
+    for (JitBlock* block : list) {
+        if ((uint16_t)(address - block->start) < (uint16_t)(block->end - block->start)) drop(block);
+    }
+
+    // Whatever is there now has to get hot again
+    for (int i = 0; i < MAX_INSTRUCTION_SIZE; i++) counters[(uint16_t)(address - i)] = 0;
+}
+
+void JIT::flush()
+{
+    for (uint32_t i = 0; i < RAM_SIZE; i++) {
+        delete blocks[i];
+        blocks[i] = nullptr;
+        entries[i] = nullptr;
+        counters[i] = 0;
+    }
+    for (std::vector<JitBlock*>& list : page_blocks) list.clear();
+    links.clear();
+    generate_trampolines();
+}
+
+void JIT::code_written(void* context, uint16_t address)
+{
+    static_cast<JIT*>(context)->invalidate(address);
+}
+
+int JIT::execute(uint64_t budget)
+{
+    RAM& ram = cpu->ram;
+    ram.code_written = code_written;
+    ram.code_context = this;
+
+    uint64_t executed = 0;
+    int result = -1;
+
+    try {
+        while (executed < budget) {
+            uint16_t pc = ram.pc;
+            JitBlock* block = blocks[pc];
+
+            if (block == nullptr && counters[pc] < JIT_HOT_THRESHOLD && ++counters[pc] == JIT_HOT_THRESHOLD) {
+                block = compile(pc);
+            }
+
+            uint64_t left = budget - executed;
+            if (block != nullptr && (uint64_t)block->length <= left) {
+                context.budget = left > INT64_MAX ? INT64_MAX : (int64_t)left;
+                int64_t given = context.budget;
+                cpu->sync_flags(); // Blocks keep the flags in registers, as bools
+                uint32_t exit = enter(&context, block->entry);
+                executed += given - context.budget;
+
+                uint16_t value = exit & 0xffff;
+                if (exit >> 16 == EXIT_HALT) {
+                    ram.pc = context.halt_pc;
+                    result = value;
+                    break;
+                }
+
+                ram.pc = value;
+                if (exit >> 16 == EXIT_INTERPRET && executed < budget) {
+                    result = cpu->tick();
+                    executed++;
+                    if (result != -1) break;
+                }
+                continue;
+            }
+
+            // Cold (or doesn't fit the budget): interpret until the end of the block
+            while (executed < budget) {
+                byte opcode = ram.memory[ram.pc];
+                result = cpu->tick();
+                executed++;
+                if (result != -1 || ends_block(opcode)) break;
+            }
+            if (result != -1) break;
+        }
+    }
+    catch (...) {
+        cpu->retired += executed;
+        throw;
+    }
+
+    cpu->retired += executed;
+    return result == TICK_YIELD ? -1 : result;
+}
+#endif
@@ -0,0 +1,93 @@
+#pragma once
+#include "def.h"
+
+// Native code generation is only written for x86-64 (System V) on Linux,
+// everywhere else the JIT engine runs the decoded engine instead.
+#if defined(__x86_64__) && defined(__linux__)
+#define NEODYMIUM_JIT 1
+#else
+#define NEODYMIUM_JIT 0
+#endif
+
+// Times a block has to be entered before it's compiled
+#ifndef JIT_HOT_THRESHOLD
+#define JIT_HOT_THRESHOLD   32
+#endif
+#define JIT_MAX_BLOCK       64          // Instructions per block
+#define JIT_CODE_SIZE       (4 << 20)   // Bytes of native code before everything is flushed
+
+struct CPU;
+
+#if NEODYMIUM_JIT
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+
+// What compiled code sees. Standard layout, the generated code uses offsetof() on it.
+struct JitContext {
+    byte* memory;
+    byte* page_flags;
+    bool* watch_written;
+    byte* registers;
+    bool* zero;
+    bool* underflow;
+    bool* overflow;
+    byte* always_zero;
+    byte* sp;
+    void** entries;     // Native entry of the block starting at each address, null if there is none
+    int64_t budget;     // Instructions compiled code can still run
+    uint16_t halt_pc;
+};
+
+struct JitBlock;
+
+// A jump at the end of a block, pointing either to its stub (exit to the dispatcher)
+// or straight into the target block once that one is compiled
+struct JitLink {
+    byte* site;     // rel32 of the jump
+    byte* stub;
+    JitBlock* from;
+};
+
+struct JitBlock {
+    uint16_t start;
+    uint16_t end;   // One past the last byte
+    int length;     // Instructions
+    byte* entry;
+    std::vector<uint16_t> targets; // Static exits, to find our links when dropped
+};
+
+// Tiered engine: blocks run in the interpreter (CPU::tick) until they are entered
+// JIT_HOT_THRESHOLD times, then they're compiled. Guest registers live in r8-r15 and
+// the flags in bl/bpl/sil while native code runs, and blocks jump straight into each other.
+struct JIT {
+    private:
+    CPU* cpu;
+    JitContext context;
+    uint16_t* counters;
+    JitBlock** blocks;
+    void** entries;
+    std::vector<JitBlock*> page_blocks[0x100];
+    std::unordered_map<uint16_t, std::vector<JitLink>> links; // By target address
+
+    byte* code;         // Executable, never writable
+    ptrdiff_t writable; // code + writable maps the same memory writable
+    byte* cursor;
+    byte* exit_code; // Common exit, stores the guest state back and returns
+    uint32_t (*enter)(JitContext* context, void* entry);
+
+    void generate_trampolines();
+    JitBlock* compile(uint16_t pc);
+    void link(JitBlock* block);
+    void drop(JitBlock* block);
+    void flush();
+    static void code_written(void* context, uint16_t address);
+
+    public:
+    JIT(CPU* cpu);
+    ~JIT();
+
+    int execute(uint64_t budget); // Same contract as CPU::execute
+    void invalidate(uint16_t address); // Drops every block containing this byte
+};
+#endif
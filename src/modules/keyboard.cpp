@@ -0,0 +1,63 @@
+#include "keyboard.h"
+
+KeyQueue::KeyQueue()
+: keys(), head(0), tail(0)
+{
+}
+
+bool KeyQueue::push(byte key)
+{
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == KEY_QUEUE_SIZE) return false;
+
+    keys[h % KEY_QUEUE_SIZE] = key;
+    head.store(h + 1, std::memory_order_release); // The key is there before the consumer can see it
+    return true;
+}
+
+bool KeyQueue::pop(byte& key)
+{
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) return false;
+
+    key = keys[t % KEY_QUEUE_SIZE];
+    tail.store(t + 1, std::memory_order_release); // Read before the producer can reuse the slot
+    return true;
+}
+
+uint32_t KeyQueue::size() const
+{
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+}
+
+void KeyQueue::clear()
+{
+    tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+byte Keyboard::read(uint16_t address)
+{
+    switch (address) {
+        case KEYBOARD_STATUS: {
+            uint32_t waiting = queue.size();
+            return waiting > 255 ? 255 : waiting;
+        }
+        case KEYBOARD_DATA: {
+            byte key = 0;
+            queue.pop(key);
+            return key;
+        }
+    }
+    return 0;
+}
+
+bool Keyboard::steady(uint16_t address)
+{
+    return address != KEYBOARD_DATA || queue.size() == 0;
+}
+
+bool Keyboard::write(uint16_t address, byte data)
+{
+    if (address == KEYBOARD_STATUS) queue.clear();
+    return false;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "def.h"
+#include "device.h"
+#include <atomic>
+
+#define KEYBOARD_ADDRESS    0xd000
+#define KEYBOARD_STATUS     (KEYBOARD_ADDRESS + 0) // Keys waiting, writing it drops them
+#define KEYBOARD_DATA       (KEYBOARD_ADDRESS + 1) // Next key, reading it takes it. 0 if there's none.
+#define KEY_QUEUE_SIZE      64 // Power of two, keys pressed while it's full are lost
+
+// Key codes, printable keys are their ASCII (letters uppercase)
+#define KEY_BACKSPACE   0x08
+#define KEY_TAB         0x09
+#define KEY_ENTER       0x0a
+#define KEY_ESCAPE      0x1b
+#define KEY_DELETE      0x7f
+#define KEY_UP          0x80
+#define KEY_DOWN        0x81
+#define KEY_LEFT        0x82
+#define KEY_RIGHT       0x83
+
+// Keys from one thread to another without locks. Each side only stores its own index,
+// head is the producer's and tail the consumer's, they only grow (the slot is index % size).
+struct KeyQueue {
+    private:
+    byte keys[KEY_QUEUE_SIZE];
+    std::atomic<uint32_t> head; // Next one pushed goes here
+    std::atomic<uint32_t> tail; // Next one popped comes from here
+
+    public:
+    KeyQueue();
+
+    // Producer side
+    bool push(byte key); // False if it was full
+
+    // Consumer side
+    bool pop(byte& key); // False if it was empty
+    uint32_t size() const;
+    void clear();
+};
+
+// Keys pressed on the window, for the guest: KEYBOARD_STATUS and KEYBOARD_DATA, the rest of the
+// page reads 0. The display pushes into it, the CPU reads it like memory.
+struct Keyboard : Device {
+    KeyQueue queue;
+
+    byte read(uint16_t address) override;
+    bool write(uint16_t address, byte data) override;
+    bool steady(uint16_t address) override; // Keys only come in from poll(), on a FRAME event
+};
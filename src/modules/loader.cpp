@@ -0,0 +1,123 @@
+#include "loader.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Copies image[from, to) to the same addresses. Device pages get the bytes in memory, where code is
+// fetched from, without their device seeing them. Pages with hooks (code, the framebuffer...) get
+// stores, the rest is copied page by page.
+static void copy_image(RAM& ram, const byte* image, size_t from, size_t to)
+{
+    while (from < to) {
+        size_t end = (from / PAGE_SIZE + 1) * PAGE_SIZE;
+        if (end > to) end = to;
+        byte flags = ram.page_flags[from / PAGE_SIZE];
+        if (flags == 0 || (flags & PAGE_DEVICE)) memcpy(ram.memory + from, image + from, end - from);
+        else for (size_t i = from; i < end; i++) ram.write(i, image[i]);
+        from = end;
+    }
+}
+
+// Opens path and checks it fits in RAM, -1 (error set) if it can't
+static int open_image(const char* path, int flags, size_t& size, Errors& error)
+{
+    int fd = open(path, flags, 0644);
+    if (fd < 0) {
+        error = errno == ENOENT ? Errors::FILE_NOT_FOUND : Errors::ERROR_OPENING_FILE;
+        return -1;
+    }
+
+    struct stat buffer;
+    if (fstat(fd, &buffer) != 0) {
+        close(fd);
+        error = Errors::ERROR_OPENING_FILE;
+        return -1;
+    }
+    if (buffer.st_size > RAM_SIZE) {
+        close(fd);
+        error = Errors::FILE_TOO_BIG;
+        return -1;
+    }
+    size = buffer.st_size;
+    return fd;
+}
+
+// How much of an image of size bytes can be mapped at address 0: whole host pages, up to the first
+// guest page anything watches (code, devices, the framebuffer...). Those have to see the stores.
+static size_t mappable(const RAM& ram, size_t size)
+{
+    if (ram.backed) return 0;
+    size_t host_page = sysconf(_SC_PAGESIZE);
+    size_t end = size / host_page * host_page;
+    for (size_t page = 0; page < end / PAGE_SIZE; page++) {
+        if (ram.page_flags[page] != 0) return page * PAGE_SIZE / host_page * host_page;
+    }
+    return end;
+}
+
+bool load_program(RAM& ram, const char* path, Errors& error, uint32_t* size)
+{
+    size_t length;
+    int fd = open_image(path, O_RDONLY, length, error);
+    if (fd < 0) return false;
+
+    if (length > 0) {
+        // Most of it becomes the file's pages, copy-on-write, nothing is read until it runs
+        size_t mapped = mappable(ram, length);
+        if (mapped > 0 && mmap(ram.memory, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            // Whatever was left there is zero pages again, copied over below
+            if (mmap(ram.memory, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+                close(fd);
+                error = Errors::ERROR_OPENING_FILE;
+                return false;
+            }
+            mapped = 0;
+        }
+
+        // The rest is copied from a mapping of the file
+        if (mapped < length) {
+            void* image = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (image == MAP_FAILED) {
+                close(fd);
+                error = Errors::ERROR_OPENING_FILE;
+                return false;
+            }
+            copy_image(ram, (const byte*)image, mapped, length);
+            munmap(image, length);
+        }
+    }
+    close(fd);
+    if (size != nullptr) *size = length;
+    return true;
+}
+
+bool load_image(RAM& ram, const byte* image, size_t size, Errors& error)
+{
+    if (size > RAM_SIZE) {
+        error = Errors::FILE_TOO_BIG;
+        return false;
+    }
+
+    copy_image(ram, image, 0, size);
+    return true;
+}
+
+bool load_ram_file(RAM& ram, const char* path, Errors& error)
+{
+    size_t length;
+    int fd = open_image(path, O_RDWR | O_CREAT, length, error);
+    if (fd < 0) return false;
+
+    bool mapped = (length == RAM_SIZE || ftruncate(fd, RAM_SIZE) == 0)
+        && mmap(ram.memory, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+    close(fd);
+    if (!mapped) {
+        error = Errors::ERROR_OPENING_FILE;
+        return false;
+    }
+    ram.backed = true;
+    return true;
+}
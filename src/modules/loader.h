@@ -0,0 +1,16 @@
+#pragma once
+#include "def.h"
+#include "errors.h"
+#include "ram.h"
+#include <cstddef>
+
+// Puts a program image at the start of RAM. Returns false and sets error if it can't.
+// size, if given, gets the size of the image. The whole host pages of it on plain memory are the
+// file mapped copy-on-write, the file shouldn't change while it runs. The rest is copied, devices
+// don't see the bytes loaded on their pages.
+bool load_program(RAM& ram, const char* path, Errors& error, uint32_t* size = nullptr);
+bool load_image(RAM& ram, const byte* image, size_t size, Errors& error); // Copies it from memory
+
+// Makes path (created, or grown to 64KB) the whole RAM, every store goes to the file and stays there
+// for the next run. Before anything is loaded or run, programs loaded after it are copied in.
+bool load_ram_file(RAM& ram, const char* path, Errors& error);
@@ -0,0 +1,539 @@
+#include "lockstep.h"
+#include "cpu.h"
+#include "opcodes.h"
+#include <cstring>
+
+// True if no lane of v is set
+template <int LANES>
+static bool none(const typename Lockstep<LANES>::Lanes& v)
+{
+    uint64_t words[(LANES + 7) / 8] = {};
+    memcpy(words, &v, LANES);
+    uint64_t any = 0;
+    for (uint64_t word : words) any |= word;
+    return any == 0;
+}
+
+template <int LANES>
+Lockstep<LANES>::Lockstep(CPU* const* cpus, int count)
+: count(count), registers(), zero(), underflow(), overflow(), pc(), left(), solo(),
+  group(0), group_mask(), group_pc(0), taken(0), group_left(0), waiting_pc(0x10000), status(), code()
+{
+    for (int l = 0; l < LANES; l++) {
+        this->cpus[l] = l < count ? cpus[l] : nullptr;
+        status[l] = l < count ? LaneStatus::RUNNING : LaneStatus::HALTED;
+    }
+    cache = new LockstepInstruction[RAM_SIZE]();
+}
+
+template <int LANES>
+Lockstep<LANES>::~Lockstep()
+{
+    for (int l = 0; l < count; l++) {
+        if (cpus[l]->ram.code_context == this) cpus[l]->ram.code_written = nullptr;
+    }
+    delete[] cache;
+}
+
+template <int LANES>
+void Lockstep<LANES>::code_written(void* context, uint16_t address)
+{
+    Lockstep* lockstep = static_cast<Lockstep*>(context);
+    for (int i = 0; i < MAX_INSTRUCTION_SIZE; i++) {
+        lockstep->cache[(uint16_t)(address - i)].decoded = false;
+    }
+}
+
+// Lanes still running in lockstep, with_budget only the ones that can run more this round
+template <int LANES>
+typename Lockstep<LANES>::Mask Lockstep<LANES>::lockstep_lanes(bool with_budget)
+{
+    Mask mask = 0;
+    for (int l = 0; l < count; l++) {
+        if (status[l] == LaneStatus::RUNNING && !solo[l] && (left[l] > 0 || !with_budget)) mask |= 1u << l;
+    }
+    return mask;
+}
+
+template <int LANES>
+void Lockstep<LANES>::gather(int lane)
+{
+    CPU& c = *cpus[lane];
+    for (int r = 0; r < LOCKSTEP_ZERO_ROW; r++) registers[r][lane] = c.registers[r];
+    registers[LOCKSTEP_ZERO_ROW][lane] = c.ALWAYS_ZERO;
+    c.sync_flags();
+    zero[lane] = c.zero ? 0xff : 0;
+    underflow[lane] = c.underflow ? 0xff : 0;
+    overflow[lane] = c.overflow ? 0xff : 0;
+    pc[lane] = c.ram.pc;
+
+    c.ram.code_written = code_written;
+    c.ram.code_context = this;
+}
+
+template <int LANES>
+void Lockstep<LANES>::scatter(int lane)
+{
+    CPU& c = *cpus[lane];
+    for (int r = 0; r < LOCKSTEP_ZERO_ROW; r++) c.registers[r] = registers[r][lane];
+    c.ALWAYS_ZERO = registers[LOCKSTEP_ZERO_ROW][lane];
+    c.flags_pending = false;
+    c.zero = zero[lane];
+    c.underflow = underflow[lane];
+    c.overflow = overflow[lane];
+    c.ram.pc = pc[lane];
+}
+
+// Ends the current group and starts one with the lanes at the lowest PC
+template <int LANES>
+void Lockstep<LANES>::regroup()
+{
+    for (Mask rest = group; rest; rest &= rest - 1) {
+        int l = __builtin_ctz(rest);
+        pc[l] = group_pc;
+        left[l] -= taken;
+    }
+    group = 0;
+    taken = 0;
+
+    Mask lanes = lockstep_lanes(true);
+    uint32_t lowest = 0x10000;
+    for (Mask rest = lanes; rest; rest &= rest - 1) {
+        int l = __builtin_ctz(rest);
+        if (pc[l] < lowest) lowest = pc[l];
+    }
+
+    group_left = UINT64_MAX;
+    waiting_pc = 0x10000;
+    for (Mask rest = lanes; rest; rest &= rest - 1) {
+        int l = __builtin_ctz(rest);
+        if (pc[l] == lowest) {
+            group |= 1u << l;
+            if (left[l] < group_left) group_left = left[l];
+        }
+        else if (pc[l] < waiting_pc) waiting_pc = pc[l];
+    }
+
+    group_pc = lowest;
+    for (int l = 0; l < LANES; l++) group_mask[l] = (group >> l) & 1 ? 0xff : 0;
+}
+
+// Takes a lane out of the group, at address after running retired more instructions
+template <int LANES>
+void Lockstep<LANES>::leave(int lane, uint16_t address, uint64_t retired)
+{
+    pc[lane] = address;
+    left[lane] -= taken + retired;
+    group &= ~(1u << lane);
+    group_mask[lane] = 0;
+}
+
+template <int LANES>
+void Lockstep<LANES>::stop(int lane, LaneStatus status, int code, uint16_t address, uint64_t retired)
+{
+    this->status[lane] = status;
+    this->code[lane] = code;
+    leave(lane, address, retired);
+}
+
+// After an instruction that set pc[] of every lane in the group itself (a branch they may not agree on)
+template <int LANES>
+void Lockstep<LANES>::split()
+{
+    for (Mask rest = group; rest; rest &= rest - 1) {
+        int l = __builtin_ctz(rest);
+        left[l] -= taken + 1;
+    }
+    group = 0;
+    taken = 0;
+}
+
+// Decodes the instruction at address for the group. Lanes whose opcode or registers
+// differ from the group leader's go solo, differing immediates are read per lane.
+// Returns false if it faulted the group.
+template <int LANES>
+bool Lockstep<LANES>::decode(uint16_t address)
+{
+    int leader = __builtin_ctz(group);
+    const byte* memory = cpus[leader]->ram.memory;
+    auto at = [&](const byte* m, int i) { return m[(uint16_t)(address + i)]; };
+
+    LockstepInstruction d = {};
+    d.opcode = at(memory, 0);
+    const char* layout = opcode_operands(d.opcode);
+    if (layout == nullptr) layout = "";
+    d.length = instruction_length(d.opcode);
+    for (int i = 0, offset = 1; layout[i]; offset += layout[i] == 'A' ? 2 : 1, i++) {
+        if (layout[i] == 'A') d.address_at = offset;
+        if (layout[i] == 'I') d.immediate_at = offset;
+    }
+
+    Mask lanes = lockstep_lanes(false); // Even the ones out of budget, they'll get here next round
+    for (Mask rest = lanes & ~(1u << leader); rest; rest &= rest - 1) {
+        int l = __builtin_ctz(rest);
+        const byte* other = cpus[l]->ram.memory;
+
+        bool same = at(other, 0) == d.opcode;
+        for (int i = 0, offset = 1; same && layout[i]; offset += layout[i] == 'A' ? 2 : 1, i++) {
+            if (layout[i] == 'R') same = at(other, offset) == at(memory, offset);
+            else if (at(other, offset) != at(memory, offset)) d.varying = true;
+            else if (layout[i] == 'A' && at(other, offset + 1) != at(memory, offset + 1)) d.varying = true;
+        }
+        if (same) continue;
+
+        // Its own code from here on
+        if (group & (1u << l)) leave(l, address, 0);
+        solo[l] = true;
+        lanes &= ~(1u << l);
+    }
+
+    for (Mask rest = lanes; rest; rest &= rest - 1) {
+        RAM& ram = cpus[__builtin_ctz(rest)]->ram;
+        ram.page_flags[address / PAGE_SIZE] |= PAGE_CODE;
+        ram.page_flags[(uint16_t)(address + d.length - 1) / PAGE_SIZE] |= PAGE_CODE;
+    }
+
+    Errors error = Errors::SIGABRT;
+    bool valid = opcode_operands(d.opcode) != nullptr;
+    byte* rows[] = {&d.x, &d.y, &d.z};
+    for (int i = 0, offset = 1, r = 0; valid && layout[i]; offset += layout[i] == 'A' ? 2 : 1, i++) {
+        if (layout[i] == 'A') d.address = (at(memory, offset) << 8) | at(memory, offset + 1);
+        if (layout[i] == 'I') d.immediate = at(memory, offset);
+        if (layout[i] != 'R') continue;
+
+        byte reg = at(memory, offset);
+        if (reg != 0xff && reg >= LOCKSTEP_ZERO_ROW) {
+            error = Errors::SIGSEGV;
+            valid = false;
+        }
+        *rows[r++] = reg == 0xff ? LOCKSTEP_ZERO_ROW : reg;
+    }
+
+    if (!valid) {
+        for (Mask rest = group; rest; rest &= rest - 1) stop(__builtin_ctz(rest), LaneStatus::FAULTED, (int)error, address, 0);
+        return false;
+    }
+
+    d.decoded = true;
+    cache[address] = d;
+    return true;
+}
+
+template <int LANES>
+void Lockstep<LANES>::step()
+{
+    if (!cache[group_pc].decoded && !decode(group_pc)) return;
+    if (group == 0) return; // Everyone went solo
+
+    const LockstepInstruction d = cache[group_pc]; // A copy, a store may drop the slot
+    const Lanes m = group_mask;
+    const uint16_t next = group_pc + d.length;
+
+    // Immediates of lane l
+    auto immediate = [&](int l) { return d.varying ? cpus[l]->ram.memory[(uint16_t)(group_pc + d.immediate_at)] : d.immediate; };
+    auto address = [&](int l) {
+        if (!d.varying) return d.address;
+        const byte* memory = cpus[l]->ram.memory;
+        return (uint16_t)((memory[(uint16_t)(group_pc + d.address_at)] << 8) | memory[(uint16_t)(group_pc + d.address_at + 1)]);
+    };
+
+    // $y, or the immediate for the #0 forms
+    Lanes value = registers[d.y];
+    if (d.immediate_at) {
+        if (d.varying) {
+            for (Mask rest = group; rest; rest &= rest - 1) value[__builtin_ctz(rest)] = immediate(__builtin_ctz(rest));
+        }
+        else value = (Lanes){} + d.immediate;
+    }
+
+    Lanes& x = registers[d.x];
+    auto write = [&](const Lanes& result) { x = (result & m) | (x & ~m); };
+    auto flags = [&](const Lanes& z, const Lanes& u, const Lanes& o) {
+        zero = (z & m) | (zero & ~m);
+        underflow = (u & m) | (underflow & ~m);
+        overflow = (o & m) | (overflow & ~m);
+    };
+    // update_flags_with_number() for x + value, CMP and SUB add too
+    auto add_flags = [&](const Lanes& sum) {
+        Lanes carry = (Lanes)(sum < x);
+        flags((Lanes)(sum == 0) & ~carry, (Lanes){}, carry);
+    };
+    // Taken lanes go to target, the rest to next. Stays a group if they all agree.
+    auto branch = [&](const Lanes& taken_lanes, uint16_t target) {
+        Lanes taken_in_group = taken_lanes & m;
+        if (!d.varying && none<LANES>(taken_in_group ^ m)) group_pc = target;
+        else if (!d.varying && none<LANES>(taken_in_group)) group_pc = next;
+        else {
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                pc[l] = taken_in_group[l] ? address(l) : next;
+            }
+            split();
+            return;
+        }
+        taken++;
+    };
+    // Devices can start things timed by the lane's own retired count, which only CPU::execute()
+    // keeps: a store to one is the lane's first instruction on its own
+    auto store = [&](int l, uint16_t to, byte data) {
+        if (cpus[l]->ram.page_flags[to / PAGE_SIZE] & PAGE_DEVICE) {
+            leave(l, group_pc, 0);
+            solo[l] = true;
+        }
+        else cpus[l]->ram.write(to, data);
+    };
+    auto branch_indirect = [&](const Lanes& taken_lanes) {
+        for (Mask rest = group; rest; rest &= rest - 1) {
+            int l = __builtin_ctz(rest);
+            pc[l] = taken_lanes[l] ? (uint16_t)((registers[d.x][l] << 8) | registers[d.y][l]) : next;
+        }
+        split();
+    };
+
+    switch (d.opcode) {
+        case 0x00: break; // NOP
+        case 0x01: case 0x02: write(value); break; // MOV
+        case 0x03: { // MOV $x, [#0]
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                x[l] = cpus[l]->ram.get_from_address(address(l));
+            }
+            break;
+        }
+        case 0x04: { // MOV $x, [$y, $z], $y is the low byte
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                x[l] = cpus[l]->ram.get_from_address((registers[d.z][l] << 8) | registers[d.y][l]);
+            }
+            break;
+        }
+        case 0x10: write(~x); break; // NOT
+        case 0x11: case 0x12: write(x & value); break; // AND
+        case 0x22: case 0x23: add_flags(x + value); break; // CMP
+        case 0x40: case 0x41: case 0x43: case 0x44: { // ADD, SUB
+            Lanes sum = x + value;
+            add_flags(sum);
+            write(sum);
+            break;
+        }
+        case 0x42: { // INC, flags only when it wraps
+            Lanes result = x + 1;
+            Lanes wrapped = (Lanes)(result == 0) & m;
+            write(result);
+            zero &= ~wrapped;
+            underflow &= ~wrapped;
+            overflow |= wrapped;
+            break;
+        }
+        case 0x45: { // DEC, flags only when it wraps
+            Lanes result = x - 1;
+            Lanes wrapped = (Lanes)(result == 0xff) & m;
+            write(result);
+            zero &= ~wrapped;
+            underflow |= wrapped;
+            overflow &= ~wrapped;
+            break;
+        }
+        case 0x46: case 0x47: { // MUL, the high byte only decides the flags
+            Lanes result, z, o;
+            for (int l = 0; l < LANES; l++) {
+                uint16_t product = x[l] * value[l];
+                result[l] = product;
+                z[l] = product == 0 ? 0xff : 0;
+                o[l] = product > 0xff ? 0xff : 0;
+            }
+            flags(z, (Lanes){}, o);
+            write(result);
+            break;
+        }
+        case 0x48: case 0x49: case 0x4a: case 0x4b: case 0x4c: case 0x4d: { // DIV, PWR, SQRT, FSQRT
+            // Rare and not vector friendly, each lane goes through its own CPU's ALU
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                CPU& c = *cpus[l];
+                byte op = d.opcode;
+                if ((op == 0x4a || op == 0x4b) && (x[l] == 0 || value[l] == 0)) {
+                    stop(l, LaneStatus::FAULTED, (int)Errors::SIGABRT, group_pc, 0);
+                    continue;
+                }
+                x[l] = op <= 0x49 ? c.alu_div(x[l], value[l]) : op <= 0x4b ? c.alu_pwr(x[l], value[l])
+                        : op == 0x4c ? c.alu_sqrt(x[l]) : c.alu_fsqrt(x[l]);
+                c.sync_flags();
+                zero[l] = c.zero ? 0xff : 0;
+                underflow[l] = c.underflow ? 0xff : 0;
+                overflow[l] = c.overflow ? 0xff : 0;
+            }
+            break;
+        }
+        case 0x4e: case 0x4f: { // MOD
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                if (value[l] == 0) {
+                    stop(l, LaneStatus::FAULTED, (int)Errors::SIGFPE, group_pc, 0);
+                    continue;
+                }
+                x[l] %= value[l];
+                zero[l] = x[l] == 0 ? 0xff : 0;
+                underflow[l] = 0;
+                overflow[l] = 0;
+            }
+            break;
+        }
+        case 0x20: branch(m, d.address); return; // JMP [#0]
+        case 0x21: branch_indirect(m); return; // JMP [$x,$y]
+        case 0x24: case 0x25: case 0x26: case 0x27: case 0x28: case 0x29: // Jcc
+        case 0x2a: case 0x2b: case 0x2c: case 0x2d: case 0x2e: case 0x2f: {
+            int which = (d.opcode - 0x24) / 4;
+            Lanes flag = which == 0 ? zero : which == 1 ? underflow : overflow;
+            if ((d.opcode - 0x24) / 2 % 2) flag = ~flag;
+
+            if (d.opcode & 1) branch_indirect(flag);
+            else branch(flag, d.address);
+            return;
+        }
+        case 0x30: case 0x31: { // PUSH
+            Lanes pushed = d.opcode == 0x30 ? x : value;
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                cpus[l]->stack.push(pushed[l]);
+            }
+            break;
+        }
+        case 0x32: { // POP
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                x[l] = cpus[l]->stack.pop();
+            }
+            break;
+        }
+        case 0x50: { // CALL [#0]
+            for (Mask rest = group; rest; rest &= rest - 1) cpus[__builtin_ctz(rest)]->stack.push_16bit(next);
+            branch(m, d.address);
+            return;
+        }
+        case 0x51: { // CALL [$x,$y]
+            for (Mask rest = group; rest; rest &= rest - 1) cpus[__builtin_ctz(rest)]->stack.push_16bit(next);
+            branch_indirect(m);
+            return;
+        }
+        case 0x52: { // RET
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                pc[l] = cpus[l]->stack.pop_16bit();
+            }
+            split();
+            return;
+        }
+        case 0x60: case 0x62: { // STORE [$x,$y], $z / #0
+            Lanes stored = d.opcode == 0x60 ? registers[d.z] : value;
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                store(l, (x[l] << 8) | registers[d.y][l], stored[l]);
+            }
+            break;
+        }
+        case 0x61: case 0x63: { // STORE [#0], $x / #1
+            Lanes stored = d.opcode == 0x61 ? x : value;
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                store(l, address(l), stored[l]);
+            }
+            break;
+        }
+        case 0x64: case 0x65: { // CAS, XADD [$x,$y], $z. Lanes don't share memory, a device is like a store.
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                RAM& ram = cpus[l]->ram;
+                uint16_t to = (x[l] << 8) | registers[d.y][l];
+                if (ram.page_flags[to / PAGE_SIZE] & PAGE_DEVICE) {
+                    leave(l, group_pc, 0);
+                    solo[l] = true;
+                    continue;
+                }
+
+                int sum = 0;
+                if (d.opcode == 0x64) {
+                    byte held = registers[0][l];
+                    ram.compare_exchange(to, held, registers[d.z][l]);
+                    sum = held == registers[0][l] ? 0 : 1;
+                    registers[0][l] = held;
+                }
+                else {
+                    byte added = registers[d.z][l], held = added;
+                    ram.fetch_add(to, held);
+                    registers[d.z][l] = held;
+                    sum = held + added;
+                }
+                zero[l] = sum == 0 ? 0xff : 0;
+                underflow[l] = 0;
+                overflow[l] = sum > 0xff ? 0xff : 0;
+            }
+            break;
+        }
+        case 0xfd: case 0xfe: case 0xff: { // HALT
+            Lanes codes = d.opcode == 0xfd ? x : d.opcode == 0xfe ? value : (Lanes){};
+            for (Mask rest = group; rest; rest &= rest - 1) {
+                int l = __builtin_ctz(rest);
+                stop(l, LaneStatus::HALTED, codes[l], next, 1);
+            }
+            return;
+        }
+    }
+
+    group_pc = next;
+    taken++;
+}
+
+template <int LANES>
+int Lockstep<LANES>::execute(uint64_t budget)
+{
+    Mask gathered = 0;
+    for (int l = 0; l < count; l++) {
+        left[l] = status[l] == LaneStatus::RUNNING ? budget : 0;
+        if (status[l] == LaneStatus::RUNNING && !solo[l]) {
+            gather(l);
+            gathered |= 1u << l;
+        }
+    }
+
+    group = 0;
+    taken = 0;
+    while (true) {
+        if (group == 0 || taken == group_left || group_pc >= waiting_pc) {
+            regroup();
+            if (group == 0) break;
+        }
+        step();
+    }
+
+    for (Mask rest = gathered; rest; rest &= rest - 1) {
+        int l = __builtin_ctz(rest);
+        scatter(l);
+        cpus[l]->retired += budget - left[l];
+    }
+
+    // Lanes that left the group finish the round on their own
+    int running = 0;
+    for (int l = 0; l < count; l++) {
+        if (status[l] != LaneStatus::RUNNING) continue;
+        if (solo[l] && left[l] > 0) {
+            try {
+                int result = cpus[l]->execute(left[l]);
+                if (result != -1) {
+                    status[l] = LaneStatus::HALTED;
+                    code[l] = result;
+                }
+            }
+            catch (VMFault& f) {
+                status[l] = LaneStatus::FAULTED;
+                code[l] = (int)f.code;
+            }
+        }
+        if (status[l] == LaneStatus::RUNNING) running++;
+    }
+    return running;
+}
+
+template struct Lockstep<8>;
+template struct Lockstep<16>;
+template struct Lockstep<32>;
@@ -0,0 +1,92 @@
+#pragma once
+#include "def.h"
+#include "errors.h"
+#include "ram.h"
+
+#define LOCKSTEP_ZERO_ROW 8 // ALWAYS_ZERO's row, after the registers
+
+struct CPU;
+
+enum struct LaneStatus : byte {
+    RUNNING,
+    HALTED,     // code is the halt code
+    FAULTED,    // code is the Errors value
+};
+
+// One byte per lane. Plain GCC/Clang vector types, SSE2 or AVX2 depending on what the
+// compiler targets (build with -mavx2 or -march=native to get the wider one).
+template <int LANES> struct LaneVector;
+template <> struct LaneVector<8>  { typedef byte type __attribute__((vector_size(8))); };
+template <> struct LaneVector<16> { typedef byte type __attribute__((vector_size(16))); };
+template <> struct LaneVector<32> { typedef byte type __attribute__((vector_size(32))); };
+
+// One instruction as every lane of a group runs it. Verified against the RAM of all
+// the lanes when it's decoded, so it doesn't matter which lane it was read from.
+struct LockstepInstruction {
+    byte opcode;
+    byte x, y, z;       // Register rows, LOCKSTEP_ZERO_ROW for ALWAYS_ZERO
+    byte immediate;
+    byte immediate_at;  // Offsets of the immediates in the instruction, 0 if it has none
+    byte address_at;
+    byte length;
+    bool decoded;
+    bool varying;       // The lanes have different immediates, read them from each lane's RAM
+    uint16_t address;   // 16-bit immediate
+};
+
+// Runs up to LANES CPUs with the same program side by side. Registers and flags are
+// kept as one vector per register (structure of arrays), and lanes at the same PC
+// run each instruction together through vector code, with a mask for the ones that
+// aren't there. When a branch splits them the lowest PC goes first, so they meet
+// again after the branch (loops, if/else). Every lane ends up exactly where it would
+// running alone through CPU::tick.
+// Lanes may have different immediates (that's how a sweep usually differs), but a lane
+// whose opcodes or registers differ is dropped and finishes on its own CPU's engine.
+template <int LANES>
+struct Lockstep {
+    public:
+    typedef typename LaneVector<LANES>::type Lanes;
+    typedef uint32_t Mask; // One bit per lane
+
+    private:
+    CPU* cpus[LANES];
+    int count;
+
+    Lanes registers[LOCKSTEP_ZERO_ROW + 1];
+    Lanes zero, underflow, overflow; // 0xff when set
+    uint16_t pc[LANES];
+    uint64_t left[LANES]; // Budget left this round
+    bool solo[LANES];
+
+    // Lanes running together now, all at group_pc and having run taken instructions since the group formed
+    Mask group;
+    Lanes group_mask;
+    uint16_t group_pc;
+    uint64_t taken;
+    uint64_t group_left;
+    uint32_t waiting_pc; // Lowest PC of the lanes waiting outside the group, past 0xffff if none
+
+    LockstepInstruction* cache; // One slot per address
+
+    Mask lockstep_lanes(bool with_budget);
+    void gather(int lane);
+    void scatter(int lane);
+    void regroup();
+    void leave(int lane, uint16_t address, uint64_t retired);
+    void stop(int lane, LaneStatus status, int code, uint16_t address, uint64_t retired);
+    void split();
+
+    bool decode(uint16_t address);
+    void step();
+    static void code_written(void* context, uint16_t address);
+
+    public:
+    LaneStatus status[LANES];
+    int code[LANES];
+
+    Lockstep(CPU* const* cpus, int count);
+    ~Lockstep();
+
+    // Gives every running lane up to budget more instructions. Returns how many are still running.
+    int execute(uint64_t budget);
+};
@@ -0,0 +1,34 @@
+#pragma once
+#include "def.h"
+
+// What the VM is built as. One of the machines below is picked at compile time (NEODYMIUM_MACHINE,
+// set by CMake), STACK_ADDRESS, SCREEN_ADDRESS, WIDTH, HEIGHT and ZOOM all come from it, so they
+// stay constants the compiler folds like it did when they were plain numbers. The address space is
+// 16 bits and there are 8 registers whatever the machine (the JIT, native code and lockstep hard-wire
+// them), so RAM_SIZE and REGISTERS aren't part of it.
+struct Machine {
+    const char* name;
+    uint16_t stack_address;
+    uint16_t screen_address;
+    int width;              // Of the screen in pixels
+    int height;
+    int zoom;               // Window pixels per screen pixel
+    bool window;            // false never opens one, even when built with GLFW
+};
+
+// The one Neodymium always was
+constexpr Machine CLASSIC_MACHINE = {"classic", 0xcf00, 0xa000, 16, 16, 32, true};
+// 32x32 screen in the same 512x512 window, the framebuffer ends at 0xabff
+constexpr Machine WIDE_MACHINE = {"wide", 0xcf00, 0xa000, 32, 32, 16, true};
+// For batch jobs and servers: the classic memory map, no window
+constexpr Machine HEADLESS_MACHINE = {"headless", 0xcf00, 0xa000, 16, 16, 32, false};
+
+#ifndef NEODYMIUM_MACHINE
+#define NEODYMIUM_MACHINE CLASSIC_MACHINE
+#endif
+
+constexpr Machine MACHINE = NEODYMIUM_MACHINE;
+
+static_assert(MACHINE.stack_address % 0x100 == 0 && MACHINE.stack_address < 0xd000, "The stack is a page under the devices");
+static_assert(MACHINE.screen_address + MACHINE.width * MACHINE.height * 3 <= MACHINE.stack_address - 15 * 0x100,
+    "The framebuffer runs into the stacks of the other cores");
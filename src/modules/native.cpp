@@ -0,0 +1,156 @@
+#include "native.h"
+#include "cpu.h"
+#include "alu.h"
+#include <cstring>
+#include <string>
+#include <dlfcn.h>
+
+static_assert(sizeof(NativeAlu) == sizeof(AluResult), "NativeAlu has to be AluResult");
+
+NativeEngine::NativeEngine(CPU* cpu)
+: cpu(cpu), library(nullptr), module(nullptr), context(), interpreted(0)
+{
+    context.memory = cpu->ram.memory;
+    context.page_flags = cpu->ram.page_flags;
+    context.registers = cpu->registers;
+    context.always_zero = &cpu->ALWAYS_ZERO;
+    context.sp = &cpu->stack.sp;
+    context.flags_result = &cpu->flags_result;
+    context.flags_pending = &cpu->flags_pending;
+    context.zero = &cpu->zero;
+    context.underflow = &cpu->underflow;
+    context.overflow = &cpu->overflow;
+    context.div_table = (const NativeAlu*)div_table.entries;
+    context.pwr_table = (const NativeAlu*)pwr_table.entries;
+    context.sqrt_table = (const NativeAlu*)sqrt_table.entries;
+    context.fsqrt_table = (const NativeAlu*)fsqrt_table.entries;
+    context.read = read;
+    context.write = write;
+    context.host = cpu;
+}
+
+NativeEngine::~NativeEngine()
+{
+    if (cpu->ram.code_context == this) cpu->ram.code_written = nullptr;
+    if (library != nullptr) dlclose(library);
+}
+
+bool NativeEngine::load(const char* path, Errors& error)
+{
+    error = Errors::BAD_NATIVE;
+    // A path without a slash would be looked up in the library path instead
+    std::string full = strchr(path, '/') == nullptr ? std::string("./") + path : std::string(path);
+    library = dlopen(full.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (library == nullptr) return false;
+
+    module = (const NativeModule*)dlsym(library, NATIVE_SYMBOL);
+    if (module == nullptr || module->version != NATIVE_VERSION || module->size > RAM_SIZE) {
+        module = nullptr;
+        return false;
+    }
+    // Only the code has to match, a snapshot can have written over the program's data
+    for (uint32_t address = 0; address < module->size; address++) {
+        if (has(module->compiled, address) && module->image[address] != cpu->ram.memory[address]) {
+            module = nullptr;
+            return false;
+        }
+    }
+
+    // Stores over compiled code have to be seen
+    for (uint32_t address = 0; address < module->size; address++) {
+        if (has(module->compiled, address)) cpu->ram.page_flags[address / PAGE_SIZE] |= PAGE_CODE;
+    }
+    return true;
+}
+
+uint8_t NativeEngine::read(void* host, uint16_t address)
+{
+    return static_cast<CPU*>(host)->ram.get_from_address(address);
+}
+
+int NativeEngine::write(void* host, uint16_t address, uint8_t data)
+{
+    return static_cast<CPU*>(host)->ram.write(address, data);
+}
+
+void NativeEngine::code_written(void* context, uint16_t address)
+{
+    NativeEngine* engine = static_cast<NativeEngine*>(context);
+    if (engine->module != nullptr && address < engine->module->size && engine->has(engine->module->compiled, address)) {
+        engine->context.stale = true;
+    }
+}
+
+int NativeEngine::execute(uint64_t budget)
+{
+    RAM& ram = cpu->ram;
+    ram.code_written = code_written;
+    ram.code_context = this;
+
+    uint64_t executed = 0;
+    int result = -1;
+
+    try {
+        while (executed < budget) {
+            uint16_t pc = ram.pc;
+            if (module != nullptr && !context.stale && has(module->entries, pc)) {
+                uint64_t left = budget - executed;
+                context.budget = left > INT64_MAX ? INT64_MAX : (int64_t)left;
+                int64_t given = context.budget;
+                uint32_t exit = module->run(&context, pc);
+                executed += given - context.budget;
+
+                uint16_t value = exit & 0xffff;
+                switch (exit >> 16) {
+                    case NATIVE_EXIT_HALT:
+                        ram.pc = context.halt_pc;
+                        result = value;
+                        break;
+                    case NATIVE_EXIT_YIELD:
+                        ram.pc = value;
+                        result = TICK_YIELD;
+                        break;
+                    case NATIVE_EXIT_BUDGET:
+                        // Less than the block is left, it runs straight through
+                        ram.pc = value;
+                        while (executed < budget && result == -1) {
+                            result = cpu->tick();
+                            executed++;
+                            interpreted++;
+                        }
+                        break;
+                    case NATIVE_EXIT_INTERPRET:
+                        ram.pc = value;
+                        result = cpu->tick();
+                        executed++;
+                        interpreted++;
+                        break;
+                    default: // NATIVE_EXIT_JUMP, NATIVE_EXIT_STALE
+                        ram.pc = value;
+                        break;
+                }
+                if (result != -1) break;
+                continue;
+            }
+
+            // No native code here, one instruction at a time until there is
+            result = cpu->tick();
+            executed++;
+            interpreted++;
+            if (result != -1) break;
+        }
+    }
+    catch (...) {
+        cpu->retired += executed;
+        throw;
+    }
+
+    cpu->retired += executed;
+    return result == TICK_YIELD ? -1 : result;
+}
+
+void NativeEngine::report(FILE* out)
+{
+    fprintf(out, "Native: %llu instructions interpreted%s\n", (unsigned long long)interpreted,
+        context.stale ? ", compiled code was written over" : "");
+}
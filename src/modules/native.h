@@ -0,0 +1,89 @@
+#pragma once
+#include "def.h"
+#include "errors.h"
+#include <cstdio>
+
+// Programs recompiled ahead of time by neodymium_aot (see recompiler.h) into a shared object,
+// run by Engine::NATIVE. The generated code only knows what's in NATIVE_ABI, which it gets as text
+// (NATIVE_ABI_SOURCE), so both sides share one definition.
+
+#define NATIVE_VERSION  1 // Goes up whenever NATIVE_ABI or the exits change
+#define NATIVE_SYMBOL   "neodymium_native" // The NativeModule a shared object exports
+
+// What run() returns: one of these in the high 16 bits, a pc in the low ones (the halt code for NATIVE_EXIT_HALT)
+#define NATIVE_EXIT_JUMP        1 // Got to an address with no native code, the interpreter goes on from there
+#define NATIVE_EXIT_BUDGET      2 // The block at pc doesn't fit in the budget
+#define NATIVE_EXIT_INTERPRET   3 // The instruction at pc has to run in the interpreter (it faults)
+#define NATIVE_EXIT_YIELD       4 // Stored to a device that wants the engine to stop, pc is after the store
+#define NATIVE_EXIT_STALE       5 // Stored over compiled code, pc is after the store
+#define NATIVE_EXIT_HALT        6 // halt_pc is after the HALT
+
+// NativeAlu is AluResult. entries and compiled are bitmaps by address: run() can start there, the
+// byte is part of an instruction it compiled. read() and write() are RAM::get_from_address() and
+// RAM::write(), for pages with flags.
+#define NATIVE_ABI \
+    struct NativeAlu { uint8_t value; uint8_t flags; }; \
+    struct NativeContext { \
+        uint8_t* memory; \
+        const uint8_t* page_flags; \
+        uint8_t* registers; \
+        uint8_t* always_zero; \
+        uint8_t* sp; \
+        int64_t* flags_result; \
+        bool* flags_pending; \
+        bool* zero; \
+        bool* underflow; \
+        bool* overflow; \
+        const NativeAlu* div_table; \
+        const NativeAlu* pwr_table; \
+        const NativeAlu* sqrt_table; \
+        const NativeAlu* fsqrt_table; \
+        uint8_t (*read)(void* host, uint16_t address); \
+        int (*write)(void* host, uint16_t address, uint8_t data); \
+        void* host; \
+        int64_t budget; \
+        uint16_t halt_pc; \
+        bool stale; \
+    }; \
+    struct NativeModule { \
+        uint32_t version; \
+        uint32_t size; \
+        const uint8_t* image; \
+        const uint8_t* entries; \
+        const uint8_t* compiled; \
+        uint32_t (*run)(NativeContext* context, uint16_t pc); \
+    };
+
+NATIVE_ABI
+
+#define NATIVE_STRING(...) #__VA_ARGS__
+#define NATIVE_TEXT(...) NATIVE_STRING(__VA_ARGS__)
+#define NATIVE_ABI_SOURCE NATIVE_TEXT(NATIVE_ABI)
+
+struct CPU;
+
+// Runs the blocks the shared object has, and the interpreter (CPU::tick) everywhere else: code the
+// recompiler couldn't find (behind register-indirect jumps, timer interrupts), and from the first
+// time the program writes over compiled code on.
+struct NativeEngine {
+    private:
+    CPU* cpu;
+    void* library;
+    const NativeModule* module;
+    NativeContext context;
+
+    static uint8_t read(void* host, uint16_t address);
+    static int write(void* host, uint16_t address, uint8_t data);
+    static void code_written(void* context, uint16_t address);
+    bool has(const uint8_t* bitmap, uint16_t address) const { return bitmap[address >> 3] >> (address & 7) & 1; }
+
+    public:
+    uint64_t interpreted; // Instructions the interpreter ran, for --stats
+
+    NativeEngine(CPU* cpu);
+    ~NativeEngine();
+
+    bool load(const char* path, Errors& error); // Built from the program in memory, BAD_NATIVE otherwise
+    int execute(uint64_t budget); // Same contract as CPU::execute
+    void report(FILE* out);
+};
@@ -0,0 +1,93 @@
+#include "opcodes.h"
+#include <cstring>
+
+const char* opcode_operands(byte opcode)
+{
+    switch (opcode) {
+        case 0x00: case 0x52: case 0xff: return "";
+        case 0x10: case 0x30: case 0x32: case 0x42: case 0x45: case 0x4c: case 0x4d: case 0xfd: return "R";
+        case 0x31: case 0xfe: return "I";
+        case 0x20: case 0x24: case 0x26: case 0x28: case 0x2a: case 0x2c: case 0x2e: case 0x50: return "A";
+        case 0x01: case 0x11: case 0x21: case 0x23: case 0x25: case 0x27: case 0x29: case 0x2b: case 0x2d: case 0x2f:
+        case 0x41: case 0x44: case 0x47: case 0x49: case 0x4b: case 0x4e: case 0x51: return "RR";
+        case 0x02: case 0x12: case 0x22: case 0x40: case 0x43: case 0x46: case 0x48: case 0x4a: case 0x4f: return "RI";
+        case 0x03: return "RA";
+        case 0x04: case 0x60: case 0x64: case 0x65: return "RRR";
+        case 0x61: return "AR";
+        case 0x62: return "RRI";
+        case 0x63: return "AI";
+    }
+    return nullptr;
+}
+
+const char* opcode_name(byte opcode)
+{
+    switch (opcode) {
+        case 0x00: return "NOP";
+        case 0x01: return "MOV $x, $y";
+        case 0x02: return "MOV $x, #0";
+        case 0x03: return "MOV $x, [#0]";
+        case 0x04: return "MOV $x, [$y, $z]";
+        case 0x10: return "NOT $x";
+        case 0x11: return "AND $x, $y";
+        case 0x12: return "AND $x, #0";
+        case 0x20: return "JMP [#0]";
+        case 0x21: return "JMP [$x, $y]";
+        case 0x22: return "CMP $x, #0";
+        case 0x23: return "CMP $x, $y";
+        case 0x24: return "JZ [#0]";
+        case 0x25: return "JZ [$x, $y]";
+        case 0x26: return "JNZ [#0]";
+        case 0x27: return "JNZ [$x, $y]";
+        case 0x28: return "JU [#0]";
+        case 0x29: return "JU [$x, $y]";
+        case 0x2a: return "JNU [#0]";
+        case 0x2b: return "JNU [$x, $y]";
+        case 0x2c: return "JO [#0]";
+        case 0x2d: return "JO [$x, $y]";
+        case 0x2e: return "JNO [#0]";
+        case 0x2f: return "JNO [$x, $y]";
+        case 0x30: return "PUSH $x";
+        case 0x31: return "PUSH #0";
+        case 0x32: return "POP $x";
+        case 0x40: return "ADD $x, #0";
+        case 0x41: return "ADD $x, $y";
+        case 0x42: return "INC $x";
+        case 0x43: return "SUB $x, #0";
+        case 0x44: return "SUB $x, $y";
+        case 0x45: return "DEC $x";
+        case 0x46: return "MUL $x, #0";
+        case 0x47: return "MUL $x, $y";
+        case 0x48: return "DIV $x, #0";
+        case 0x49: return "DIV $x, $y";
+        case 0x4a: return "PWR $x, #0";
+        case 0x4b: return "PWR $x, $y";
+        case 0x4c: return "SQRT $x";
+        case 0x4d: return "FSQRT $x";
+        case 0x4e: return "MOD $x, $y";
+        case 0x4f: return "MOD $x, #0";
+        case 0x50: return "CALL [#0]";
+        case 0x51: return "CALL [$x, $y]";
+        case 0x52: return "RET";
+        case 0x60: return "STORE [$x, $y], $z";
+        case 0x61: return "STORE [#0], $x";
+        case 0x62: return "STORE [$x, $y], #0";
+        case 0x63: return "STORE [#0], #1";
+        case 0x64: return "CAS [$x, $y], $z";
+        case 0x65: return "XADD [$x, $y], $z";
+        case 0xfd: return "HALT $x";
+        case 0xfe: return "HALT #0";
+        case 0xff: return "HALT";
+    }
+    return "???";
+}
+
+int instruction_length(byte opcode)
+{
+    const char* operands = opcode_operands(opcode);
+    if (operands == nullptr) return 1;
+
+    int length = 1;
+    for (const char* o = operands; *o; o++) length += *o == 'A' ? 2 : 1;
+    return length;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "def.h"
+
+// What every opcode looks like, for the tools and engines that need to walk code without running it
+
+// Operands in order: R register, I 8-bit immediate, A 16-bit immediate (high byte first). nullptr if the opcode doesn't exist.
+const char* opcode_operands(byte opcode);
+// Assembly form ("ADD $x, #0"), "???" if the opcode doesn't exist
+const char* opcode_name(byte opcode);
+// Bytes, opcode included. 1 for opcodes that don't exist, same as the interpreter reads.
+int instruction_length(byte opcode);
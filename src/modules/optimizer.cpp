@@ -0,0 +1,614 @@
+#include "optimizer.h"
+#include "alu.h"
+#include "cpu.h"
+#include "opcodes.h"
+
+#define OPT_REGISTERS   (REGISTERS + 1) // ALWAYS_ZERO can be written like any other
+#define OPT_ALL_LIVE    ((1 << OPT_REGISTERS) - 1)
+
+// Register operand as an index into the known values, ALWAYS_ZERO last
+static int reg(byte r)
+{
+    return r == 0xff ? REGISTERS : r;
+}
+
+static uint16_t bit(byte r)
+{
+    return r == 0xff || r < REGISTERS ? 1 << reg(r) : 0;
+}
+
+// Reading there does something (takes a key), it's not just a load
+static bool device_address(uint16_t address)
+{
+    return address / PAGE_SIZE == KEYBOARD_ADDRESS / PAGE_SIZE;
+}
+
+// Where a load or store through [$x, $y] goes, -1 if it isn't one or the registers aren't known
+static int pointed_at(const CodeInstruction& in, const int known[])
+{
+    const byte* o = in.operands;
+    int high, low;
+    switch (in.opcode) {
+        case 0x04: high = known[reg(o[2])]; low = known[reg(o[1])]; break; // MOV $x, [$y, $z], $y is the low byte
+        case 0x60: case 0x62: case 0x64: case 0x65: high = known[reg(o[0])]; low = known[reg(o[1])]; break;
+        default: return -1;
+    }
+    return high == -1 || low == -1 ? -1 : high << 8 | low;
+}
+
+// What running an instruction does to the registers and flags
+struct Effects {
+    uint16_t reads;     // Registers
+    uint16_t writes;    // Registers it leaves a new value in
+    bool reads_flags;
+    bool sets_flags;    // Every time it runs
+    bool may_set_flags; // INC/DEC, only when they wrap
+    bool pure;          // Nothing else: no memory or stack, can't fault, doesn't jump
+};
+
+static Effects effects(const CodeInstruction& in)
+{
+    Effects e = {};
+    const byte* o = in.operands;
+
+    switch (in.opcode) {
+        case 0x00: e.pure = true; break;
+        case 0x01: e.reads = bit(o[1]); e.writes = bit(o[0]); e.pure = true; break;
+        case 0x02: e.writes = bit(o[0]); e.pure = true; break;
+        case 0x03: e.writes = bit(o[0]); e.pure = !device_address(in.address); break;
+        case 0x04: e.reads = bit(o[1]) | bit(o[2]); e.writes = bit(o[0]); break; // Could be reading a device
+        case 0x10: case 0x12: e.reads = e.writes = bit(o[0]); e.pure = true; break;
+        case 0x11: e.reads = bit(o[0]) | bit(o[1]); e.writes = bit(o[0]); e.pure = true; break;
+        case 0x22: e.reads = bit(o[0]); e.sets_flags = e.pure = true; break;
+        case 0x23: e.reads = bit(o[0]) | bit(o[1]); e.sets_flags = e.pure = true; break;
+        case 0x24: case 0x26: case 0x28: case 0x2a: case 0x2c: case 0x2e: e.reads_flags = true; break;
+        case 0x30: e.reads = bit(o[0]); break;
+        case 0x32: e.writes = bit(o[0]); break;
+        case 0x40: case 0x43: case 0x46: case 0x48: case 0x4c: case 0x4d:
+            e.reads = e.writes = bit(o[0]); e.sets_flags = e.pure = true; break;
+        case 0x41: case 0x44: case 0x47: case 0x49:
+            e.reads = bit(o[0]) | bit(o[1]); e.writes = bit(o[0]); e.sets_flags = e.pure = true; break;
+        case 0x42: case 0x45: e.reads = e.writes = bit(o[0]); e.may_set_flags = e.pure = true; break;
+        case 0x4a: e.reads = e.writes = bit(o[0]); e.sets_flags = true; break;                 // PWR faults on a 0
+        case 0x4b: case 0x4e: e.reads = bit(o[0]) | bit(o[1]); e.writes = bit(o[0]); e.sets_flags = true; break;
+        case 0x4f: e.reads = e.writes = bit(o[0]); e.sets_flags = true; e.pure = o[1] != 0; break;  // MOD #0 faults
+        case 0x60: e.reads = bit(o[0]) | bit(o[1]) | bit(o[2]); break;
+        case 0x61: e.reads = bit(o[2]); break;
+        case 0x62: e.reads = bit(o[0]) | bit(o[1]); break;
+        case 0x64: e.reads = bit(o[0]) | bit(o[1]) | bit(o[2]) | bit(0); e.writes = bit(0); e.sets_flags = true; break; // CAS compares with $a
+        case 0x65: e.reads = bit(o[0]) | bit(o[1]) | bit(o[2]); e.writes = bit(o[2]); e.sets_flags = true; break;
+        case 0xfd: e.reads = bit(o[0]); break;
+    }
+    return e;
+}
+
+// Same flag, jumping when it's the other way
+static byte opposite(byte opcode)
+{
+    switch (opcode) {
+        case 0x24: return 0x26;
+        case 0x26: return 0x24;
+        case 0x28: return 0x2a;
+        case 0x2a: return 0x28;
+        case 0x2c: return 0x2e;
+        case 0x2e: return 0x2c;
+    }
+    return 0;
+}
+
+static bool leaves_to(byte opcode) // Has a jump or call target
+{
+    return is_jump(opcode) || is_conditional_jump(opcode) || opcode == 0x50;
+}
+
+Optimizer::Optimizer(const ControlFlow& flow)
+    : flow(flow), code(flow.instructions), removed(code.size()), leader(code.size()), region(code.size()),
+      live(code.size()), flags_live(code.size()), stats(), problem(nullptr), problem_pc(0)
+{
+    // Instructions that follow each other with nothing in between can be packed together
+    for (size_t i = 1; i < code.size(); i++) {
+        bool touching = code[i - 1].pc + code[i - 1].length == code[i].pc;
+        region[i] = region[i - 1] + (touching ? 0 : 1);
+    }
+
+    // Data in the image has to stay where it is, a fixed address or a register pair could point at it
+    compact = !flow.reads_memory();
+    for (size_t address = 0; address < flow.image.size() && compact; address++) {
+        if (flow.marks[address] & CFG_WRITTEN) compact = false;
+    }
+}
+
+int Optimizer::resolve(uint16_t address) const
+{
+    int i = flow.index[address];
+    if (i == -1) return -1;
+    while (i < (int)code.size() && removed[i]) i++;
+    return i < (int)code.size() ? i : -1;
+}
+
+int Optimizer::following(int i) const
+{
+    int next = i + 1;
+    while (next < (int)code.size() && removed[next]) next++;
+    if (next == (int)code.size()) return -1;
+
+    // Past a gap there's data in between, unless it's all going away
+    if (!compact && region[next] != region[i]) return -1;
+    return next;
+}
+
+int Optimizer::successors(int i, int out[2]) const
+{
+    const CodeInstruction& in = code[i];
+    if (!valid_registers(in)) return 0; // Faults every time
+    if (in.opcode == 0x52) return -1;
+
+    int count = 0;
+    if (leaves_to(in.opcode)) out[count++] = resolve(in.address);
+    if (!is_terminator(in.opcode) && in.opcode != 0x50) out[count++] = following(i);
+    return count;
+}
+
+void Optimizer::remove(int i, int& counter)
+{
+    removed[i] = true;
+    counter++;
+}
+
+void Optimizer::rewrite(int i, byte opcode, byte a, byte b, byte c)
+{
+    CodeInstruction& in = code[i];
+    in.opcode = opcode;
+    in.length = instruction_length(opcode);
+    in.operands[0] = a;
+    in.operands[1] = b;
+    in.operands[2] = c;
+
+    // 16-bit immediates, high byte first
+    if (has_address(opcode)) {
+        int at = opcode == 0x03 ? 1 : 0;
+        in.address = (uint16_t)(in.operands[at] << 8 | in.operands[at + 1]);
+    }
+}
+
+void Optimizer::move_immediate(int i, byte r, byte value, int known)
+{
+    if (known == value) {
+        remove(i, stats.redundant);
+        return;
+    }
+    if (!fits(i, instruction_length(0x02))) return;
+    rewrite(i, 0x02, r, value);
+    stats.folded++;
+}
+
+bool Optimizer::fits(int i, int length) const
+{
+    if (compact || length <= code[i].length) return true;
+
+    // A run of code packed in place can't get longer than it was
+    int first = i, last = i;
+    while (first > 0 && region[first - 1] == region[i]) first--;
+    while (last + 1 < (int)code.size() && region[last + 1] == region[i]) last++;
+
+    int size = length - code[i].length;
+    for (int at = first; at <= last; at++) size += removed[at] ? 0 : code[at].length;
+    return size <= flow.instructions[last].pc + flow.instructions[last].length - flow.instructions[first].pc;
+}
+
+void Optimizer::find_leaders()
+{
+    for (size_t i = 0; i < code.size(); i++) leader[i] = false;
+
+    int entry = resolve(0);
+    if (entry != -1) leader[entry] = true;
+
+    for (size_t i = 0; i < code.size(); i++) {
+        if (removed[i]) continue;
+        byte opcode = code[i].opcode;
+
+        if (leaves_to(opcode)) {
+            int target = resolve(code[i].address);
+            if (target != -1) leader[target] = true;
+        }
+        // Where a branch doesn't go and where a CALL comes back to
+        if (is_conditional_jump(opcode) || opcode == 0x50) {
+            int next = following(i);
+            if (next != -1) leader[next] = true;
+        }
+    }
+}
+
+// Backwards until nothing changes: what's read before being written again, on any path
+void Optimizer::find_liveness()
+{
+    std::vector<uint16_t> live_in(code.size());
+    std::vector<bool> flags_in(code.size());
+    for (size_t i = 0; i < code.size(); i++) {
+        live[i] = 0;
+        flags_live[i] = false;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = (int)code.size() - 1; i >= 0; i--) {
+            if (removed[i]) continue;
+
+            uint16_t out = 0;
+            bool flags_out = false;
+            int next[2];
+            int count = successors(i, next);
+            if (count == -1) {
+                out = OPT_ALL_LIVE; // Back to the caller, which could read anything
+                flags_out = true;
+            }
+            for (int s = 0; s < count; s++) {
+                if (next[s] == -1) continue;
+                out |= live_in[next[s]];
+                flags_out = flags_out || flags_in[next[s]];
+            }
+
+            Effects e = effects(code[i]);
+            uint16_t in = e.reads | (out & ~e.writes);
+            bool flags = e.reads_flags || (!e.sets_flags && flags_out);
+            if (!valid_registers(code[i])) {
+                in = 0;
+                flags = false;
+            }
+
+            if (in != live_in[i] || flags != flags_in[i] || out != live[i] || flags_out != flags_live[i]) changed = true;
+            live_in[i] = in;
+            flags_in[i] = flags;
+            live[i] = out;
+            flags_live[i] = flags_out;
+        }
+    }
+}
+
+bool Optimizer::thread_jumps()
+{
+    bool changed = false;
+
+    for (int i = 0; i < (int)code.size(); i++) {
+        if (removed[i] || !leaves_to(code[i].opcode)) continue;
+        byte opcode = code[i].opcode;
+        uint16_t target = code[i].address;
+
+        for (int step = 0; step < OPT_MAX_THREAD; step++) {
+            int t = resolve(target);
+            if (t == -1 || t == i || !valid_registers(code[t])) break;
+
+            // The flags can't change on the way: nothing else runs in between
+            const CodeInstruction& to = code[t];
+            uint16_t next;
+            if (is_jump(to.opcode)) next = to.address;
+            else if (is_conditional_jump(opcode) && to.opcode == opcode) next = to.address;
+            else if (is_conditional_jump(opcode) && to.opcode == opposite(opcode) && following(t) != -1) next = code[following(t)].pc;
+            else break;
+
+            if (next == target) break;
+            target = next;
+        }
+        if (target != code[i].address) {
+            rewrite(i, opcode, target >> 8, target & 0xff);
+            stats.threaded++;
+            changed = true;
+        }
+
+        // A JMP to a RET or HALT might as well be it
+        int t = resolve(code[i].address);
+        if (is_jump(opcode) && t != -1 && (code[t].opcode == 0x52 || code[t].opcode >= 0xfd)) {
+            rewrite(i, code[t].opcode, code[t].operands[0]);
+            stats.jumps++;
+            changed = true;
+            continue;
+        }
+        if ((is_jump(opcode) || is_conditional_jump(opcode)) && t != -1 && t == following(i)) {
+            remove(i, stats.jumps);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Forwards through each basic block, with the values registers are known to have
+bool Optimizer::fold_constants()
+{
+    bool changed = false;
+    int known[OPT_REGISTERS];
+
+    for (int i = 0; i < (int)code.size(); i++) {
+        if (removed[i]) continue;
+        if (leader[i]) {
+            for (int r = 0; r < OPT_REGISTERS; r++) known[r] = -1;
+        }
+
+        CodeInstruction& in = code[i];
+        if (!valid_registers(in)) continue; // Faults, whatever comes next only runs from a jump
+
+        // The walk only saw fixed addresses, this is the same check for the ones worked out here
+        int pointer = pointed_at(in, known);
+        if (pointer != -1 && (flow.marks[pointer] & (CFG_INSTRUCTION | CFG_OPERAND))) {
+            problem = in.opcode == 0x04 ? "reads its own code" : "writes its own code";
+            problem_pc = in.pc;
+            return false;
+        }
+
+        const byte* o = in.operands;
+        int x = o[0] == 0xff || o[0] < REGISTERS ? known[reg(o[0])] : -1; // Only used when they're registers
+        int y = o[1] == 0xff || o[1] < REGISTERS ? known[reg(o[1])] : -1;
+        int result = -1; // What the written register ends with
+        CodeInstruction before = in;
+
+        switch (in.opcode) {
+            case 0x00: remove(i, stats.nops); break;
+            case 0x01: // MOV $x, $y
+                if (o[0] == o[1]) remove(i, stats.self_moves);
+                else if (y != -1) move_immediate(i, o[0], y, x);
+                result = y;
+                break;
+            case 0x02: // MOV $x, #0
+                if (x == o[1]) remove(i, stats.redundant);
+                result = o[1];
+                break;
+            case 0x04: // MOV $x, [$y, $z], $y is the low byte
+                if (y != -1 && known[reg(o[2])] != -1) {
+                    rewrite(i, 0x03, o[0], known[reg(o[2])], y);
+                    stats.immediates++;
+                }
+                break;
+            case 0x10: // NOT $x
+                if (x != -1) {
+                    result = (byte)~x;
+                    move_immediate(i, o[0], result, x);
+                }
+                break;
+            case 0x11: // AND $x, $y
+                if (o[0] == o[1]) {
+                    remove(i, stats.self_moves);
+                    result = x;
+                    break;
+                }
+                if (y == -1) break;
+                rewrite(i, 0x12, o[0], y);
+                stats.immediates++;
+                // fallthrough
+            case 0x12: // AND $x, #0
+                if (o[1] == 0xff) {
+                    remove(i, stats.redundant);
+                    result = x;
+                }
+                else if (x != -1 || o[1] == 0) {
+                    result = x & o[1];
+                    move_immediate(i, o[0], result, x);
+                }
+                break;
+            case 0x22: // CMP $x, #0
+                if (!flags_live[i]) remove(i, stats.dead);
+                break;
+            case 0x23: // CMP $x, $y
+                if (!flags_live[i]) remove(i, stats.dead);
+                else if (y != -1) {
+                    rewrite(i, 0x22, o[0], y);
+                    stats.immediates++;
+                }
+                break;
+            case 0x41: case 0x44: case 0x47: case 0x49: case 0x4b: case 0x4e: // Register forms
+                if (y == -1) break;
+                rewrite(i, in.opcode == 0x4e ? 0x4f : in.opcode - 1, o[0], y);
+                stats.immediates++;
+                // fallthrough
+            case 0x40: case 0x43: case 0x46: case 0x48: case 0x4a: case 0x4f: { // Immediate forms, CMP and SUB add
+                byte v = in.operands[1];
+                switch (in.opcode) {
+                    case 0x40: case 0x43: if (x != -1) result = (byte)(x + v); break;
+                    case 0x46: if (x != -1) result = (byte)(x * v); break;
+                    case 0x48: if (x != -1) result = div_table[x << 8 | v].value; break;
+                    case 0x4a: if (x > 0 && v != 0) result = pwr_table[x << 8 | v].value; break;
+                    case 0x4f: if (x != -1 && v != 0) result = x % v; break;
+                }
+                if (flags_live[i]) break;
+
+                bool identity = ((in.opcode == 0x40 || in.opcode == 0x43) && v == 0) || (in.opcode == 0x46 && v == 1);
+                if (result != -1) move_immediate(i, in.operands[0], result, x);
+                else if (identity) remove(i, stats.dead);
+                break;
+            }
+            case 0x42: case 0x45: { // INC/DEC only set the flags when they wrap
+                if (x == -1) break;
+                bool wraps = in.opcode == 0x42 ? x == 0xff : x == 0;
+                result = (byte)(in.opcode == 0x42 ? x + 1 : x - 1);
+                if (!wraps || !flags_live[i]) move_immediate(i, o[0], result, x);
+                break;
+            }
+            case 0x4c: case 0x4d: // SQRT, FSQRT
+                if (x == -1) break;
+                result = (in.opcode == 0x4c ? sqrt_table[x] : fsqrt_table[x]).value;
+                if (!flags_live[i]) move_immediate(i, o[0], result, x);
+                break;
+            case 0x30: // PUSH $x
+                if (x != -1) {
+                    rewrite(i, 0x31, x);
+                    stats.immediates++;
+                }
+                break;
+            case 0x60: case 0x62: { // STORE [$x, $y], $z|#0
+                int value = in.opcode == 0x60 ? known[reg(o[2])] : o[2];
+                if (x != -1 && y != -1) {
+                    if (value != -1) rewrite(i, 0x63, x, y, value);
+                    else rewrite(i, 0x61, x, y, o[2]);
+                    stats.immediates++;
+                }
+                else if (in.opcode == 0x60 && value != -1) {
+                    rewrite(i, 0x62, o[0], o[1], value);
+                    stats.immediates++;
+                }
+                break;
+            }
+            case 0x61: // STORE [#0], $x
+                if (known[reg(o[2])] != -1) {
+                    rewrite(i, 0x63, o[0], o[1], known[reg(o[2])]);
+                    stats.immediates++;
+                }
+                break;
+            case 0xfd: // HALT $x
+                if (x != -1) {
+                    rewrite(i, 0xfe, x);
+                    stats.immediates++;
+                }
+                break;
+        }
+
+        bool same = in.opcode == before.opcode && in.operands[0] == before.operands[0]
+            && in.operands[1] == before.operands[1] && in.operands[2] == before.operands[2];
+        if (removed[i] || !same) changed = true;
+
+        // Whatever it wrote is what it worked out, or not known
+        uint16_t written = effects(before).writes;
+        for (int r = 0; r < OPT_REGISTERS; r++) {
+            if (written & (1 << r)) known[r] = result;
+        }
+    }
+    return changed;
+}
+
+bool Optimizer::remove_dead()
+{
+    bool changed = false;
+
+    for (int i = 0; i < (int)code.size(); i++) {
+        if (removed[i] || !valid_registers(code[i])) continue;
+
+        Effects e = effects(code[i]);
+        if (!e.pure) continue;
+        if (code[i].opcode == 0x00) {
+            remove(i, stats.nops);
+            changed = true;
+            continue;
+        }
+        bool flags = e.sets_flags || e.may_set_flags;
+        if ((e.writes & live[i]) == 0 && (!flags || !flags_live[i])) {
+            remove(i, stats.dead);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool Optimizer::remove_unreachable()
+{
+    std::vector<bool> reached(code.size());
+    std::vector<int> pending;
+    int entry = resolve(0);
+    if (entry != -1) pending.push_back(entry);
+
+    while (!pending.empty()) {
+        int i = pending.back();
+        pending.pop_back();
+        if (i == -1 || reached[i]) continue;
+        reached[i] = true;
+
+        int next[2];
+        int count = successors(i, next);
+        for (int s = 0; s < count; s++) pending.push_back(next[s]);
+        if (code[i].opcode == 0x50) pending.push_back(following(i)); // The RET comes back
+    }
+
+    bool changed = false;
+    for (size_t i = 0; i < code.size(); i++) {
+        if (!removed[i] && !reached[i]) {
+            remove(i, stats.unreachable);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+void Optimizer::run()
+{
+    for (int round = 0; round < OPT_MAX_ROUNDS; round++) {
+        bool changed = thread_jumps();
+        changed = remove_unreachable() || changed;
+
+        find_leaders();
+        find_liveness();
+        changed = fold_constants() || changed;
+
+        find_liveness();
+        changed = remove_dead() || changed;
+        if (!changed || problem != nullptr) break;
+    }
+}
+
+int Optimizer::instructions() const
+{
+    int count = 0;
+    for (size_t i = 0; i < code.size(); i++) count += !removed[i];
+    return count;
+}
+
+std::vector<byte> Optimizer::output() const
+{
+    std::vector<uint16_t> placed(code.size());
+    std::vector<byte> out;
+
+    if (compact) {
+        // One run of code from 0, the rest of the image was never reached
+        for (size_t i = 0; i < code.size(); i++) {
+            if (removed[i]) continue;
+            placed[i] = out.size();
+            out.resize(out.size() + code[i].length);
+        }
+    }
+    else {
+        // Each run of code is packed where it was, the data around it doesn't move
+        out = flow.image;
+        size_t end = 0;
+        for (size_t address = 0; address < out.size(); address++) {
+            if (!(flow.marks[address] & (CFG_INSTRUCTION | CFG_OPERAND))) end = address + 1;
+        }
+
+        uint32_t cursor = 0;
+        for (size_t i = 0; i < code.size(); i++) {
+            const CodeInstruction& original = flow.instructions[i];
+            if (i == 0 || region[i] != region[i - 1]) cursor = original.pc;
+            for (int b = 0; b < original.length; b++) out[original.pc + b] = 0;
+
+            if (removed[i]) continue;
+            placed[i] = cursor;
+            cursor += code[i].length;
+            if (cursor > end) end = cursor;
+        }
+        out.resize(end);
+    }
+
+    for (size_t i = 0; i < code.size(); i++) {
+        if (removed[i]) continue;
+        CodeInstruction in = code[i];
+
+        if (leaves_to(in.opcode)) {
+            uint16_t target = placed[resolve(in.address)];
+            in.operands[0] = target >> 8;
+            in.operands[1] = target & 0xff;
+        }
+        out[placed[i]] = in.opcode;
+        for (int b = 1; b < in.length; b++) out[placed[i] + b] = in.operands[b - 1];
+    }
+    return out;
+}
+
+void Optimizer::report(FILE* out) const
+{
+    fprintf(out, "Instructions: %zu -> %d\n", code.size(), instructions());
+    fprintf(out, "  NOPs             %6d\n", stats.nops);
+    fprintf(out, "  Moves to self    %6d\n", stats.self_moves);
+    fprintf(out, "  Jumps threaded   %6d\n", stats.threaded);
+    fprintf(out, "  Jumps dropped    %6d\n", stats.jumps);
+    fprintf(out, "  Constants folded %6d\n", stats.folded);
+    fprintf(out, "  Immediates       %6d\n", stats.immediates);
+    fprintf(out, "  Redundant loads  %6d\n", stats.redundant);
+    fprintf(out, "  Dead writes      %6d\n", stats.dead);
+    fprintf(out, "  Unreachable      %6d\n", stats.unreachable);
+    fprintf(out, "Layout: %s\n", compact ? "compacted, nothing reads the image" : "code packed in place, data kept where it was");
+}
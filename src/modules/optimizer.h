@@ -0,0 +1,70 @@
+#pragma once
+#include "def.h"
+#include "cfg.h"
+#include <cstdio>
+#include <vector>
+
+#define OPT_MAX_ROUNDS  64  // Times the passes run over the program, they stop earlier once nothing changes
+#define OPT_MAX_THREAD  64  // Jumps followed from one jump, so a loop of them ends
+
+// What the passes did, in instructions
+struct OptimizerStats {
+    int nops;           // NOPs dropped
+    int self_moves;     // MOV $x, $x and AND $x, $x
+    int threaded;       // Jumps sent straight to where the jumps they landed on go
+    int jumps;          // Jumps to the next instruction dropped, JMPs to a RET/HALT replaced by it
+    int folded;         // Math on known values turned into a MOV $x, #0
+    int immediates;     // Register operands with a known value turned into immediates
+    int redundant;      // Loads of the value the register already had
+    int dead;           // Writes to registers nothing reads, flags nothing reads
+    int unreachable;    // Instructions nothing can get to anymore
+};
+
+// Rewrites a program into a smaller one that does the same, without running it. Works on the
+// instructions ControlFlow found, then lays them out again and moves every jump target.
+//
+// What has to stay the same is what a program can be seen doing: memory, the stack, the HALT code
+// and faults. Registers only matter while something can read them, flags while a Jcc can. The
+// image is taken not to be read or written as data through an address held in registers, a
+// program doing that to its own code can't be rewritten. It's checked for fixed addresses and for
+// register pairs whose values are worked out, anything else touching the image keeps its layout.
+struct Optimizer {
+    private:
+    const ControlFlow& flow;
+    std::vector<CodeInstruction> code;  // flow.instructions, rewritten
+    std::vector<bool> removed;
+    std::vector<bool> leader;
+    std::vector<int> region;            // Run of code each instruction is in, they can't move out of it
+    std::vector<uint16_t> live;         // Registers something reads after each instruction
+    std::vector<bool> flags_live;       // Flags something reads after each instruction
+    bool compact;                       // Nothing reads the image as data: drop everything but the code
+    OptimizerStats stats;
+
+    int resolve(uint16_t address) const;    // First instruction still there at or after address, -1 if none
+    int following(int i) const;             // The one control falls into after i, -1 if none
+    int successors(int i, int out[2]) const;// Where control can go after i, -1 for a RET (anywhere)
+    void remove(int i, int& counter);
+    void rewrite(int i, byte opcode, byte a, byte b = 0, byte c = 0);
+    void move_immediate(int i, byte reg, byte value, int known); // MOV $reg, #value, or nothing if known
+    bool fits(int i, int length) const; // Instruction i can become this long
+
+    void find_leaders();
+    void find_liveness();
+    bool thread_jumps();
+    bool fold_constants();
+    bool remove_dead();
+    bool remove_unreachable();
+
+    public:
+    // Like ControlFlow::problem, found while running the passes: then output() can't be used
+    const char* problem;
+    uint16_t problem_pc;
+
+    Optimizer(const ControlFlow& flow);
+
+    void run(); // Every pass until nothing changes, or a problem
+    std::vector<byte> output() const;
+    int instructions() const; // Still there
+    const OptimizerStats& statistics() const { return stats; }
+    void report(FILE* out) const;
+};
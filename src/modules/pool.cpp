@@ -0,0 +1,79 @@
+#include "pool.h"
+
+ThreadPool::ThreadPool(unsigned threads)
+: queues(threads == 0 ? 1 : threads), queued(0), pending(0), next(0), stopping(false)
+{
+    for (size_t i = 0; i < queues.size(); i++) {
+        workers.emplace_back([this, i]() { work_loop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work.notify_all();
+    for (std::thread& worker : workers) worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    Queue& queue = queues[next++ % queues.size()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued++;
+        pending++;
+    }
+    work.notify_one();
+}
+
+bool ThreadPool::take(size_t worker, std::function<void()>& task)
+{
+    for (size_t i = 0; i < queues.size(); i++) {
+        Queue& queue = queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+
+        if (i == 0) { // Ours, newest first
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else { // Someone else's, oldest first
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::work_loop(size_t worker)
+{
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work.wait(lock, [this]() { return queued > 0 || stopping; });
+            if (queued == 0 && stopping) return;
+            queued--; // There's one for us somewhere, claim it before looking
+        }
+
+        std::function<void()> task;
+        while (!take(worker, task)) std::this_thread::yield(); // Its submitter is still pushing it
+        task();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) idle.notify_all();
+    }
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return pending == 0; });
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool: every worker has its own deque and takes from its back,
+// when it runs dry it steals from the front of the others.
+struct ThreadPool {
+    private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;               // Guards sleeping and finishing
+    std::condition_variable work;   // Tasks were queued, or we're stopping
+    std::condition_variable idle;   // Everything submitted is done
+    size_t queued;                  // Waiting in the deques
+    size_t pending;                 // Submitted and not finished
+    size_t next;
+    bool stopping;
+
+    bool take(size_t worker, std::function<void()>& task);
+    void work_loop(size_t worker);
+
+    public:
+    ThreadPool(unsigned threads);
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+    void wait(); // Until every submitted task has finished
+};
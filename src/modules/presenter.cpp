@@ -0,0 +1,30 @@
+#include "presenter.h"
+
+Presenter::Presenter()
+: next_frame(std::chrono::steady_clock::now()), mode(PresentMode::FIXED_RATE)
+{
+    set_fps(DEFAULT_FPS);
+}
+
+void Presenter::set_fps(uint32_t fps)
+{
+    if (fps == 0) fps = DEFAULT_FPS;
+    frame_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::nanoseconds(1000000000 / fps)
+    );
+}
+
+bool Presenter::frame_due()
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now < next_frame) return false;
+
+    next_frame += frame_time;
+    if (next_frame < now) next_frame = now + frame_time; // We fell behind, don't try to catch up with a burst of frames
+    return true;
+}
+
+double Presenter::until_frame() const
+{
+    return std::chrono::duration<double>(next_frame - std::chrono::steady_clock::now()).count();
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "def.h"
+#include <chrono>
+
+// Instructions executed between two checks of the frame clock
+#define PRESENT_BATCH   4096
+#define DEFAULT_FPS     60
+
+enum struct PresentMode : byte {
+    FIXED_RATE, // Refreshes the window every frame, whatever happened
+    ON_WRITE,   // Refreshes only if the framebuffer was written since the last frame
+};
+
+struct Presenter {
+    private:
+    std::chrono::steady_clock::duration frame_time;
+    std::chrono::steady_clock::time_point next_frame;
+
+    public:
+    PresentMode mode;
+
+    Presenter();
+    void set_fps(uint32_t fps);
+    bool frame_due(); // True once per frame interval, schedules the next one
+    double until_frame() const; // Seconds, 0 or less once it's due
+};
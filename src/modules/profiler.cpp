@@ -0,0 +1,167 @@
+#include "profiler.h"
+#include "cpu.h"
+#include "opcodes.h"
+#include <algorithm>
+#include <vector>
+
+#define PROFILE_TOP 20 // Rows in each table of the report
+
+Profiler::Profiler(CPU* cpu)
+: cpu(cpu), opcodes(), root{0, nullptr, {}, 0, 0}, frame(&root), overflowed(0)
+{
+    counts = new uint64_t[RAM_SIZE]();
+    taken = new uint64_t[RAM_SIZE]();
+    not_taken = new uint64_t[RAM_SIZE]();
+    root.function = cpu->ram.pc;
+}
+
+Profiler::~Profiler()
+{
+    for (auto& callee : root.callees) free_frames(callee.second);
+    delete[] counts;
+    delete[] taken;
+    delete[] not_taken;
+}
+
+void Profiler::free_frames(ProfileFrame* frame)
+{
+    for (auto& callee : frame->callees) free_frames(callee.second);
+    delete frame;
+}
+
+void Profiler::call(uint16_t function)
+{
+    // Deeper than the stack can really hold means CALL is used as a jump, don't grow forever
+    if (frame->depth >= PROFILE_MAX_DEPTH) {
+        overflowed++;
+        return;
+    }
+
+    ProfileFrame*& callee = frame->callees[function];
+    if (callee == nullptr) callee = new ProfileFrame{function, frame, {}, 0, frame->depth + 1};
+    frame = callee;
+}
+
+void Profiler::ret()
+{
+    if (overflowed > 0) overflowed--;
+    else if (frame->parent != nullptr) frame = frame->parent; // A RET with no CALL stays at the start
+}
+
+int Profiler::execute(uint64_t budget)
+{
+    CPU& c = *cpu;
+    RAM& ram = c.ram;
+
+    for (uint64_t i = 0; i < budget; i++) {
+        uint16_t pc = ram.pc;
+        byte opcode = ram.memory[pc];
+        bool branch = opcode >= 0x24 && opcode <= 0x2f;
+
+        // Whether a Jcc jumps has to be worked out before it runs, it may jump to the next instruction
+        bool jumps = false;
+        if (branch) {
+            int flag = (opcode - 0x24) / 4;
+            c.sync_flags();
+            bool set = flag == 0 ? c.zero : flag == 1 ? c.underflow : c.overflow;
+            jumps = ((opcode - 0x24) / 2) % 2 ? !set : set;
+        }
+
+        int res = c.tick();
+        c.retired++;
+        counts[pc]++;
+        opcodes[opcode]++;
+        frame->self++;
+
+        if (branch) (jumps ? taken : not_taken)[pc]++;
+        else if (opcode == 0x50 || opcode == 0x51) call(ram.pc);
+        else if (opcode == 0x52) ret();
+
+        if (res != -1) return res == TICK_YIELD ? -1 : res;
+    }
+    return -1;
+}
+
+void Profiler::report(FILE* out)
+{
+    const byte* memory = cpu->ram.memory;
+    uint64_t total = 0;
+    for (uint64_t count : opcodes) total += count;
+    double percent = total > 0 ? 100.0 / total : 0;
+
+    fprintf(out, "Profile: %llu instructions\n", (unsigned long long)total);
+
+    std::vector<uint16_t> addresses;
+    for (uint32_t a = 0; a < RAM_SIZE; a++) {
+        if (counts[a] > 0) addresses.push_back(a);
+    }
+    std::stable_sort(addresses.begin(), addresses.end(), [&](uint16_t a, uint16_t b) { return counts[a] > counts[b]; });
+
+    fprintf(out, "\nHottest addresses\n");
+    for (size_t i = 0; i < addresses.size() && i < PROFILE_TOP; i++) {
+        uint16_t a = addresses[i];
+        fprintf(out, "  0x%04x %14llu %6.2f%%  %s\n", a, (unsigned long long)counts[a], counts[a] * percent, opcode_name(memory[a]));
+    }
+
+    std::vector<int> used;
+    for (int op = 0; op < 256; op++) {
+        if (opcodes[op] > 0) used.push_back(op);
+    }
+    std::stable_sort(used.begin(), used.end(), [&](int a, int b) { return opcodes[a] > opcodes[b]; });
+
+    fprintf(out, "\nOpcodes\n");
+    for (int op : used) {
+        fprintf(out, "  0x%02x %14llu %6.2f%%  %s\n", op, (unsigned long long)opcodes[op], opcodes[op] * percent, opcode_name(op));
+    }
+
+    fprintf(out, "\nBranches                  taken      not taken\n");
+    int shown = 0;
+    for (uint16_t a : addresses) {
+        if (taken[a] + not_taken[a] == 0) continue;
+        if (shown++ == PROFILE_TOP) break;
+        fprintf(out, "  0x%04x %14llu %14llu %6.2f%% taken  %s\n", a, (unsigned long long)taken[a], (unsigned long long)not_taken[a],
+            100.0 * taken[a] / (taken[a] + not_taken[a]), opcode_name(memory[a]));
+    }
+
+    // Self instructions of each function, wherever it was called from
+    std::map<uint16_t, uint64_t> functions;
+    std::vector<const ProfileFrame*> pending = {&root};
+    while (!pending.empty()) {
+        const ProfileFrame* f = pending.back();
+        pending.pop_back();
+        if (f != &root) functions[f->function] += f->self;
+        for (auto& callee : f->callees) pending.push_back(callee.second);
+    }
+    std::vector<std::pair<uint16_t, uint64_t>> by_self(functions.begin(), functions.end());
+    std::stable_sort(by_self.begin(), by_self.end(), [](const std::pair<uint16_t, uint64_t>& a, const std::pair<uint16_t, uint64_t>& b) {
+        return a.second > b.second;
+    });
+
+    fprintf(out, "\nFunctions (self)\n");
+    fprintf(out, "  start  %14llu %6.2f%%\n", (unsigned long long)root.self, root.self * percent);
+    for (size_t i = 0; i < by_self.size() && i < PROFILE_TOP; i++) {
+        fprintf(out, "  0x%04x %14llu %6.2f%%\n", by_self[i].first, (unsigned long long)by_self[i].second, by_self[i].second * percent);
+    }
+}
+
+void Profiler::collapse(FILE* out, const ProfileFrame* frame, std::string& stack)
+{
+    size_t length = stack.size();
+    if (frame->parent == nullptr) stack = "start";
+    else {
+        char name[8];
+        snprintf(name, sizeof(name), "0x%04x", frame->function);
+        stack += ";";
+        stack += name;
+    }
+
+    if (frame->self > 0) fprintf(out, "%s %llu\n", stack.c_str(), (unsigned long long)frame->self);
+    for (auto& callee : frame->callees) collapse(out, callee.second, stack);
+    stack.resize(length);
+}
+
+void Profiler::write_collapsed(FILE* out)
+{
+    std::string stack;
+    collapse(out, &root, stack);
+}
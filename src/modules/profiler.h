@@ -0,0 +1,46 @@
+#pragma once
+#include "def.h"
+#include "ram.h"
+#include <cstdio>
+#include <map>
+#include <string>
+
+#define PROFILE_MAX_DEPTH 128 // Frames, CALL pushes 2 bytes so a 256 byte stack can't hold more
+
+struct CPU;
+
+// A function in the call tree: one node per distinct path of CALLs from the start
+struct ProfileFrame {
+    uint16_t function;  // Address it was called at
+    ProfileFrame* parent;
+    std::map<uint16_t, ProfileFrame*> callees;
+    uint64_t self;      // Instructions run in this frame itself
+    int depth;
+};
+
+// Engine::PROFILE, CPU::tick() with everything it runs counted. It's its own engine so
+// none of this costs anything when profiling is off.
+struct Profiler {
+    private:
+    CPU* cpu;
+    uint64_t* counts;       // Executions per address
+    uint64_t* taken;        // Jcc at this address jumped
+    uint64_t* not_taken;
+    uint64_t opcodes[256];
+    ProfileFrame root;      // Whatever runs before the first CALL
+    ProfileFrame* frame;
+    int overflowed;         // CALLs past PROFILE_MAX_DEPTH, their RETs don't pop a frame
+
+    void call(uint16_t function);
+    void ret();
+    static void free_frames(ProfileFrame* frame);
+    static void collapse(FILE* out, const ProfileFrame* frame, std::string& stack);
+
+    public:
+    Profiler(CPU* cpu);
+    ~Profiler();
+
+    int execute(uint64_t budget); // Same contract as CPU::execute
+    void report(FILE* out);
+    void write_collapsed(FILE* out); // One "start;0x0040;0x0100 count" line per stack, for flamegraph.pl and the like
+};
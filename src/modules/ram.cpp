@@ -1,16 +1,26 @@
 #include "ram.h"
 #include "casts.h"
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
 
+// Mapped instead of allocated, so files can be mapped over it (see loader.h). Comes zeroed.
+static byte* map_memory()
+{
+    void* memory = mmap(nullptr, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) throw std::bad_alloc();
+    return (byte*)memory;
+}
 
-RAM::RAM () 
-    : pc(0) 
+RAM::RAM (RAM* owner) 
+    : pc(0), page_flags(), devices(), device_pages(0), watch_start(0), watch_end(0), watch_written(false), owner(owner != nullptr ? owner : this), shared(owner != nullptr), backed(false), code_written(nullptr), code_context(nullptr), tracker(0), dirty(), dirty_count(0)
 {
-    memory = new byte[0x10000](); // 0x0000 - 0xffff
+    memory = owner != nullptr ? owner->memory : map_memory(); // 0x0000 - 0xffff
 };
 
 RAM::~RAM () 
 {
-    delete[] memory;
+    if (owner == this) munmap(memory, RAM_SIZE);
 };
 
 byte RAM::current() 
@@ -25,20 +35,170 @@ byte RAM::next()
     return result;
 }
 
-byte RAM::get_from_address(uint16_t addr) 
+uint16_t RAM::next_16bit_immediate() 
 {
-    return memory[addr];
+    // The first byte is the high one. Kept in two statements, the order of function arguments isn't specified
+    byte high = next();
+    byte low = next();
+    return bytes_to_uint16(low, high);
 }
 
-uint16_t RAM::next_16bit_immediate() 
+int RAM::write(uint16_t address, byte data) 
 {
-    uint16_t result = bytes_to_uint16(next(), next());
-    return result;
+    if (page_flags[address / PAGE_SIZE]) return flagged_write(address, data);
+    memory[address] = data;
+    return WRITE_DONE;
+};
+
+void RAM::watch(uint16_t start, uint32_t size)
+{
+    watch_start = start;
+    watch_end = start + size;
+    watch_written = true; // So the first frame is always drawn
+
+    for (uint32_t page = start / PAGE_SIZE; page * PAGE_SIZE < watch_end; page++) {
+        page_flags[page] |= PAGE_WATCHED;
+    }
 }
 
-int RAM::write(uint16_t address, byte data) 
+void RAM::map(uint16_t start, uint32_t size, Device* device)
+{
+    for (uint32_t page = start / PAGE_SIZE; page * PAGE_SIZE < start + size && page < PAGES; page++) {
+        if (page_flags[page] & PAGE_DEVICE) device_pages--;
+        devices[page] = device;
+        if (device == nullptr) {
+            page_flags[page] &= ~PAGE_DEVICE;
+            continue;
+        }
+        page_flags[page] |= PAGE_DEVICE;
+        device_pages++;
+    }
+}
+
+void RAM::protect(uint16_t start, uint32_t size)
+{
+    for (uint32_t page = start / PAGE_SIZE; page * PAGE_SIZE < start + size && page < PAGES; page++) {
+        page_flags[page] |= PAGE_READONLY;
+    }
+}
+
+void RAM::track_writes(uint64_t tracker)
+{
+    this->tracker = tracker;
+    dirty_count = 0;
+    for (int page = 0; page < PAGES; page++) page_flags[page] |= PAGE_TRACKED;
+}
+
+void RAM::reset_dirty()
+{
+    for (int i = 0; i < dirty_count; i++) page_flags[dirty[i]] |= PAGE_TRACKED;
+    dirty_count = 0;
+}
+
+void RAM::fill(uint16_t address, byte value, uint32_t size)
+{
+    if (!plain(address, size)) {
+        for (uint32_t i = 0; i < size; i++) write(address + i, value);
+        return;
+    }
+    memset(memory + address, value, size);
+    written(address, size);
+}
+
+void RAM::copy(uint16_t to, uint16_t from, uint32_t size)
 {
+    if (!plain(to, size) || !plain(from, size)) {
+        for (uint32_t i = 0; i < size; i++) write(to + i, get_from_address(from + i));
+        return;
+    }
+
+    // Copying forward over its own source repeats the start, memmove would keep it
+    if (from < to && from + size > to) {
+        for (uint32_t i = 0; i < size; i++) memory[to + i] = memory[from + i];
+    }
+    else memmove(memory + to, memory + from, size);
+    written(to, size);
+}
+
+// The hooks for a range that was written straight into memory
+void RAM::written(uint16_t address, uint32_t size)
+{
+    uint32_t end = address + size;
+    for (uint32_t page = address / PAGE_SIZE; page * PAGE_SIZE < end; page++) {
+        byte flags = page_flags[page];
+        if (!flags) continue;
+
+        uint32_t start = page * PAGE_SIZE > address ? page * PAGE_SIZE : address;
+        uint32_t stop = (page + 1) * PAGE_SIZE < end ? (page + 1) * PAGE_SIZE : end;
+
+        // Cached code needs every byte, everything else only cares that the page was written
+        if (flags & PAGE_CODE) {
+            for (uint32_t at = start; at < stop; at++) notify(at);
+            continue;
+        }
+        notify(start);
+        if ((flags & PAGE_WATCHED) && start < watch_end && stop > watch_start) __atomic_store_n(&owner->watch_written, true, __ATOMIC_RELEASE);
+    }
+}
+
+bool RAM::plain(uint16_t address, uint32_t size)
+{
+    for (uint32_t page = address / PAGE_SIZE; page * PAGE_SIZE < address + size; page++) {
+        if (page_flags[page] & (PAGE_DEVICE | PAGE_READONLY)) return false;
+    }
+    return true;
+}
+
+int RAM::flagged_write(uint16_t address, byte data)
+{
+    byte flags = page_flags[address / PAGE_SIZE];
+    if (flags & PAGE_DEVICE) return devices[address / PAGE_SIZE]->write(address, data) ? WRITE_YIELD : WRITE_DONE;
+    if (flags & PAGE_READONLY) return WRITE_DROPPED;
+
     memory[address] = data;
-    if (memory[address] != data) return 1; // means error, but it's almost impossible this occurrs, i may deprecate this line
-    return 0;
-};
\ No newline at end of file
+    notify(address);
+    return WRITE_DONE;
+}
+
+int RAM::compare_exchange(uint16_t address, byte& expected, byte desired)
+{
+    byte flags = page_flags[address / PAGE_SIZE];
+    if (flags & (PAGE_DEVICE | PAGE_READONLY)) {
+        byte held = get_from_address(address);
+        int written = held == expected ? flagged_write(address, desired) : WRITE_DONE;
+        expected = held;
+        return written;
+    }
+
+    bool swapped = __atomic_compare_exchange_n(&memory[address], &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (swapped && flags) notify(address);
+    return WRITE_DONE;
+}
+
+int RAM::fetch_add(uint16_t address, byte& value)
+{
+    byte flags = page_flags[address / PAGE_SIZE];
+    if (flags & (PAGE_DEVICE | PAGE_READONLY)) {
+        byte held = get_from_address(address);
+        int written = flagged_write(address, held + value);
+        value = held;
+        return written;
+    }
+
+    value = __atomic_fetch_add(&memory[address], value, __ATOMIC_SEQ_CST);
+    if (flags) notify(address);
+    return WRITE_DONE;
+}
+
+void RAM::notify(uint16_t address)
+{
+    byte flags = page_flags[address / PAGE_SIZE];
+
+    if (flags & PAGE_TRACKED) {
+        page_flags[address / PAGE_SIZE] &= ~PAGE_TRACKED;
+        dirty[dirty_count++] = address / PAGE_SIZE;
+    }
+
+    if ((flags & PAGE_WATCHED) && address >= watch_start && address < watch_end) __atomic_store_n(&owner->watch_written, true, __ATOMIC_RELEASE);
+    if ((flags & PAGE_CODE) && code_written != nullptr) code_written(code_context, address);
+}
@@ -1,15 +1,87 @@
 #pragma once
 #include "def.h"
+#include "device.h"
 
+#define RAM_SIZE    0x10000
+#define PAGE_SIZE   0x100
+#define PAGES       (RAM_SIZE / PAGE_SIZE)
+
+// Per-page flags, write() only leaves its fast path on pages with any of these set
+#define PAGE_WATCHED    0x01 // Part of the watched range
+#define PAGE_CODE       0x02 // Some engine cached code decoded from this page
+#define PAGE_TRACKED    0x04 // Not written since track_writes(), the first write adds it to dirty
+#define PAGE_DEVICE     0x08 // Reads and writes go to devices[page] instead of memory
+#define PAGE_READONLY   0x10 // ROM, writes are dropped
+
+// What write() returns
+#define WRITE_DONE      0
+#define WRITE_DROPPED   1 // ROM
+#define WRITE_YIELD     2 // A device wants the engine to stop after this instruction, see Device::write()
+
+// The guest's address space, one page table entry (page_flags, devices) per 256 bytes. Plain pages
+// are read and written straight in memory, the rest go through flagged_write() or their device.
+// Code is always fetched from memory, even on device pages.
 struct RAM {
     bytes memory;
     uint16_t pc;
+    byte page_flags[PAGES];
+    Device* devices[PAGES]; // Handler of each PAGE_DEVICE page, not owned
+    int device_pages;       // Pages mapped to a device, the JIT only checks loads for them when there are any
+
+    // Watched range (used for the framebuffer), watch_written is set by write() and cleared by the reader.
+    // Cores sharing memory set their owner's, with atomic stores: the first core reads it while they run.
+    uint32_t watch_start;
+    uint32_t watch_end;
+    bool watch_written;
+
+    // Cores (see cores.h): owner is the RAM memory belongs to, this one unless it was made from
+    // another. shared is set on all of them, other threads can store to memory any time then.
+    RAM* owner;
+    bool shared;
+    bool backed; // memory is a file, every store goes to it (see load_ram_file())
+
+    // Called on writes to PAGE_CODE pages, so cached code can be dropped
+    void (*code_written)(void* context, uint16_t address);
+    void* code_context;
+
+    // Pages written since track_writes(tracker), for snapshots. Only the first write to a page
+    // leaves the fast path, then the page is untracked until reset_dirty().
+    uint64_t tracker; // Who armed it (Snapshot::id), 0 for nobody
+    byte dirty[PAGES];
+    int dirty_count;
     
-    RAM();
+    RAM(RAM* owner = nullptr); // Sharing owner's memory, or with its own
     ~RAM();
     byte current();
     byte next();
     byte get_from_address(uint16_t addr);
     uint16_t next_16bit_immediate();
-    int write(uint16_t address, byte data);
-};
\ No newline at end of file
+    int write(uint16_t address, byte data); // WRITE_*
+    // Atomic with every other core, WRITE_*. Devices and ROM aren't shared, they're a read and a write there.
+    int compare_exchange(uint16_t address, byte& expected, byte desired); // Stores desired if it held expected, which gets what it held
+    int fetch_add(uint16_t address, byte& value); // Adds value, which gets what it held
+    void watch(uint16_t start, uint32_t size);
+
+    // Both work on whole pages, every page the range touches. Map before running code there, the JIT
+    // compiles fixed address loads (and the stack) on what the pages were at the time.
+    void map(uint16_t start, uint32_t size, Device* device); // nullptr makes them plain memory again
+    void protect(uint16_t start, uint32_t size);              // Read-only from now on, for the guest
+    bool plain(uint16_t address, uint32_t size);              // No device or ROM page in the range
+    void track_writes(uint64_t tracker); // Every page clean from now on
+    void reset_dirty(); // Tracks the dirty pages again, as clean
+
+    // Bulk writes, as seen by the hooks the same as write() on every byte. The range can't wrap past 0xffff.
+    void fill(uint16_t address, byte value, uint32_t size);
+    void copy(uint16_t to, uint16_t from, uint32_t size); // Forward, a byte at a time as far as the result goes
+
+    private:
+    int flagged_write(uint16_t address, byte data);
+    void notify(uint16_t address); // The hooks of a byte that was stored
+    void written(uint16_t address, uint32_t size);
+};
+
+inline byte RAM::get_from_address(uint16_t addr)
+{
+    if (page_flags[addr / PAGE_SIZE] & PAGE_DEVICE) return devices[addr / PAGE_SIZE]->read(addr);
+    return memory[addr];
+}
@@ -0,0 +1,295 @@
+#include "recompiler.h"
+#include "native.h"
+#include "cpu.h"
+#include "opcodes.h"
+#include <cstdarg>
+
+// Condition of each direct Jcc (its indirect twin is one more), on the synced flags
+static const char* condition(byte opcode)
+{
+    switch (opcode & ~1) {
+        case 0x24: return "zf";
+        case 0x26: return "!zf";
+        case 0x28: return "uf";
+        case 0x2a: return "!uf";
+        case 0x2c: return "of";
+        case 0x2e: return "!of";
+    }
+    return "false";
+}
+
+// Runs the whole block: nothing but these leave it in the middle
+static bool ends_block(byte opcode)
+{
+    return is_terminator(opcode) || is_conditional_jump(opcode) || is_indirect_jump(opcode) || opcode == 0x50;
+}
+
+Recompiler::Recompiler(const ControlFlow& flow)
+: flow(flow), entry(RAM_SIZE), blocks(0), instructions(0)
+{
+    for (const CodeInstruction& in : flow.instructions) {
+        if (in.pc == 0 || (flow.marks[in.pc] & CFG_LEADER)) entry[in.pc] = true;
+    }
+}
+
+void Recompiler::emit(const char* format, ...)
+{
+    va_list args, again;
+    va_start(args, format);
+    va_copy(again, args);
+    int length = vsnprintf(nullptr, 0, format, args);
+    size_t at = out.size();
+    out.resize(at + length + 1);
+    vsnprintf(&out[at], length + 1, format, again);
+    out.resize(at + length);
+    va_end(again);
+    va_end(args);
+}
+
+const char* Recompiler::reg(byte operand) const
+{
+    static const char* const names[REGISTERS] = {"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7"};
+    return operand == 0xff ? "rz" : names[operand];
+}
+
+void Recompiler::leave(const char* kind, const char* value, int unused)
+{
+    if (unused > 0) emit("    { budget += %d; LEAVE(%s, %s); }\n", unused, kind, value);
+    else emit("    LEAVE(%s, %s);\n", kind, value);
+}
+
+void Recompiler::leave(int kind, uint16_t pc, int unused)
+{
+    char value[8];
+    snprintf(value, sizeof(value), "0x%04x", pc);
+    leave(std::to_string(kind).c_str(), value, unused);
+}
+
+void Recompiler::jump(uint16_t target, int unused)
+{
+    if (entry[target]) emit("    goto b_%04x;\n", target);
+    else leave(NATIVE_EXIT_JUMP, target, unused);
+}
+
+void Recompiler::instruction(const CodeInstruction& in, int at, int length)
+{
+    const byte* o = in.operands;
+    uint16_t next = in.pc + in.length;
+    int after = length - at - 1; // Instructions of the block after this one
+    char next_pc[8];
+    snprintf(next_pc, sizeof(next_pc), "0x%04x", next);
+
+    emit("    // %04x %s\n", in.pc, opcode_name(in.opcode));
+    if (!valid_registers(in)) {
+        leave(NATIVE_EXIT_INTERPRET, in.pc, after + 1);
+        return;
+    }
+
+    switch (in.opcode) {
+        case 0x00: break;
+        case 0x01: emit("    %s = %s;\n", reg(o[0]), reg(o[1])); break;
+        case 0x02: emit("    %s = %u;\n", reg(o[0]), o[1]); break;
+        case 0x03: emit("    %s = LOAD(0x%04x);\n", reg(o[0]), in.address); break;
+        case 0x04: emit("    %s = LOAD(%s | %s << 8);\n", reg(o[0]), reg(o[1]), reg(o[2])); break;
+        case 0x10: emit("    %s = ~%s;\n", reg(o[0]), reg(o[0])); break;
+        case 0x11: emit("    %s &= %s;\n", reg(o[0]), reg(o[1])); break;
+        case 0x12: emit("    %s &= %u;\n", reg(o[0]), o[1]); break;
+        case 0x20: jump(in.address, 0); break;
+        case 0x21: emit("    pc = %s | %s << 8;\n    goto dispatch;\n", reg(o[1]), reg(o[0])); break;
+        case 0x22: emit("    FLAGS((int64_t)%s + %u);\n", reg(o[0]), o[1]); break;
+        case 0x23: emit("    FLAGS((int64_t)%s + %s);\n", reg(o[0]), reg(o[1])); break;
+        case 0x24: case 0x26: case 0x28: case 0x2a: case 0x2c: case 0x2e:
+            emit("    SYNC();\n    if (%s)\n", condition(in.opcode));
+            jump(in.address, 0);
+            break;
+        case 0x25: case 0x27: case 0x29: case 0x2b: case 0x2d: case 0x2f:
+            emit("    SYNC();\n    if (%s) { pc = %s | %s << 8; goto dispatch; }\n", condition(in.opcode), reg(o[1]), reg(o[0]));
+            break;
+
+        // The stack ignores what devices want, like Stack::push()
+        case 0x30: case 0x31:
+            emit("    e = STORE(STACK + 255 - sp, %s);\n    sp++;\n", in.opcode == 0x30 ? reg(o[0]) : std::to_string(o[0]).c_str());
+            emit("    if (e == %d)\n", NATIVE_EXIT_STALE);
+            leave(NATIVE_EXIT_STALE, next, after);
+            break;
+        case 0x32: emit("    sp--;\n    %s = LOAD(STACK + 255 - sp);\n", reg(o[0])); break;
+
+        case 0x40: case 0x43: emit("    n = (int64_t)%s + %u;\n    FLAGS(n);\n    %s = n;\n", reg(o[0]), o[1], reg(o[0])); break;
+        case 0x41: case 0x44: emit("    n = (int64_t)%s + %s;\n    FLAGS(n);\n    %s = n;\n", reg(o[0]), reg(o[1]), reg(o[0])); break;
+        case 0x42: emit("    %s++;\n    if (%s == 0) FLAGS(256);\n", reg(o[0]), reg(o[0])); break;
+        case 0x45: emit("    %s--;\n    if (%s == 255) FLAGS(-1);\n", reg(o[0]), reg(o[0])); break;
+        case 0x46: emit("    n = (int64_t)%s * %u;\n    FLAGS(n);\n    %s = n;\n", reg(o[0]), o[1], reg(o[0])); break;
+        case 0x47: emit("    n = (int64_t)%s * %s;\n    FLAGS(n);\n    %s = n;\n", reg(o[0]), reg(o[1]), reg(o[0])); break;
+        case 0x48: emit("    %s = ALU(div_table, %s << 8 | %u);\n", reg(o[0]), reg(o[0]), o[1]); break;
+        case 0x49: emit("    %s = ALU(div_table, %s << 8 | %s);\n", reg(o[0]), reg(o[0]), reg(o[1])); break;
+        case 0x4a:
+            if (o[1] == 0) {
+                leave(NATIVE_EXIT_INTERPRET, in.pc, after + 1);
+                break;
+            }
+            emit("    if (%s == 0)\n", reg(o[0]));
+            leave(NATIVE_EXIT_INTERPRET, in.pc, after + 1);
+            emit("    %s = ALU(pwr_table, %s << 8 | %u);\n", reg(o[0]), reg(o[0]), o[1]);
+            break;
+        case 0x4b:
+            emit("    if (%s == 0 || %s == 0)\n", reg(o[0]), reg(o[1]));
+            leave(NATIVE_EXIT_INTERPRET, in.pc, after + 1);
+            emit("    %s = ALU(pwr_table, %s << 8 | %s);\n", reg(o[0]), reg(o[0]), reg(o[1]));
+            break;
+        case 0x4c: emit("    %s = ALU(sqrt_table, %s);\n", reg(o[0]), reg(o[0])); break;
+        case 0x4d: emit("    %s = ALU(fsqrt_table, %s);\n", reg(o[0]), reg(o[0])); break;
+        case 0x4e:
+            emit("    if (%s == 0)\n", reg(o[1]));
+            leave(NATIVE_EXIT_INTERPRET, in.pc, after + 1);
+            emit("    n = %s %% %s;\n    FLAGS(n);\n    %s = n;\n", reg(o[0]), reg(o[1]), reg(o[0]));
+            break;
+        case 0x4f:
+            if (o[1] == 0) {
+                leave(NATIVE_EXIT_INTERPRET, in.pc, after + 1);
+                break;
+            }
+            emit("    n = %s %% %u;\n    FLAGS(n);\n    %s = n;\n", reg(o[0]), o[1], reg(o[0]));
+            break;
+
+        // Return address low byte first, like Stack::push_16bit()
+        case 0x50: case 0x51:
+            if (in.opcode == 0x50) emit("    pc = 0x%04x;\n", in.address);
+            else emit("    pc = %s | %s << 8;\n", reg(o[1]), reg(o[0]));
+            emit("    e = STORE(STACK + 255 - sp, %u);\n    sp++;\n", next & 0xff);
+            emit("    if (STORE(STACK + 255 - sp, %u) == %d) e = %d;\n    sp++;\n", next >> 8, NATIVE_EXIT_STALE, NATIVE_EXIT_STALE);
+            emit("    if (e == %d)\n", NATIVE_EXIT_STALE);
+            leave("e", "pc", after);
+            if (in.opcode == 0x50) jump(in.address, 0);
+            else emit("    goto dispatch;\n");
+            break;
+        case 0x52:
+            emit("    sp--;\n    n = LOAD(STACK + 255 - sp) << 8;\n    sp--;\n    pc = n | LOAD(STACK + 255 - sp);\n    goto dispatch;\n");
+            break;
+
+        // Stores leave with the exit STORE() gave, after the store
+        case 0x60: emit("    if ((e = STORE(%s | %s << 8, %s)))\n", reg(o[1]), reg(o[0]), reg(o[2])); leave("e", next_pc, after); break;
+        case 0x61: emit("    if ((e = STORE(0x%04x, %s)))\n", in.address, reg(o[2])); leave("e", next_pc, after); break;
+        case 0x62: emit("    if ((e = STORE(%s | %s << 8, %u)))\n", reg(o[1]), reg(o[0]), o[2]); leave("e", next_pc, after); break;
+        case 0x63: emit("    if ((e = STORE(0x%04x, %u)))\n", in.address, o[2]); leave("e", next_pc, after); break;
+
+        case 0xfd: case 0xfe: case 0xff:
+            emit("    cx->halt_pc = 0x%04x;\n", next);
+            if (in.opcode == 0xfd) emit("    n = %s;\n", reg(o[0]));
+            else emit("    n = %u;\n", in.opcode == 0xfe ? o[0] : 0);
+            leave(std::to_string(NATIVE_EXIT_HALT).c_str(), "n", after);
+            break;
+
+        default: // CAS and XADD run in the interpreter, anything else doesn't exist and faults
+            leave(NATIVE_EXIT_INTERPRET, in.pc, after + 1);
+            break;
+    }
+}
+
+std::string Recompiler::source()
+{
+    out.clear();
+    emit("// Generated by neodymium_aot, don't edit\n#include <cstdint>\n\n%s\n\n", NATIVE_ABI_SOURCE);
+    emit("#define PAGE_DEVICE 0x%02x\n#define WRITE_YIELD %d\n#define STACK 0x%04x\n\n", PAGE_DEVICE, WRITE_YIELD, STACK_ADDRESS);
+
+    // What the engine needs to know about the code
+    std::vector<byte> entries(RAM_SIZE / 8), compiled(RAM_SIZE / 8);
+    for (const CodeInstruction& in : flow.instructions) {
+        if (entry[in.pc]) entries[in.pc / 8] |= 1 << (in.pc % 8);
+        for (int i = 0; i < in.length; i++) compiled[(in.pc + i) / 8] |= 1 << ((in.pc + i) % 8);
+    }
+    auto table = [this](const char* name, const byte* data, size_t size) {
+        emit("static const uint8_t %s[%zu] = {", name, size > 0 ? size : 1);
+        for (size_t i = 0; i < size; i++) emit("%s0x%02x,", i % 16 == 0 ? "\n    " : " ", data[i]);
+        emit("%s\n};\n\n", size > 0 ? "" : "0");
+    };
+    table("image", flow.image.data(), flow.image.size());
+    table("entries", entries.data(), entries.size());
+    table("compiled", compiled.data(), compiled.size());
+
+    emit(
+        "static inline uint8_t load(NativeContext* cx, uint8_t* memory, const uint8_t* pages, uint16_t address)\n"
+        "{\n"
+        "    return pages[address >> 8] & PAGE_DEVICE ? cx->read(cx->host, address) : memory[address];\n"
+        "}\n\n"
+        "// 0, or how run() leaves after it\n"
+        "static inline int store(NativeContext* cx, uint8_t* memory, const uint8_t* pages, uint16_t address, uint8_t data)\n"
+        "{\n"
+        "    if (pages[address >> 8] == 0) {\n"
+        "        memory[address] = data;\n"
+        "        return 0;\n"
+        "    }\n"
+        "    int written = cx->write(cx->host, address, data);\n"
+        "    if (cx->stale) return %d;\n"
+        "    return written == WRITE_YIELD ? %d : 0;\n"
+        "}\n\n",
+        NATIVE_EXIT_STALE, NATIVE_EXIT_YIELD);
+
+    emit(
+        "static uint32_t run(NativeContext* cx, uint16_t pc)\n"
+        "{\n"
+        "    uint8_t* const memory = cx->memory;\n"
+        "    const uint8_t* const pages = cx->page_flags;\n"
+        "    const NativeAlu* const div_table = cx->div_table;\n"
+        "    const NativeAlu* const pwr_table = cx->pwr_table;\n"
+        "    const NativeAlu* const sqrt_table = cx->sqrt_table;\n"
+        "    const NativeAlu* const fsqrt_table = cx->fsqrt_table;\n"
+        "    uint8_t r0 = cx->registers[0], r1 = cx->registers[1], r2 = cx->registers[2], r3 = cx->registers[3];\n"
+        "    uint8_t r4 = cx->registers[4], r5 = cx->registers[5], r6 = cx->registers[6], r7 = cx->registers[7];\n"
+        "    uint8_t rz = *cx->always_zero, sp = *cx->sp;\n"
+        "    int64_t fr = *cx->flags_result;\n"
+        "    bool fp = *cx->flags_pending, zf = *cx->zero, uf = *cx->underflow, of = *cx->overflow;\n"
+        "    int64_t budget = cx->budget;\n"
+        "    int64_t n;\n"
+        "    int e;\n\n"
+        "    #define LEAVE(kind, value) do { \\\n"
+        "        cx->registers[0] = r0; cx->registers[1] = r1; cx->registers[2] = r2; cx->registers[3] = r3; \\\n"
+        "        cx->registers[4] = r4; cx->registers[5] = r5; cx->registers[6] = r6; cx->registers[7] = r7; \\\n"
+        "        *cx->always_zero = rz; *cx->sp = sp; \\\n"
+        "        *cx->flags_result = fr; *cx->flags_pending = fp; *cx->zero = zf; *cx->underflow = uf; *cx->overflow = of; \\\n"
+        "        cx->budget = budget; \\\n"
+        "        return (uint32_t)(kind) << 16 | (uint16_t)(value); \\\n"
+        "    } while (0)\n"
+        "    #define FLAGS(number) (fr = (number), fp = true)\n"
+        "    #define SYNC() if (fp) { fp = false; of = fr > 255; zf = fr == 0; uf = fr < 0; }\n"
+        "    #define LOAD(address) load(cx, memory, pages, (uint16_t)(address))\n"
+        "    #define STORE(address, data) store(cx, memory, pages, (uint16_t)(address), (data))\n"
+        "    #define ALU(table, index) (FLAGS(table[index].flags & 1 ? 0 : table[index].flags & 2 ? -1 : table[index].flags & 4 ? 256 : 1), table[index].value)\n\n"
+        "dispatch:\n"
+        "    switch (pc) {\n");
+    for (const CodeInstruction& in : flow.instructions) {
+        if (entry[in.pc]) emit("        case 0x%04x: goto b_%04x;\n", in.pc, in.pc);
+    }
+    emit("    }\n    LEAVE(%d, pc);\n", NATIVE_EXIT_JUMP);
+
+    // Blocks, from every entry until something leaves or the next entry
+    for (size_t i = 0; i < flow.instructions.size(); ) {
+        const CodeInstruction& first = flow.instructions[i];
+        size_t end = i + 1;
+        if (!ends_block(first.opcode)) {
+            while (end < flow.instructions.size()) {
+                const CodeInstruction& last = flow.instructions[end - 1];
+                const CodeInstruction& in = flow.instructions[end];
+                if (in.pc != last.pc + last.length || entry[in.pc]) break;
+                end++;
+                if (ends_block(in.opcode)) break;
+            }
+        }
+        int length = end - i;
+
+        emit("\nb_%04x:\n    if (budget < %d) LEAVE(%d, 0x%04x);\n    budget -= %d;\n", first.pc, length, NATIVE_EXIT_BUDGET, first.pc, length);
+        for (size_t k = i; k < end; k++) instruction(flow.instructions[k], k - i, length);
+
+        // Falls through into whatever comes next
+        const CodeInstruction& last = flow.instructions[end - 1];
+        if (!is_terminator(last.opcode) && !(last.opcode >= 0x50 && last.opcode <= 0x52)) jump(last.pc + last.length, 0);
+
+        blocks++;
+        instructions += length;
+        i = end;
+    }
+    emit("}\n\n");
+
+    emit("extern \"C\" const NativeModule %s;\n", NATIVE_SYMBOL);
+    emit("const NativeModule %s = { %d, %zu, image, entries, compiled, run };\n", NATIVE_SYMBOL, NATIVE_VERSION, flow.image.size());
+    return out;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "def.h"
+#include "cfg.h"
+#include <string>
+#include <vector>
+
+// Turns a program into C++ for a shared object Engine::NATIVE runs (see native.h), what
+// neodymium_aot writes. Works on what a partial ControlFlow walk found: every basic block becomes a
+// label in one function, static JMP/Jcc/CALL targets are gotos, register-indirect jumps and RET go
+// through a switch over the blocks. Anywhere else (and on faults) it hands back to the interpreter.
+//
+// Registers and flags are locals while it runs, the compiler keeps them in host registers. Every
+// block takes its instructions out of the budget when it starts, or leaves if they don't fit.
+struct Recompiler {
+    private:
+    const ControlFlow& flow;
+    std::vector<bool> entry;    // Starts a block
+    std::string out;
+
+    void emit(const char* format, ...);
+    void instruction(const CodeInstruction& in, int at, int length); // at: instructions before it in its block
+    void leave(const char* kind, const char* value, int unused); // Exits with the instructions not run given back
+    void leave(int kind, uint16_t pc, int unused);
+    void jump(uint16_t target, int unused);        // To a block, or out
+    const char* reg(byte operand) const;
+
+    public:
+    int blocks;
+    int instructions;
+
+    Recompiler(const ControlFlow& flow);
+    std::string source(); // The whole translation unit
+};
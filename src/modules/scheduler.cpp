@@ -0,0 +1,55 @@
+#include "scheduler.h"
+#include <algorithm>
+
+// Soonest on top of std::push_heap's max-heap
+static bool sooner(const Event& a, const Event& b)
+{
+    return a.at > b.at;
+}
+
+void Scheduler::schedule(uint64_t at, EventKind kind)
+{
+    heap.push_back({at, kind});
+    std::push_heap(heap.begin(), heap.end(), sooner);
+}
+
+void Scheduler::schedule_in(uint64_t delay, EventKind kind)
+{
+    later.push_back({delay, kind});
+}
+
+void Scheduler::settle(uint64_t now)
+{
+    for (const Event& event : later) schedule(now + event.at, event.kind);
+    later.clear();
+}
+
+void Scheduler::cancel(EventKind kind)
+{
+    auto same = [kind](const Event& e) { return e.kind == kind; };
+    heap.erase(std::remove_if(heap.begin(), heap.end(), same), heap.end());
+    later.erase(std::remove_if(later.begin(), later.end(), same), later.end());
+    std::make_heap(heap.begin(), heap.end(), sooner);
+}
+
+uint64_t Scheduler::next() const
+{
+    return heap.empty() ? NO_EVENT : heap.front().at;
+}
+
+uint64_t Scheduler::next(EventKind kind) const
+{
+    uint64_t soonest = NO_EVENT;
+    for (const Event& event : heap) {
+        if (event.kind == kind && event.at < soonest) soonest = event.at;
+    }
+    return soonest;
+}
+
+Event Scheduler::pop()
+{
+    std::pop_heap(heap.begin(), heap.end(), sooner);
+    Event event = heap.back();
+    heap.pop_back();
+    return event;
+}
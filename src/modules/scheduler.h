@@ -0,0 +1,34 @@
+#pragma once
+#include "def.h"
+#include <vector>
+
+#define NO_EVENT UINT64_MAX
+
+enum struct EventKind : byte {
+    FRAME,  // Time to check the frame clock, present and poll the window (only while CPU::run)
+    TIMER,  // The timer runs out
+};
+
+struct Event {
+    uint64_t at;    // Retired instructions
+    EventKind kind;
+};
+
+// Things that have to happen after some number of retired instructions, soonest first. The CPU
+// runs the engines until the next one is due instead of checking for them on every instruction.
+struct Scheduler {
+    private:
+    std::vector<Event> heap;    // Min-heap by at
+    std::vector<Event> later;   // schedule_in(), at is still relative
+
+    public:
+    void schedule(uint64_t at, EventKind kind);
+    // From the end of the running instruction, for devices: they don't know the retired count. The
+    // store that calls it has to end the slice (Device::write() returns true), settle() places it then.
+    void schedule_in(uint64_t delay, EventKind kind);
+    void settle(uint64_t now);
+    void cancel(EventKind kind); // Every pending one of that kind
+    uint64_t next() const;       // When the soonest one is due, NO_EVENT if there are none
+    uint64_t next(EventKind kind) const; // Same, of that kind
+    Event pop();                 // The soonest one, taken out
+};
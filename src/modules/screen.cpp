@@ -1,59 +1,53 @@
 #include "screen.h"
-#include "errors.h"
+#include "image.h"
 
-Screen::Screen(byte* addr_ptr) 
+Screen::Screen(byte* addr_ptr, Keyboard* keyboard) 
 {
     framebuffer = addr_ptr;
-
-    if (!glfwInit()) 
-    {
-        glfwTerminate();
-        raise(Errors::SIGABRT); // Abnormal termination
-    }
-
-    window = glfwCreateWindow(
-        WIDTH * ZOOM,
-        HEIGHT * ZOOM,
-        "Neodymium vScreen",
-        NULL,
-        NULL
-    );
-
-    if (!window) 
-    {
-        glfwTerminate();
-        raise(Errors::SIGABRT);
-    }
-
-    glfwMakeContextCurrent(window);
+    this->keyboard = keyboard;
+    display = create_display(DisplayBackend::HEADLESS);
+    display->attach(keyboard);
 };
 
-void Screen::tick()
+Screen::~Screen()
 {
-    if(glfwWindowShouldClose(window))
-    { 
-        glfwTerminate(); 
-        raise(Errors::SIGKILL);
-    }
+    delete display;
+}
 
-    glClear(GL_COLOR_BUFFER_BIT);
+void Screen::set_backend(DisplayBackend backend)
+{
+    delete display;
+    display = create_display(backend);
+    display->attach(keyboard);
+}
 
-    glPixelZoom(ZOOM, ZOOM);
-    glRasterPos2i(0, 0);
+bool Screen::tick()
+{
+    present();
+    return poll();
+};
 
-    glDrawPixels(
-        WIDTH,
-        HEIGHT,
-        GL_RGB,
-        GL_UNSIGNED_BYTE,
-        framebuffer
-    );
+void Screen::present(bool changed)
+{
+    display->present(framebuffer, changed);
+};
 
-    glfwSwapBuffers(window);
-    glfwPollEvents();
+bool Screen::poll()
+{
+    return display->poll();
 };
 
+void Screen::wait(double seconds)
+{
+    display->wait(seconds);
+}
+
+bool Screen::dump(const char* path)
+{
+    return write_image(path, framebuffer, WIDTH, HEIGHT);
+}
+
 void Screen::terminate()
 {
-    glfwTerminate();
-}
\ No newline at end of file
+    display->terminate();
+}
@@ -1,19 +1,32 @@
 #pragma once
 #include "def.h"
-#include <GLFW/glfw3.h>
+#include "display.h"
+#include "machine.h"
 
-#define HEIGHT  16
-#define WIDTH   16
-// Zoom size, calculated by 512/HEIGHT (just when HEIGHT == WIDTH)
-#define ZOOM    32
+#define HEIGHT  (MACHINE.height)
+#define WIDTH   (MACHINE.width)
+// Zoom size, 512/HEIGHT for every machine so far
+#define ZOOM    (MACHINE.zoom)
+// RGB, one byte per channel
+#define FRAMEBUFFER_SIZE (WIDTH * HEIGHT * 3)
 
 struct Screen {
     private:
     bytes framebuffer;
-    GLFWwindow* window;
+    Keyboard* keyboard; // Handed to every display
 
     public:
-    Screen(byte* addr_ptr);
-    void tick();
+    Display* display; // Owned, deleted with it
+
+    Screen(byte* addr_ptr, Keyboard* keyboard = nullptr); // Starts headless, call set_backend() to get a window
+    Screen(const Screen&) = delete; // A copy would delete display again
+    Screen& operator=(const Screen&) = delete;
+    ~Screen();
+    void set_backend(DisplayBackend backend);
+    bool tick(); // present() + poll()
+    void present(bool changed = true); // Sends the framebuffer to the display, changed if it was written since the last one
+    bool poll(); // Handles display events, false once the window was closed
+    void wait(double seconds); // Sleeps, less if the display gets an event
+    bool dump(const char* path); // Writes the current framebuffer as PPM or PNG (by extension)
     void terminate();
-};
\ No newline at end of file
+};
@@ -0,0 +1,195 @@
+#include "snapshot.h"
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+
+Snapshot::Snapshot()
+: id(0), registers(), always_zero(0), zero(false), underflow(false), overflow(false), pc(0), sp(0), retired(0),
+  timer_control(0), timer_period(), timer_vector(), timer_expired(false), timer_in_service(false), timer_due(NO_EVENT)
+{
+    memory = new byte[RAM_SIZE]();
+}
+
+Snapshot::~Snapshot()
+{
+    delete[] memory;
+}
+
+uint64_t Snapshot::next_id()
+{
+    static std::atomic<uint64_t> ids(0);
+    return ++ids;
+}
+
+void Snapshot::take(CPU* cpu)
+{
+    id = next_id();
+    memcpy(memory, cpu->ram.memory, RAM_SIZE);
+    memcpy(registers, cpu->registers, REGISTERS);
+    always_zero = cpu->ALWAYS_ZERO;
+    cpu->sync_flags();
+    zero = cpu->zero;
+    underflow = cpu->underflow;
+    overflow = cpu->overflow;
+    pc = cpu->ram.pc;
+    sp = cpu->stack.sp;
+    retired = cpu->retired;
+
+    timer_control = cpu->timer.control;
+    memcpy(timer_period, cpu->timer.period, 2);
+    memcpy(timer_vector, cpu->timer.vector_bytes, 2);
+    timer_expired = cpu->timer.expired;
+    timer_in_service = cpu->timer.in_service;
+    timer_due = cpu->scheduler.next(EventKind::TIMER);
+
+    cpu->ram.track_writes(id);
+}
+
+bool Snapshot::same(const Snapshot& other) const
+{
+    return memcmp(memory, other.memory, RAM_SIZE) == 0 && memcmp(registers, other.registers, REGISTERS) == 0
+        && always_zero == other.always_zero && zero == other.zero && underflow == other.underflow
+        && overflow == other.overflow && pc == other.pc && sp == other.sp && retired == other.retired
+        && timer_control == other.timer_control && memcmp(timer_period, other.timer_period, 2) == 0
+        && memcmp(timer_vector, other.timer_vector, 2) == 0 && timer_expired == other.timer_expired
+        && timer_in_service == other.timer_in_service && timer_due == other.timer_due;
+}
+
+void Snapshot::restore_page(RAM& ram, int page)
+{
+    uint32_t start = page * PAGE_SIZE;
+    if (ram.page_flags[page] & (PAGE_DEVICE | PAGE_READONLY)) return; // Never written, and devices keep their own state
+
+    // Cached code and the framebuffer have to hear about it, let write() tell them about the bytes that change
+    if (ram.page_flags[page] & (PAGE_CODE | PAGE_WATCHED)) {
+        for (uint32_t address = start; address < start + PAGE_SIZE; address++) {
+            if (ram.memory[address] != memory[address]) ram.write(address, memory[address]);
+        }
+    }
+    else memcpy(ram.memory + start, memory + start, PAGE_SIZE);
+}
+
+void Snapshot::restore(CPU* cpu)
+{
+    RAM& ram = cpu->ram;
+
+    // Dirty pages are already untracked, restoring them doesn't add them again
+    if (id != 0 && ram.tracker == id) {
+        for (int i = 0; i < ram.dirty_count; i++) restore_page(ram, ram.dirty[i]);
+        ram.reset_dirty();
+    }
+    else {
+        for (int page = 0; page < PAGES; page++) restore_page(ram, page);
+        ram.track_writes(id);
+    }
+
+    memcpy(cpu->registers, registers, REGISTERS);
+    cpu->ALWAYS_ZERO = always_zero;
+    cpu->flags_pending = false;
+    cpu->zero = zero;
+    cpu->underflow = underflow;
+    cpu->overflow = overflow;
+    ram.pc = pc;
+    cpu->stack.sp = sp;
+    cpu->retired = retired;
+
+    cpu->timer.control = timer_control;
+    memcpy(cpu->timer.period, timer_period, 2);
+    memcpy(cpu->timer.vector_bytes, timer_vector, 2);
+    cpu->timer.expired = timer_expired;
+    cpu->timer.in_service = timer_in_service;
+    cpu->scheduler.cancel(EventKind::TIMER);
+    if (timer_due != NO_EVENT) cpu->scheduler.schedule(timer_due, EventKind::TIMER);
+}
+
+bool Snapshot::save(const char* path, Errors& error) const
+{
+    byte header[SNAPSHOT_HEADER];
+    byte* at = header;
+    memcpy(at, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE); at += SNAPSHOT_MAGIC_SIZE;
+    *at++ = pc >> 8;
+    *at++ = pc & 0xff;
+    *at++ = sp;
+    *at++ = (zero ? 1 : 0) | (underflow ? 2 : 0) | (overflow ? 4 : 0);
+    *at++ = always_zero;
+    memcpy(at, registers, REGISTERS); at += REGISTERS;
+    for (int shift = 56; shift >= 0; shift -= 8) *at++ = (byte)(retired >> shift);
+    *at++ = timer_control;
+    *at++ = timer_period[0];
+    *at++ = timer_period[1];
+    *at++ = timer_vector[0];
+    *at++ = timer_vector[1];
+    *at++ = (timer_expired ? 1 : 0) | (timer_in_service ? 2 : 0);
+    for (int shift = 56; shift >= 0; shift -= 8) *at++ = (byte)(timer_due >> shift);
+
+    std::ofstream out(path, std::ios::out | std::ios::binary);
+    if (!out.is_open()) {
+        error = Errors::ERROR_OPENING_FILE;
+        return false;
+    }
+    out.write((const char*)header, SNAPSHOT_HEADER);
+    out.write((const char*)memory, RAM_SIZE);
+    if (!out) {
+        error = Errors::ERROR_OPENING_FILE;
+        return false;
+    }
+    return true;
+}
+
+bool Snapshot::load(const char* path, Errors& error)
+{
+    struct stat buffer;
+    if (stat(path, &buffer) != 0) {
+        error = Errors::FILE_NOT_FOUND;
+        return false;
+    }
+
+    if (buffer.st_size != SNAPSHOT_HEADER + RAM_SIZE) {
+        error = Errors::BAD_SNAPSHOT;
+        return false;
+    }
+
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.is_open()) {
+        error = Errors::ERROR_OPENING_FILE;
+        return false;
+    }
+
+    byte header[SNAPSHOT_HEADER];
+    in.read((char*)header, SNAPSHOT_HEADER);
+    if (!in || memcmp(header, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0) {
+        error = Errors::BAD_SNAPSHOT;
+        return false;
+    }
+    in.read((char*)memory, RAM_SIZE);
+    if (!in) {
+        error = Errors::ERROR_OPENING_FILE;
+        return false;
+    }
+
+    const byte* at = header + SNAPSHOT_MAGIC_SIZE;
+    pc = (at[0] << 8) | at[1]; at += 2;
+    sp = *at++;
+    zero = *at & 1;
+    underflow = *at & 2;
+    overflow = *at & 4;
+    at++;
+    always_zero = *at++;
+    memcpy(registers, at, REGISTERS); at += REGISTERS;
+    retired = 0;
+    for (int i = 0; i < 8; i++) retired = (retired << 8) | *at++;
+    timer_control = *at++;
+    timer_period[0] = *at++;
+    timer_period[1] = *at++;
+    timer_vector[0] = *at++;
+    timer_vector[1] = *at++;
+    timer_expired = *at & 1;
+    timer_in_service = *at & 2;
+    at++;
+    timer_due = 0;
+    for (int i = 0; i < 8; i++) timer_due = (timer_due << 8) | *at++;
+
+    id = next_id(); // Whoever this was tracking has the old contents
+    return true;
+}
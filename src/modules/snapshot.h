@@ -0,0 +1,51 @@
+#pragma once
+#include "def.h"
+#include "cpu.h"
+#include "errors.h"
+
+#define SNAPSHOT_MAGIC      "NDSNAP2\n"
+#define SNAPSHOT_MAGIC_SIZE 8
+#define SNAPSHOT_HEADER     (SNAPSHOT_MAGIC_SIZE + 2 + 1 + 1 + 1 + REGISTERS + 8 + 1 + 2 + 2 + 1 + 8)
+
+// The whole machine: RAM, registers, flags, pc, the stack pointer, the retired count and the timer.
+// RAM tracks the pages written after take() or restore(), so restoring to that same CPU
+// only copies those back: resetting after a short run costs what it touched, not 64KB.
+// Any other CPU (or one that took another snapshot since) gets everything copied.
+// Restoring isn't thread safe with that CPU running, take and restore between execute()s.
+//
+// File format, multi-byte values high byte first like the rest of the VM:
+//   "NDSNAP2\n", pc (2), sp, flags (zero 1, underflow 2, overflow 4), ALWAYS_ZERO,
+//   the registers, retired (8), timer control, period (2), vector (2), timer flags (expired 1,
+//   in service 2), when the timer runs out in retired instructions (8, all ones if it isn't
+//   running), then the 64KB of RAM
+struct Snapshot {
+    private:
+    uint64_t id; // New for every take() and load(), what RAM::tracker is compared with
+    bytes memory;
+    byte registers[REGISTERS];
+    byte always_zero;
+    bool zero, underflow, overflow;
+    uint16_t pc;
+    byte sp;
+    uint64_t retired;
+
+    // The timer, and its event: that's keyed on retired, a restore going back in time has to move it
+    byte timer_control;
+    byte timer_period[2];
+    byte timer_vector[2];
+    bool timer_expired, timer_in_service;
+    uint64_t timer_due; // NO_EVENT if it isn't running
+
+    void restore_page(RAM& ram, int page);
+    static uint64_t next_id();
+
+    public:
+    Snapshot();
+    ~Snapshot();
+
+    void take(CPU* cpu);
+    void restore(CPU* cpu);
+    bool save(const char* path, Errors& error) const;
+    bool load(const char* path, Errors& error);
+    bool same(const Snapshot& other) const; // The same machine, retired count included
+};
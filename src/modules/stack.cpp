@@ -1,18 +1,16 @@
 #include "stack.h"
 #include "casts.h"
 
-Stack::Stack (byte* stack_start) : sp(0) {
-    stack = stack_start;
-}
+Stack::Stack (RAM* ram, uint16_t stack_start) : ram(ram), base(stack_start), sp(0) {}
 
+// sp counts the pushed bytes and the stack grows down from base + 255, so the top is at base + 255 - (sp - 1)
 byte Stack::peek() {
-    return stack[255-sp];
+    return ram->get_from_address(base + 255 - (byte)(sp - 1));
 }
 
 byte Stack::pop() {
-    byte temp = stack[255-sp];
     sp--;
-    return temp;
+    return ram->get_from_address(base + 255 - sp);
 }
 
 uint16_t Stack::pop_16bit() {
@@ -22,7 +20,7 @@ uint16_t Stack::pop_16bit() {
 }
 
 void Stack::push(byte data) {
-    stack[255-sp] = data;
+    ram->write(base + 255 - sp, data);
     sp++;   
 }
 
@@ -30,4 +28,5 @@ void Stack::push_16bit(uint16_t data) {
     byte* bdata = uint16_to_bytes(data);
     push(bdata[0]);
     push(bdata[1]);
-}
\ No newline at end of file
+    delete[] bdata;
+}
@@ -1,16 +1,22 @@
 #pragma once
 #include "def.h"
+#include "ram.h"
 
 struct Stack {
     private:
-    bytes stack;
+    RAM* ram;
+    uint16_t base;
     byte sp;
 
+    friend struct JIT;
+    friend struct NativeEngine;
+    friend struct Snapshot;
+
     public:
-    Stack(byte* stack_start);
+    Stack(RAM* ram, uint16_t stack_start); // Goes through RAM so writes are seen by its hooks
     byte peek();
     byte pop();
     uint16_t pop_16bit();
     void push(byte data);
     void push_16bit(uint16_t data);
-};
\ No newline at end of file
+};
@@ -0,0 +1,60 @@
+#include "timer.h"
+#include "casts.h"
+
+Timer::Timer(Scheduler* scheduler)
+: scheduler(scheduler), control(0), period(), vector_bytes(), expired(false), in_service(false)
+{
+}
+
+uint32_t Timer::length() const
+{
+    return (period[0] << 8 | period[1]) * TIMER_TICK;
+}
+
+uint16_t Timer::vector() const
+{
+    return bytes_to_uint16(vector_bytes[1], vector_bytes[0]);
+}
+
+byte Timer::read(uint16_t address)
+{
+    switch (address) {
+        case TIMER_CONTROL: return control | (expired ? TIMER_EXPIRED : 0);
+        case TIMER_PERIOD: return period[0];
+        case TIMER_PERIOD + 1: return period[1];
+        case TIMER_VECTOR: return vector_bytes[0];
+        case TIMER_VECTOR + 1: return vector_bytes[1];
+    }
+    return 0;
+}
+
+bool Timer::write(uint16_t address, byte data)
+{
+    switch (address) {
+        case TIMER_CONTROL:
+            control = data & (TIMER_ENABLE | TIMER_REPEAT | TIMER_INTERRUPT);
+            scheduler->cancel(EventKind::TIMER);
+            if ((control & TIMER_ENABLE) && length() != 0) scheduler->schedule_in(length(), EventKind::TIMER);
+            return true;
+        case TIMER_ACKNOWLEDGE:
+            expired = false;
+            in_service = false;
+            break;
+        case TIMER_PERIOD: period[0] = data; break;
+        case TIMER_PERIOD + 1: period[1] = data; break;
+        case TIMER_VECTOR: vector_bytes[0] = data; break;
+        case TIMER_VECTOR + 1: vector_bytes[1] = data; break;
+    }
+    return false;
+}
+
+bool Timer::expire(uint64_t at)
+{
+    expired = true;
+    if ((control & TIMER_REPEAT) && length() != 0) scheduler->schedule(at + length(), EventKind::TIMER);
+    else control &= ~TIMER_ENABLE;
+
+    if (!(control & TIMER_INTERRUPT) || in_service) return false;
+    in_service = true;
+    return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "def.h"
+#include "device.h"
+#include "scheduler.h"
+
+#define TIMER_ADDRESS       0xd100
+#define TIMER_CONTROL       (TIMER_ADDRESS + 0) // TIMER_* bits below, writing it starts the timer again
+#define TIMER_ACKNOWLEDGE   (TIMER_ADDRESS + 1) // Writing clears TIMER_EXPIRED and ends the interrupt
+#define TIMER_PERIOD        (TIMER_ADDRESS + 2) // 16-bit, high byte first, in TIMER_TICKs. 0 never runs out.
+#define TIMER_VECTOR        (TIMER_ADDRESS + 4) // 16-bit, high byte first, where interrupts CALL
+#define TIMER_TICK          64 // Instructions
+
+// TIMER_CONTROL
+#define TIMER_ENABLE    0x01
+#define TIMER_REPEAT    0x02 // Starts again every time it runs out, otherwise it's disabled then
+#define TIMER_INTERRUPT 0x04 // Running out CALLs TIMER_VECTOR
+#define TIMER_EXPIRED   0x80 // Read only, ran out since the last acknowledge
+
+// Counts retired instructions, from the end of the store to TIMER_CONTROL (the engine stops there
+// so the count starts right). When it runs out with TIMER_INTERRUPT set, the CPU pushes
+// pc and jumps to TIMER_VECTOR between two instructions, like a CALL: the handler ends with RET.
+// It has to leave registers and flags as it found them (loads, stores, MOV, PUSH and POP don't
+// touch the flags). There are no more interrupts until it writes TIMER_ACKNOWLEDGE.
+struct Timer : Device {
+    private:
+    Scheduler* scheduler;
+    byte control;
+    byte period[2];
+    byte vector_bytes[2];
+    bool expired;
+    bool in_service; // Interrupted, not acknowledged yet
+
+    uint32_t length() const; // Instructions
+
+    friend struct Snapshot;
+
+    public:
+    Timer(Scheduler* scheduler);
+
+    byte read(uint16_t address) override;
+    bool write(uint16_t address, byte data) override;
+    bool steady(uint16_t address) override { return true; } // Only changes on its TIMER event
+
+    bool expire(uint64_t at); // Its TIMER event ran out at at, true if the CPU has to interrupt now
+    uint16_t vector() const;
+};
@@ -0,0 +1,19 @@
+#include "triple_buffer.h"
+
+#define FRAME_FRESH 0x04
+
+TripleBuffer::TripleBuffer()
+: frames(), middle(1), writing(0), reading(2)
+{}
+
+void TripleBuffer::publish()
+{
+    writing = middle.exchange(writing | FRAME_FRESH, std::memory_order_acq_rel) & ~FRAME_FRESH;
+}
+
+bool TripleBuffer::acquire()
+{
+    if (!(middle.load(std::memory_order_acquire) & FRAME_FRESH)) return false;
+    reading = middle.exchange(reading, std::memory_order_acq_rel) & ~FRAME_FRESH;
+    return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "def.h"
+#include "screen.h"
+#include <atomic>
+
+// Hands the latest frame from one thread to another without locks. Each side has a buffer
+// of its own and they trade through a third one: the writer never waits for the reader,
+// and the reader always gets the newest complete frame (older ones it missed are dropped).
+struct TripleBuffer {
+    private:
+    byte frames[3][FRAMEBUFFER_SIZE];
+    std::atomic<byte> middle;   // Index of the buffer in between, | FRAME_FRESH if the writer left a frame there
+    byte writing;               // Writer's own
+    byte reading;               // Reader's own
+
+    public:
+    TripleBuffer();
+
+    // Writer side
+    byte* back() { return frames[writing]; }
+    void publish(); // back() is a complete frame, hand it over
+
+    // Reader side
+    bool acquire(); // Takes the newest frame if there's one it didn't have, front() is it then
+    const byte* front() const { return frames[reading]; }
+};
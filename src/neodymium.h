@@ -0,0 +1,66 @@
+/* libneodymium: the VM as a library, for running guests inside another program.
+ *
+ *   neodymium_vm* vm = neodymium_create(NEODYMIUM_ENGINE_DECODED);
+ *   neodymium_load(vm, image, size);
+ *   while (neodymium_run_for(vm, 1000000) == NEODYMIUM_RUNNING) { ...other work... }
+ *   neodymium_destroy(vm);
+ *
+ * Nothing here exits the process or throws: a guest fault is a status, bad arguments are a return
+ * value. A VM is used by one thread at a time, any number of them can run on different threads.
+ * It's always headless, the framebuffer is plain memory at 0xA000 (see devinfo.md). */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct neodymium_vm neodymium_vm;
+
+typedef enum neodymium_engine {
+    NEODYMIUM_ENGINE_REFERENCE = 0,
+    NEODYMIUM_ENGINE_DECODED = 1,
+    NEODYMIUM_ENGINE_JIT = 2, /* The decoded engine where there's no JIT */
+} neodymium_engine;
+
+typedef enum neodymium_status {
+    NEODYMIUM_RUNNING = 0, /* Used up the budget, run it again to go on */
+    NEODYMIUM_HALTED = 1,  /* neodymium_exit_code() has the halt code */
+    NEODYMIUM_FAULTED = 2, /* neodymium_error() has what went wrong, the VM doesn't run again */
+} neodymium_status;
+
+#define NEODYMIUM_ALWAYS_ZERO 0xff /* Register number of the always zero register, it can be written */
+
+/* NULL if there's no memory for it */
+neodymium_vm* neodymium_create(neodymium_engine engine);
+void neodymium_destroy(neodymium_vm* vm);
+
+/* Copies the image to address 0 and starts from there, the rest of RAM, registers and flags are
+ * left as they are. -1 if it's bigger than the 64KB of RAM. */
+int neodymium_load(neodymium_vm* vm, const uint8_t* image, size_t size);
+
+/* Runs up to budget instructions. Idle loops waiting for the timer may be skipped through at once,
+ * counting what they would have run. A halted VM runs again from after its HALT. */
+neodymium_status neodymium_run_for(neodymium_vm* vm, uint64_t budget);
+neodymium_status neodymium_status_of(const neodymium_vm* vm); /* Of the last run */
+int neodymium_exit_code(const neodymium_vm* vm);              /* Of the last HALT, -1 before any */
+const char* neodymium_error(const neodymium_vm* vm);          /* NULL unless it faulted */
+uint64_t neodymium_instructions(const neodymium_vm* vm);      /* Since it was created */
+
+/* Registers 0-7 ($a-$h) and NEODYMIUM_ALWAYS_ZERO, out of range reads 0 and writes nothing */
+uint8_t neodymium_get_register(neodymium_vm* vm, int reg);
+void neodymium_set_register(neodymium_vm* vm, int reg, uint8_t value);
+uint16_t neodymium_get_pc(const neodymium_vm* vm); /* After a fault, the faulting instruction on every engine */
+void neodymium_set_pc(neodymium_vm* vm, uint16_t pc);
+
+/* Like the guest's loads and stores: devices see them (reading a key takes it out of the queue)
+ * and ROM drops writes. A range can't go past 0xffff, -1 if it does. */
+uint8_t neodymium_read(neodymium_vm* vm, uint16_t address);
+void neodymium_write(neodymium_vm* vm, uint16_t address, uint8_t value);
+int neodymium_read_memory(neodymium_vm* vm, uint16_t address, uint8_t* out, size_t size);
+int neodymium_write_memory(neodymium_vm* vm, uint16_t address, const uint8_t* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,159 @@
+// neodymium_opt: rewrites a program into a smaller one that does the same (see modules/optimizer.h).
+//
+//   neodymium_opt [--verify] [--max-instructions N] [--quiet] INPUT.bin OUTPUT.bin
+//
+// A program whose control flow can't be worked out statically (jumps to addresses held in
+// registers, code reading or writing itself...) is written out as it was.
+// --verify runs both versions and only writes the output if they end the same way. It fails on a
+// program the walk couldn't take apart, running it once says nothing about the paths it didn't take.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+
+#include "modules/cfg.h"
+#include "modules/cpu.h"
+#include "modules/errors.h"
+#include "modules/optimizer.h"
+
+#define OPT_MAX_INSTRUCTIONS (1ull << 32) // --verify gives up on programs running longer than this
+
+static std::vector<byte> read_image(const char* path)
+{
+    struct stat buffer;
+    if (stat(path, &buffer) != 0) raise(Errors::FILE_NOT_FOUND);
+    if (buffer.st_size > RAM_SIZE) raise(Errors::FILE_TOO_BIG);
+
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) raise(Errors::ERROR_OPENING_FILE);
+    std::vector<byte> image(buffer.st_size);
+    size_t read = fread(image.data(), 1, image.size(), file);
+    fclose(file);
+    if (read != image.size()) raise(Errors::ERROR_OPENING_FILE);
+    return image;
+}
+
+// How a run ended, and what it left where a program can be seen
+struct Outcome {
+    int result;         // Halt code, -1 if it didn't halt
+    const char* error;  // Set if it faulted
+    uint64_t instructions;
+    std::vector<byte> memory;
+};
+
+static Outcome run(const std::vector<byte>& image, uint64_t max_instructions)
+{
+    Outcome o = {-1, nullptr, 0, {}};
+    CPU* cpu = new CPU();
+    for (size_t i = 0; i < image.size(); i++) cpu->ram.write(i, image[i]);
+
+    try {
+        while (o.result == -1 && cpu->retired < max_instructions) o.result = cpu->execute(1 << 20);
+    }
+    catch (VMFault& f) {
+        o.error = error_message(f.code);
+    }
+    o.instructions = cpu->retired;
+    o.memory.assign(cpu->ram.memory, cpu->ram.memory + RAM_SIZE);
+    delete cpu;
+    return o;
+}
+
+// Past both images and outside the stack (which holds return addresses, and those moved)
+static bool same_memory(const Outcome& a, const Outcome& b, size_t from)
+{
+    for (size_t address = from; address < RAM_SIZE; address++) {
+        if (address >= STACK_ADDRESS && address < STACK_ADDRESS + PAGE_SIZE) continue;
+        if (a.memory[address] != b.memory[address]) return false;
+    }
+    return true;
+}
+
+static void describe(const char* which, const Outcome& o)
+{
+    if (o.error != nullptr) fprintf(stderr, "  %s: faults (%s)", which, o.error);
+    else if (o.result == -1) fprintf(stderr, "  %s: doesn't halt", which);
+    else fprintf(stderr, "  %s: halts with %d", which, o.result);
+    fprintf(stderr, " after %llu instructions\n", (unsigned long long)o.instructions);
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* input = nullptr;
+    const char* output = nullptr;
+    bool verify = false;
+    bool quiet = false;
+    uint64_t max_instructions = OPT_MAX_INSTRUCTIONS;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+
+        if (strcmp(arg, "--verify") == 0) verify = true;
+        else if (strcmp(arg, "--quiet") == 0) quiet = true;
+        else if (strcmp(arg, "--max-instructions") == 0 && i + 1 < argc) max_instructions = strtoull(argv[++i], nullptr, 10);
+        else if (arg[0] != '-' && input == nullptr) input = arg;
+        else if (arg[0] != '-' && output == nullptr) output = arg;
+        else {
+            input = nullptr;
+            break;
+        }
+    }
+    if (input == nullptr || output == nullptr) {
+        fprintf(stderr, "Usage: %s [--verify] [--max-instructions N] [--quiet] INPUT.bin OUTPUT.bin\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<byte> image = read_image(input);
+    std::vector<byte> optimized = image;
+
+    ControlFlow flow(image.data(), image.size());
+    const char* problem = flow.problem;
+    uint16_t problem_pc = flow.problem_pc;
+    if (problem == nullptr) {
+        Optimizer optimizer(flow);
+        optimizer.run();
+        problem = optimizer.problem;
+        problem_pc = optimizer.problem_pc;
+        if (problem == nullptr) {
+            optimized = optimizer.output();
+            if (!quiet) optimizer.report(stdout);
+        }
+    }
+    if (problem != nullptr && verify) {
+        fprintf(stderr, "Can't verify: the program %s (0x%04x), nothing written\n", problem, problem_pc);
+        return 1;
+    }
+    if (problem != nullptr) fprintf(stderr, "Left as it was: the program %s (0x%04x)\n", problem, problem_pc);
+    if (!quiet) printf("Bytes: %zu -> %zu\n", image.size(), optimized.size());
+
+    if (verify) {
+        Outcome before = run(image, max_instructions);
+        Outcome after = run(optimized, max_instructions);
+
+        if (before.result == -1 && before.error == nullptr) {
+            fprintf(stderr, "Can't verify, the program didn't halt in %llu instructions\n", (unsigned long long)max_instructions);
+            return 1;
+        }
+        bool same = before.result == after.result && before.error == after.error
+            && same_memory(before, after, image.size() > optimized.size() ? image.size() : optimized.size());
+        if (!same) {
+            fprintf(stderr, "The optimized program doesn't end the same way, nothing written\n");
+            describe("Before", before);
+            describe("After", after);
+            return 1;
+        }
+        if (!quiet) {
+            if (before.error != nullptr) printf("Verified: faults (%s)", before.error);
+            else printf("Verified: halts with %d", before.result);
+            printf(", %llu -> %llu instructions run\n", (unsigned long long)before.instructions, (unsigned long long)after.instructions);
+        }
+    }
+
+    FILE* file = fopen(output, "wb");
+    if (file == nullptr) raise(Errors::ERROR_OPENING_FILE);
+    fwrite(optimized.data(), 1, optimized.size(), file);
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,430 @@
+// neodymium_tests: cases the engines and tools got wrong once, run by ctest.
+//
+//   neodymium_tests [NAME]
+//
+// Runs every case, or the one named. Prints the ones that fail, the exit code is how many did.
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "neodymium.h"
+#include "modules/alu.h"
+#include "modules/cfg.h"
+#include "modules/cpu.h"
+#include "modules/errors.h"
+#include "modules/lockstep.h"
+#include "modules/optimizer.h"
+#include "modules/snapshot.h"
+#include "modules/timer.h"
+
+// After errors.h, they bring signal macros with the names of its Errors
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FUZZ_SEED       1
+#define FUZZ_PROGRAMS   300
+#define FUZZ_GROUPS     100     // Of lockstep lanes
+#define FUZZ_BUDGET     20000   // Instructions each program gets, in slices of random length
+#define FUZZ_FAULT      0x1000  // EngineRun::result of a fault, plus the Errors value
+#define FUZZ_DIED       0x10000 // The process running it died, plus its wait() status
+
+// Everything a run leaves that the engines have to agree on
+struct EngineRun {
+    int result;         // Halt code, -1 if the budget ran out, FUZZ_FAULT or FUZZ_DIED
+    uint16_t pc;
+    byte registers[REGISTERS];
+    byte always_zero;
+    bool zero, underflow, overflow;
+    uint64_t retired;
+    byte memory[RAM_SIZE];
+
+    void take(CPU* cpu, int result); // A friend of CPU, for the registers and flags
+    bool same(const EngineRun& other) const;
+};
+
+void EngineRun::take(CPU* cpu, int result)
+{
+    this->result = result;
+    pc = cpu->ram.pc;
+    memcpy(registers, cpu->registers, REGISTERS);
+    always_zero = cpu->ALWAYS_ZERO;
+    cpu->sync_flags();
+    zero = cpu->zero;
+    underflow = cpu->underflow;
+    overflow = cpu->overflow;
+    retired = cpu->retired;
+    memcpy(memory, cpu->ram.memory, RAM_SIZE);
+}
+
+bool EngineRun::same(const EngineRun& other) const
+{
+    return result == other.result && pc == other.pc && memcmp(registers, other.registers, REGISTERS) == 0
+        && always_zero == other.always_zero && zero == other.zero && underflow == other.underflow
+        && overflow == other.overflow && retired == other.retired && memcmp(memory, other.memory, RAM_SIZE) == 0;
+}
+
+// Every opcode and its operands: R register, I immediate, A 16-bit address
+static const struct { byte opcode; const char* operands; } fuzz_opcodes[] = {
+    {0x00, ""},   {0x01, "RR"},  {0x02, "RI"},  {0x03, "RA"},  {0x04, "RRR"}, {0x10, "R"},   {0x11, "RR"},
+    {0x12, "RI"}, {0x20, "A"},   {0x21, "RR"},  {0x22, "RI"},  {0x23, "RR"},  {0x24, "A"},   {0x25, "RR"},
+    {0x26, "A"},  {0x27, "RR"},  {0x28, "A"},   {0x29, "RR"},  {0x2a, "A"},   {0x2b, "RR"},  {0x2c, "A"},
+    {0x2d, "RR"}, {0x2e, "A"},   {0x2f, "RR"},  {0x30, "R"},   {0x31, "I"},   {0x32, "R"},   {0x40, "RI"},
+    {0x41, "RR"}, {0x42, "R"},   {0x43, "RI"},  {0x44, "RR"},  {0x45, "R"},   {0x46, "RI"},  {0x47, "RR"},
+    {0x48, "RI"}, {0x49, "RR"},  {0x4a, "RI"},  {0x4b, "RR"},  {0x4c, "R"},   {0x4d, "R"},   {0x4e, "RR"},
+    {0x4f, "RI"}, {0x50, "A"},   {0x51, "RR"},  {0x52, ""},    {0x60, "RRR"}, {0x61, "AR"},  {0x62, "RRI"},
+    {0x63, "AI"}, {0x64, "RRR"}, {0x65, "RRR"}, {0xfd, "R"},   {0xfe, "I"},   {0xff, ""},
+};
+
+// First halves of the pairs the decoded engine fuses: MOV then STORE [#A], CMP, INC or DEC then a
+// conditional jump to [#A]
+static const byte fused_firsts[] = {0x01, 0x02, 0x22, 0x23, 0x42, 0x45};
+
+// Mostly registers that exist, now and then anything: faults are part of it. Three out of four
+// jumps land on an instruction so there are loops for the JIT, a third of the fixed addresses
+// point into the program so there's code writing itself. Every so often a pair that gets fused,
+// or a fill or copy loop.
+static std::vector<byte> random_program(std::mt19937& random)
+{
+    std::vector<byte> program;
+    std::vector<uint16_t> starts;
+    std::vector<size_t> jumps, addresses;
+    size_t size = 20 + random() % 200;
+
+    auto add = [&](byte opcode) {
+        const char* operands = "";
+        for (auto& known : fuzz_opcodes) if (known.opcode == opcode) operands = known.operands;
+        starts.push_back(program.size());
+        program.push_back(opcode);
+        for (const char* o = operands; *o; o++) {
+            int r = random() % 20;
+            if (*o == 'A') {
+                bool memory = opcode == 0x03 || opcode == 0x61 || opcode == 0x63;
+                (memory ? addresses : jumps).push_back(program.size());
+                program.push_back(random() % 256);
+            }
+            if (*o == 'R') program.push_back(r < 17 ? random() % REGISTERS : r == 17 ? 0xff : random() % 256);
+            else program.push_back(random() % 256);
+        }
+    };
+
+    while (program.size() < size) {
+        int shape = random() % 16;
+        if (shape == 0) {
+            byte first = fused_firsts[random() % sizeof(fused_firsts)];
+            add(first);
+            add(first <= 0x02 ? 0x61 : 0x24 + 2 * (random() % 6));
+            continue;
+        }
+        if (shape == 1) {
+            // for (; $b != 0; $b++) [$a, $b] = $c, or = [$d, $b] (RAM::fill and RAM::copy)
+            byte page = random() % 4 == 0 ? SCREEN_ADDRESS >> 8 : 0x40 + random() % 0x80;
+            uint16_t loop = program.size() + 6;
+            starts.push_back(program.size());
+            program.insert(program.end(), {0x02, 0x00, page, 0x02, 0x01, (byte)(random() % 4 == 0 ? 0 : random())});
+            if (random() % 2) program.insert(program.end(), {0x60, 0x00, 0x01, 0x02});
+            else program.insert(program.end(), {0x04, 0x02, 0x01, 0x03, 0x60, 0x00, 0x01, 0x02});
+            program.insert(program.end(), {0x42, 0x01, 0x2e, (byte)(loop >> 8), (byte)loop});
+            continue;
+        }
+        add(fuzz_opcodes[random() % (sizeof(fuzz_opcodes) / sizeof(fuzz_opcodes[0]))].opcode);
+    }
+
+    for (size_t at : jumps) {
+        if (random() % 4 == 0) continue;
+        uint16_t target = starts[random() % starts.size()];
+        program[at] = target >> 8;
+        program[at + 1] = target & 0xff;
+    }
+    for (size_t at : addresses) {
+        if (random() % 3 != 0) continue;
+        uint16_t target = random() % program.size();
+        program[at] = target >> 8;
+        program[at + 1] = target & 0xff;
+    }
+    return program;
+}
+
+// In a child process, so an engine crashing is a failed case and not the end of the tests
+static void run_engine(const std::vector<byte>& program, Engine engine, uint64_t slice, EngineRun* run)
+{
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        CPU* cpu = new CPU();
+        for (size_t i = 0; i < program.size(); i++) cpu->ram.write(i, program[i]);
+        cpu->engine = engine;
+
+        int result = -1;
+        try {
+            for (uint64_t done = 0; done < FUZZ_BUDGET && result == -1; done += slice) {
+                result = cpu->execute(slice < FUZZ_BUDGET - done ? slice : FUZZ_BUDGET - done);
+            }
+        }
+        catch (VMFault& f) {
+            result = FUZZ_FAULT + (int)f.code;
+        }
+        run->take(cpu, result);
+        _exit(0);
+    }
+
+    int status = 0;
+    if (child == -1 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        memset(run, 0, sizeof(EngineRun));
+        run->result = FUZZ_DIED + status;
+    }
+}
+
+// Random programs end the same way on every engine: registers, flags, RAM, pc, how it ended
+// (halt code or fault) and the retired count
+static bool engines_agree()
+{
+    const Engine engines[] = {Engine::REFERENCE, Engine::DECODED, Engine::JIT};
+    const int count = sizeof(engines) / sizeof(engines[0]);
+    EngineRun* runs = (EngineRun*)mmap(nullptr, sizeof(EngineRun) * count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (runs == MAP_FAILED) return false;
+
+    std::mt19937 random(FUZZ_SEED);
+    int failures = 0;
+    for (int p = 0; p < FUZZ_PROGRAMS; p++) {
+        std::vector<byte> program = random_program(random);
+        uint64_t slice = 1 + random() % 5000;
+
+        // The reference engine in one go, the others stopping every slice
+        for (int e = 0; e < count; e++) run_engine(program, engines[e], e == 0 ? FUZZ_BUDGET : slice, &runs[e]);
+        for (int e = 1; e < count; e++) {
+            if (runs[e].same(runs[0])) continue;
+            if (failures++ < 5) {
+                printf("  program %d, engine %d: result %d/%d, pc 0x%04x/0x%04x, %llu/%llu instructions\n", p, e,
+                    runs[e].result, runs[0].result, runs[e].pc, runs[0].pc,
+                    (unsigned long long)runs[e].retired, (unsigned long long)runs[0].retired);
+            }
+        }
+    }
+    munmap(runs, sizeof(EngineRun) * count);
+    return failures == 0;
+}
+
+// A group of 8 lanes runs like each of them alone on the reference engine. The lanes get the
+// same program with a byte changed here and there: different immediates keep them together,
+// a different opcode or register drops the lane to its own CPU.
+static bool lockstep_matches_reference()
+{
+    const int lanes = 8;
+    std::vector<EngineRun> alone(lanes), together(lanes);
+    std::mt19937 random(FUZZ_SEED);
+    int failures = 0;
+
+    for (int g = 0; g < FUZZ_GROUPS; g++) {
+        std::vector<byte> program = random_program(random);
+        uint64_t slice = 1 + random() % 5000;
+        CPU* reference[lanes];
+        CPU* cpus[lanes];
+
+        for (int l = 0; l < lanes; l++) {
+            std::vector<byte> lane = program;
+            if (random() % 3 == 0) lane[random() % lane.size()] = random();
+
+            reference[l] = new CPU();
+            cpus[l] = new CPU();
+            for (size_t i = 0; i < lane.size(); i++) {
+                reference[l]->ram.write(i, lane[i]);
+                cpus[l]->ram.write(i, lane[i]);
+            }
+
+            int result = -1;
+            try {
+                result = reference[l]->execute(FUZZ_BUDGET);
+            }
+            catch (VMFault& f) {
+                result = FUZZ_FAULT + (int)f.code;
+            }
+            alone[l].take(reference[l], result);
+        }
+
+        Lockstep<lanes>* group = new Lockstep<lanes>(cpus, lanes);
+        for (uint64_t done = 0; done < FUZZ_BUDGET; done += slice) {
+            if (group->execute(slice < FUZZ_BUDGET - done ? slice : FUZZ_BUDGET - done) == 0) break;
+        }
+
+        for (int l = 0; l < lanes; l++) {
+            LaneStatus status = group->status[l];
+            int result = status == LaneStatus::HALTED ? group->code[l] : status == LaneStatus::FAULTED ? FUZZ_FAULT + group->code[l] : -1;
+            together[l].take(cpus[l], result);
+            if (!together[l].same(alone[l]) && failures++ < 5) {
+                printf("  group %d, lane %d: result %d/%d, pc 0x%04x/0x%04x, %llu/%llu instructions\n", g, l,
+                    together[l].result, alone[l].result, together[l].pc, alone[l].pc,
+                    (unsigned long long)together[l].retired, (unsigned long long)alone[l].retired);
+            }
+        }
+        delete group; // Before its CPUs, it unhooks itself from them
+        for (int l = 0; l < lanes; l++) {
+            delete reference[l];
+            delete cpus[l];
+        }
+    }
+    return failures == 0;
+}
+
+// The compile-time DIV/PWR/SQRT/FSQRT tables against the host math they replaced, every input
+static bool alu_tables_match()
+{
+    return verify_alu_tables(stdout) == 0;
+}
+
+// A CALL and RET with PUSH/POP balanced in between, nothing for the walk to complain about
+static bool cfg_accepts_balanced_call()
+{
+    const byte image[] = {
+        0x50, 0x00, 0x05,   // CALL [0x0005]
+        0xfe, 0x01,         // HALT #1
+        0x30, 0x00,         // PUSH $a
+        0x32, 0x00,         // POP $a
+        0x52,               // RET
+    };
+    ControlFlow flow(image, sizeof(image));
+    return flow.problem == nullptr;
+}
+
+// Pushes a return address by hand and RETs to it, the walk never sees 0x000d
+static bool cfg_rejects_pushed_return()
+{
+    const byte image[] = {0x00, 0x00, 0x00, 0x00, 0x31, 0x0d, 0x31, 0x00, 0x52, 0xfe, 0x01, 0x00, 0x00, 0xfe, 0x2a};
+    ControlFlow flow(image, sizeof(image));
+    return flow.problem != nullptr && flow.problem_pc == 0x0008;
+}
+
+// Same inside a function: the RET goes to what it pushed, not back after the CALL
+static bool cfg_rejects_unbalanced_return()
+{
+    const byte image[] = {
+        0x50, 0x00, 0x05,   // CALL [0x0005]
+        0xfe, 0x01,         // HALT #1
+        0x31, 0x00,         // PUSH #0
+        0x31, 0x0c,         // PUSH #12
+        0x52,               // RET
+        0xfe, 0x00,         // (HALT #0, never walked)
+        0xfe, 0x2a,
+    };
+    ControlFlow flow(image, sizeof(image));
+    return flow.problem != nullptr && flow.problem_pc == 0x0009;
+}
+
+// STORE [$a, $b] with $a:$b worked out to 0x0010, the HALT's operand: it halts with 7, not 1.
+// The optimizer can't move that HALT, it has to give up.
+static bool opt_refuses_self_modifying()
+{
+    const byte image[] = {
+        0x02, 0x00, 0x00,       // MOV $a, #0
+        0x02, 0x01, 0x10,       // MOV $b, #0x10
+        0x62, 0x00, 0x01, 0x07, // STORE [$a, $b], #7
+        0x00, 0x00, 0x00, 0x00, 0x00,
+        0xfe, 0x01,             // HALT #1
+        0xff,
+    };
+    ControlFlow flow(image, sizeof(image));
+    if (flow.problem != nullptr) return false;
+    Optimizer optimizer(flow);
+    optimizer.run();
+    return optimizer.problem != nullptr && optimizer.problem_pc == 0x0006;
+}
+
+// A snapshot taken with the timer running has it running after a restore, to the same CPU
+// (its pending event is from later on) and to a new one (which has none)
+static bool snapshot_keeps_timer()
+{
+    const byte image[] = {
+        0x63, 0xd1, 0x02, 0x00, // STORE [TIMER_PERIOD], #0
+        0x63, 0xd1, 0x03, 0x01, // STORE [TIMER_PERIOD + 1], #1
+        0x63, 0xd1, 0x04, 0x00, // STORE [TIMER_VECTOR], #0
+        0x63, 0xd1, 0x05, 0x19, // STORE [TIMER_VECTOR + 1], #0x19
+        0x63, 0xd1, 0x00, 0x07, // STORE [TIMER_CONTROL], #7 (enabled, repeat, interrupt)
+        0x42, 0x00,             // INC $a
+        0x20, 0x00, 0x14,       // JMP [0x0014]
+        0x42, 0x01,             // INC $b
+        0x63, 0xd1, 0x01, 0x00, // STORE [TIMER_ACKNOWLEDGE], #0
+        0x52,                   // RET
+    };
+    CPU* cpu = new CPU();
+    CPU* other = new CPU();
+    for (size_t i = 0; i < sizeof(image); i++) cpu->ram.write(i, image[i]);
+
+    // Straight on, then from the snapshot on the same CPU and on the other one. What the timer did
+    // shows in $a and $b and on the stack.
+    Snapshot start;
+    std::vector<EngineRun> runs(3);
+    cpu->execute(1000);
+    start.take(cpu);
+    cpu->execute(5000);
+    runs[0].take(cpu, -1);
+
+    start.restore(cpu);
+    cpu->execute(5000);
+    runs[1].take(cpu, -1);
+    start.restore(other);
+    other->execute(5000);
+    runs[2].take(other, -1);
+
+    delete cpu;
+    delete other;
+    return runs[1].same(runs[0]) && runs[2].same(runs[0]);
+}
+
+// Ranges running past 0xffff are refused, the ones ending right at it aren't
+static bool lib_memory_bounds()
+{
+    neodymium_vm* vm = neodymium_create(NEODYMIUM_ENGINE_REFERENCE);
+    uint8_t buffer[4] = {1, 2, 3, 4};
+    bool ok = neodymium_write_memory(vm, 0xfffc, buffer, 4) == 0
+        && neodymium_read_memory(vm, 0xfffc, buffer, 4) == 0 && buffer[3] == 4
+        && neodymium_write_memory(vm, 0xfffd, buffer, 4) == -1
+        && neodymium_read_memory(vm, 0xfffd, buffer, 4) == -1
+        && neodymium_read_memory(vm, 0x0000, buffer, 0x10001) == -1
+        && neodymium_read_memory(vm, 0xffff, buffer, (size_t)-1) == -1;
+    neodymium_destroy(vm);
+    return ok;
+}
+
+// An image over the device pages doesn't set them up: the timer stays off
+static bool lib_load_skips_devices()
+{
+    std::vector<uint8_t> image(TIMER_CONTROL + 1);
+    image[0] = 0xff;                    // HALT
+    image[TIMER_CONTROL] = 0x07;        // Enabled, repeat, interrupt
+    neodymium_vm* vm = neodymium_create(NEODYMIUM_ENGINE_REFERENCE);
+    bool ok = neodymium_load(vm, image.data(), image.size()) == 0
+        && neodymium_read(vm, TIMER_CONTROL) == 0
+        && neodymium_run_for(vm, 100) == NEODYMIUM_HALTED;
+    neodymium_destroy(vm);
+    return ok;
+}
+
+static const struct { const char* name; bool (*run)(); } cases[] = {
+    {"engines_agree",                   engines_agree},
+    {"lockstep_matches_reference",      lockstep_matches_reference},
+    {"alu_tables_match",                alu_tables_match},
+    {"cfg_accepts_balanced_call",       cfg_accepts_balanced_call},
+    {"cfg_rejects_pushed_return",       cfg_rejects_pushed_return},
+    {"cfg_rejects_unbalanced_return",   cfg_rejects_unbalanced_return},
+    {"opt_refuses_self_modifying",      opt_refuses_self_modifying},
+    {"snapshot_keeps_timer",            snapshot_keeps_timer},
+    {"lib_memory_bounds",               lib_memory_bounds},
+    {"lib_load_skips_devices",          lib_load_skips_devices},
+};
+
+int main(int argc, const char* argv[])
+{
+    int failures = 0, ran = 0;
+    for (const auto& c : cases) {
+        if (argc > 1 && strcmp(argv[1], c.name) != 0) continue;
+        ran++;
+        if (!c.run()) {
+            printf("FAILED %s\n", c.name);
+            failures++;
+        }
+    }
+    printf("%d cases, %d failed\n", ran, failures);
+    return ran == 0 ? 1 : failures;
+}